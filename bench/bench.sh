@@ -0,0 +1,188 @@
+#!/bin/bash
+#
+# bench.sh - sweep the stock servers over client counts, order mixes and
+# table sizes on loopback, write the results as CSV and compare them with a
+# baseline recorded on the same machine.
+#
+# usage: bench.sh [-o results.csv] [-b baseline.csv] [-t tolerance%] [-u] [task1|task2 ...]
+#   -o  where to write the results (default bench/results.csv)
+#   -b  baseline to compare against (default bench/baseline.csv)
+#   -t  allowed throughput drop / p99 growth in percent (default 20)
+#   -u  store this run as the new baseline instead of comparing
+#
+# The sweep can be narrowed from the environment:
+#   CLIENTS="1 4 16 64"  MIXES="1:1:1 0:1:1"  SIZES="10 10000"  DURATION=1  RUNS=3
+#
+# Each point is measured RUNS times (default 3), one CSV row per run, and
+# the comparison takes the median of each side: single loopback runs vary by
+# more than the tolerance. Points whose median regressed are measured again
+# with RECHECK_DURATION (default three times DURATION) seconds a run, and only
+# a metric that regresses again counts. The baseline is not kept in the
+# repository, since numbers from another machine say nothing about this one;
+# without one the script only writes the results. Exit status is 1 if any
+# point regressed in both measurements.
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+OUT=$ROOT/bench/results.csv
+BASELINE=$ROOT/bench/baseline.csv
+TOLERANCE=20
+UPDATE=0
+
+CLIENTS=${CLIENTS:-"1 4 16 64"}
+MIXES=${MIXES:-"1:1:1 0:1:1"}
+SIZES=${SIZES:-"10 10000"}
+DURATION=${DURATION:-1}
+RUNS=${RUNS:-3}
+RECHECK_DURATION=${RECHECK_DURATION:-$(awk -v d="$DURATION" 'BEGIN { print d * 3 }')}
+THREADS=${THREADS:-4}
+PORT=${PORT:-19000}
+SEED=${SEED:-1}
+
+HEADER="task,stocks,mix,clients,orders,failed,seconds,ops_per_sec,p50_us,p90_us,p99_us,p999_us,max_us"
+
+while getopts "o:b:t:u" opt; do
+    case $opt in
+        o) OUT=$OPTARG ;;
+        b) BASELINE=$OPTARG ;;
+        t) TOLERANCE=$OPTARG ;;
+        u) UPDATE=1 ;;
+        *) sed -n '3,23p' "$0"; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+TASKS=${*:-"task1 task2"}
+
+WORK=$(mktemp -d)
+SERVER_PID=
+cleanup() {
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null && wait "$SERVER_PID" 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+# Stock ids 1..n in random order so the tree is not a linked list
+gen_stock() {
+    seq 1 "$1" | awk -v seed="$SEED" 'BEGIN { srand(seed) } { print rand(), $1 }' \
+        | sort -k1,1 | awk '{ print $2, 1000000, 1000 + $2 % 9000 }'
+}
+
+wait_port() {
+    for _ in $(seq 1 100); do
+        (exec 3<>/dev/tcp/127.0.0.1/"$1") 2>/dev/null && return 0
+        sleep 0.05
+    done
+    echo "server on port $1 did not come up" >&2
+    return 1
+}
+
+# Measure every point, or only the task,stocks,mix,clients keys listed in $2
+sweep() {
+    local out=$1 only=$2 task size mix clients row
+
+    echo "$HEADER" > "$out"
+    for task in $TASKS; do
+        make -s -C "$ROOT/$task" multiclient stockserver
+        for size in $SIZES; do
+            if [ -n "$only" ] && ! grep -q "^$task,$size," "$only"; then
+                continue
+            fi
+            PORT=$((PORT + 1))
+            mkdir -p "$WORK/$task"
+            gen_stock "$size" > "$WORK/$task/stock.txt"
+            (cd "$WORK/$task" && STOCK_LOG=off STOCK_STATS_INTERVAL=0 \
+                exec "$ROOT/$task/stockserver" "$PORT" > /dev/null 2>&1) &
+            SERVER_PID=$!
+            wait_port "$PORT"
+
+            for mix in $MIXES; do
+                for clients in $CLIENTS; do
+                    if [ -n "$only" ] && ! grep -qxF "$task,$size,$mix,$clients" "$only"; then
+                        continue
+                    fi
+                    for _ in $(seq 1 "$RUNS"); do
+                        row=$("$ROOT/$task/multiclient" 127.0.0.1 "$PORT" "$clients" -c \
+                              -t "$THREADS" -d "$DURATION" -m "$mix" -k "$size" -s "$SEED")
+                        if [ -z "$row" ]; then
+                            echo "multiclient failed: $task stocks=$size mix=$mix clients=$clients" >&2
+                            exit 1
+                        fi
+                        echo "$task,$size,$mix,$row" | tee -a "$out"
+                    done
+                done
+            done
+
+            kill "$SERVER_PID"
+            wait "$SERVER_PID" 2>/dev/null || true
+            SERVER_PID=
+        done
+    done
+}
+
+# Points are matched on task,stocks,mix,clients and compared by their medians;
+# prints one line per regressed metric, led by the point's key and the metric
+compare() {
+    awk -F, -v tol="$TOLERANCE" '
+        function median(list,    v, n, i, j, t) {
+            n = split(list, v, " ")
+            for (i = 2; i <= n; i++)
+                for (j = i; j > 1 && v[j - 1] + 0 > v[j] + 0; j--) {
+                    t = v[j]; v[j] = v[j - 1]; v[j - 1] = t
+                }
+            return n % 2 ? v[(n + 1) / 2] : (v[n / 2] + v[n / 2 + 1]) / 2
+        }
+        FNR == 1 { next }
+        {
+            key = $1","$2","$3","$4
+            side = NR == FNR ? "base" : "new"
+            tput[side, key] = tput[side, key] " " $8
+            p99[side, key] = p99[side, key] " " $11
+            if (side == "new" && !(key in seen)) { seen[key] = 1; order[++n] = key }
+        }
+        END {
+            for (i = 1; i <= n; i++) {
+                key = order[i]
+                if (!(("base", key) in tput)) continue
+                bt = median(tput["base", key]); nt = median(tput["new", key])
+                bp = median(p99["base", key]); np = median(p99["new", key])
+                if (nt < bt * (1 - tol / 100))
+                    printf "%s throughput %.1f -> %.1f ops/s\n", key, bt, nt
+                if (np > bp * (1 + tol / 100))
+                    printf "%s p99 %.1f -> %.1f us\n", key, bp, np
+            }
+        }
+    ' "$1" "$2"
+}
+
+sweep "$OUT" ""
+
+if [ "$UPDATE" = 1 ]; then
+    cp "$OUT" "$BASELINE"
+    echo "baseline updated: $BASELINE"
+    exit 0
+fi
+if [ ! -f "$BASELINE" ]; then
+    echo "no baseline at $BASELINE (run with -u to create one)"
+    exit 0
+fi
+
+compare "$BASELINE" "$OUT" > "$WORK/suspect"
+if [ ! -s "$WORK/suspect" ]; then
+    echo "no regressions against baseline"
+    exit 0
+fi
+sed 's/^/suspect /' "$WORK/suspect"
+cut -d' ' -f1 "$WORK/suspect" | sort -u > "$WORK/keys"
+echo "measuring $(wc -l < "$WORK/keys") points again"
+DURATION=$RECHECK_DURATION sweep "$WORK/recheck.csv" "$WORK/keys" > /dev/null
+compare "$BASELINE" "$WORK/recheck.csv" > "$WORK/again"
+cut -d' ' -f1,2 "$WORK/suspect" > "$WORK/metrics"
+awk 'NR == FNR { s[$1" "$2] = 1; next } ($1" "$2) in s' "$WORK/metrics" "$WORK/again" \
+    > "$WORK/regressed"
+if [ ! -s "$WORK/regressed" ]; then
+    echo "no regressions against baseline (suspects did not repeat)"
+    exit 0
+fi
+sed 's/^/REGRESSION /' "$WORK/regressed"
+exit 1
@@ -0,0 +1,54 @@
+/* $begin account.h */
+#ifndef __ACCOUNT_H__
+#define __ACCOUNT_H__
+
+#include <stddef.h>
+#include <semaphore.h>
+
+/*
+ * Client accounts: a cash balance and a position per stock. A connection
+ * that sends "login <account>" trades for that account: a buy needs the
+ * cash for qty * price and moves the shares into the position, a sell
+ * needs the shares and pays qty * price back. Connections that never log
+ * in trade against the server's inventory alone, as before.
+ *
+ * Accounts are looked up in an open-addressing index keyed by account id
+ * only at login; the connection keeps the account_t pointer, and accounts
+ * are never freed, so a trade goes straight to its account. An account's
+ * positions are a second open-addressing table keyed by stock id with
+ * 8-byte slots, so a trade touches the account header and one slot.
+ *
+ * An account is not thread-safe: callers that trade on it from several
+ * threads hold its lock from the check to the update.
+ */
+
+#define ACCT_FILE       "accounts.txt"  /* Saved next to stock.txt */
+#define ACCT_MIN_SLOTS  16              /* Initial position table size */
+#define ACCT_ROW_MAX    24              /* Longest position row of a report */
+
+typedef struct {
+    int stock;                      /* ACCT_FREE in an empty slot */
+    int qty;
+} acct_pos_t;
+
+typedef struct _account_ {
+    sem_t lock;                     /* Serializes trades on the account */
+    int id;
+    long cash;
+    acct_pos_t *pos;                /* Power of two slots, linear probing */
+    unsigned cap, used;
+} account_t;
+
+extern long acct_open_cash;         /* Cash of an account opened by login */
+
+void acct_config(void);
+int acct_load(const char *path);
+int acct_save(const char *path);
+account_t *acct_login(int id);
+int acct_held(const account_t *a, int stock);
+const char *acct_check(const account_t *a, int stock, long delta, int price);
+void acct_trade(account_t *a, int stock, long delta, int price);
+int acct_report(account_t *a, char *buf, size_t cap);
+
+#endif /* __ACCOUNT_H__ */
+/* $end account.h */
@@ -0,0 +1,194 @@
+/*
+ * bookbench.c - matching engine microbenchmark
+ *
+ * Replays a synthetic order stream against the books in book.c without any
+ * networking. The stream is generated up front so only the engine is timed:
+ * limit orders priced around a per-book mid that drifts in a random walk,
+ * a share of market orders, and cancels of recently rested orders.
+ * Every 16th operation is timed individually for the latency percentiles.
+ */
+#include "csapp.h"
+#include "book.h"
+#include "hist.h"
+#include <time.h>
+
+#define RECENT 4096		/* Rested orders cancels pick from */
+#define SAMPLE_MASK 15		/* Time one operation in 16 */
+
+enum { OP_LIMIT, OP_MARKET, OP_CANCEL };
+
+typedef struct {
+	int type;
+	int book;
+	int side;
+	int qty;
+	int price;
+	int pick;		/* OP_CANCEL: slot of the recent-order ring */
+} op_t;
+
+typedef struct {
+	long orders;
+	int books;
+	int cancel_pct;
+	int market_pct;
+	int spread;		/* Limit prices fall within mid +- spread */
+	int qty_max;
+	uint64_t seed;
+	int csv;
+} config_t;
+
+static config_t cfg = { 5000000, 1, 30, 5, 50, 100, 1, 0 };
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t next_rand(uint64_t *s)
+{
+	uint64_t z = (*s += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-n orders] [-b books] [-p cancel%%] [-m market%%]\n"
+		"       [-w spread] [-q max_qty] [-s seed] [-c]\n", prog);
+	exit(1);
+}
+
+static op_t *generate(void)
+{
+	op_t *ops = Malloc(cfg.orders * sizeof(op_t));
+	int *mid = Malloc(cfg.books * sizeof(int));
+	uint64_t rng = cfg.seed;
+	long i;
+
+	for (i = 0; i < cfg.books; i++)
+		mid[i] = 10000;
+	for (i = 0; i < cfg.orders; i++) {
+		op_t *op = &ops[i];
+		int r = next_rand(&rng) % 100;
+
+		op->book = next_rand(&rng) % cfg.books;
+		op->side = next_rand(&rng) & 1;
+		op->qty = 1 + next_rand(&rng) % cfg.qty_max;
+		op->pick = next_rand(&rng) % RECENT;
+		if (r < cfg.cancel_pct) {
+			op->type = OP_CANCEL;
+		} else if (r < cfg.cancel_pct + cfg.market_pct) {
+			op->type = OP_MARKET;
+			op->price = 0;
+		} else {
+			op->type = OP_LIMIT;
+			op->price = mid[op->book] - cfg.spread
+				+ next_rand(&rng) % (2 * cfg.spread + 1);
+			if (op->price < 1)
+				op->price = 1;
+		}
+		if ((i & 63) == 0)
+			mid[op->book] += (int)(next_rand(&rng) % 3) - 1;
+	}
+	Free(mid);
+	return ops;
+}
+
+int main(int argc, char **argv)
+{
+	book_t **books;
+	op_t *ops;
+	hist_t *lat = Calloc(1, sizeof(hist_t));
+	struct { int book; unsigned oid; } recent[RECENT];
+	long i, fills = 0, fill_qty = 0, cancels = 0;
+	size_t resting = 0;
+	uint64_t t0, t1, s;
+	double secs;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:b:p:m:w:q:s:c")) != -1) {
+		switch (c) {
+		case 'n': cfg.orders = atol(optarg); break;
+		case 'b': cfg.books = atoi(optarg); break;
+		case 'p': cfg.cancel_pct = atoi(optarg); break;
+		case 'm': cfg.market_pct = atoi(optarg); break;
+		case 'w': cfg.spread = atoi(optarg); break;
+		case 'q': cfg.qty_max = atoi(optarg); break;
+		case 's': cfg.seed = strtoull(optarg, NULL, 10); break;
+		case 'c': cfg.csv = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (cfg.orders <= 0 || cfg.books <= 0 || cfg.spread <= 0 || cfg.qty_max <= 0
+	    || cfg.cancel_pct + cfg.market_pct > 100)
+		usage(argv[0]);
+
+	ops = generate();
+	books = Malloc(cfg.books * sizeof(book_t *));
+	for (i = 0; i < cfg.books; i++)
+		books[i] = book_create();
+	memset(recent, 0, sizeof(recent));
+
+	t0 = now_ns();
+	for (i = 0; i < cfg.orders; i++) {
+		op_t *op = &ops[i];
+		book_result_t res;
+
+		s = (i & SAMPLE_MASK) ? 0 : now_ns();
+		if (op->type == OP_CANCEL) {
+			if (recent[op->pick].oid
+			    && book_cancel(books[recent[op->pick].book], recent[op->pick].oid) >= 0)
+				cancels++;
+			recent[op->pick].oid = 0;
+		} else {
+			book_submit(books[op->book], op->side, op->qty, op->price, &res);
+			if (res.filled) {
+				fills++;
+				fill_qty += res.filled;
+			}
+			if (res.oid) {
+				recent[i & (RECENT - 1)].book = op->book;
+				recent[i & (RECENT - 1)].oid = res.oid;
+			}
+		}
+		if (s)
+			hist_record(lat, now_ns() - s);
+	}
+	t1 = now_ns();
+
+	for (i = 0; i < cfg.books; i++) {
+		resting += book_resting(books[i]);
+		book_destroy(books[i]);
+	}
+	secs = (t1 - t0) / 1e9;
+
+	if (cfg.csv) {
+		printf("%ld,%d,%.3f,%.0f,%ld,%lu,%lu,%lu,%lu\n", cfg.orders, cfg.books,
+		       secs, cfg.orders / secs, fills,
+		       (unsigned long)hist_percentile(lat, 0.50),
+		       (unsigned long)hist_percentile(lat, 0.99),
+		       (unsigned long)hist_percentile(lat, 0.999),
+		       (unsigned long)lat->max);
+	} else {
+		printf("%ld orders on %d books in %.3f s: %.0f orders/sec\n",
+		       cfg.orders, cfg.books, secs, cfg.orders / secs);
+		printf("matched %ld orders (%ld shares), cancelled %ld, %zu left resting\n",
+		       fills, fill_qty, cancels, resting);
+		printf("latency ns (1 in %d sampled): p50 %lu  p99 %lu  p99.9 %lu  max %lu\n",
+		       SAMPLE_MASK + 1,
+		       (unsigned long)hist_percentile(lat, 0.50),
+		       (unsigned long)hist_percentile(lat, 0.99),
+		       (unsigned long)hist_percentile(lat, 0.999),
+		       (unsigned long)lat->max);
+	}
+	Free(ops);
+	Free(books);
+	Free(lat);
+	return 0;
+}
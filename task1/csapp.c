@@ -879,6 +879,35 @@ ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_getline - View of the next buffered line (no copy, no read)
+ *    Finds the newline with memchr instead of moving one byte at a time,
+ *    points *linep at the line inside the internal buffer and consumes it.
+ *    The view keeps its newline, is not terminated, and stays valid until
+ *    the buffer is refilled. Like rio_readlineb, a line longer than
+ *    maxlen-1 bytes comes back in pieces. Returns the line's length, or 0
+ *    if no whole line is buffered; with eof set, the unfinished rest is
+ *    returned as the last line.
+ */
+/* $begin rio_getline */
+ssize_t rio_getline(rio_t *rp, char **linep, size_t maxlen, int eof)
+{
+    size_t cnt = rp->rio_cnt;
+    char *nl;
+
+    if (cnt > maxlen - 1)
+        cnt = maxlen - 1;
+    if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+        cnt = nl - rp->rio_bufptr + 1;
+    else if (cnt < maxlen - 1 && rp->rio_cnt < RIO_BUFSIZE && !eof)
+        return 0;               /* Line not finished yet */
+    *linep = rp->rio_bufptr;
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    return cnt;
+}
+/* $end rio_getline */
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -893,8 +922,14 @@ ssize_t Rio_readn(int fd, void *ptr, size_t nbytes)
 
 void Rio_writen(int fd, void *usrbuf, size_t n) 
 {
-    if (rio_writen(fd, usrbuf, n) != n)
+    if (rio_writen(fd, usrbuf, n) != n) {
+	/* A client that left or stopped reading loses its connection, not the server */
+	if (errno == EPIPE || errno == ECONNRESET || errno == EAGAIN || errno == EWOULDBLOCK) {
+	    shutdown(fd, SHUT_RDWR);
+	    return;
+	}
 	unix_error("Rio_writen error");
+    }
 }
 
 void Rio_readinitb(rio_t *rp, int fd)
@@ -1012,6 +1047,63 @@ int open_listenfd(char *port)
 }
 /* $end open_listenfd */
 
+/*
+ * open_unix_clientfd - Open connection to the server listening on the
+ *     Unix domain socket at path.
+ *
+ *     On error, returns -1 and sets errno.
+ */
+int open_unix_clientfd(char *path)
+{
+    struct sockaddr_un addr;
+    int clientfd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((clientfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(clientfd, (SA *)&addr, sizeof(addr)) < 0) {
+        Close(clientfd);
+        return -1;
+    }
+    return clientfd;
+}
+
+/*
+ * open_unix_listenfd - Open and return a listening Unix domain socket at
+ *     path, replacing whatever a previous run left there.
+ *
+ *     On error, returns -1 and sets errno.
+ */
+int open_unix_listenfd(char *path)
+{
+    struct sockaddr_un addr;
+    int listenfd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    unlink(path);
+    if (bind(listenfd, (SA *)&addr, sizeof(addr)) < 0 || listen(listenfd, LISTENQ) < 0) {
+        Close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
 /****************************************************
  * Wrappers for reentrant protocol-independent helpers
  ****************************************************/
@@ -1033,6 +1125,24 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_unix_clientfd(char *path)
+{
+    int rc;
+
+    if ((rc = open_unix_clientfd(path)) < 0)
+	unix_error("Open_unix_clientfd error");
+    return rc;
+}
+
+int Open_unix_listenfd(char *path)
+{
+    int rc;
+
+    if ((rc = open_unix_listenfd(path)) < 0)
+	unix_error("Open_unix_listenfd error");
+    return rc;
+}
+
 /* $end csapp.c */
 
 
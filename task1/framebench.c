@@ -0,0 +1,225 @@
+/*
+ * framebench.c - request line framing microbenchmark
+ *
+ * A writer thread streams a synthetic pipelined command stream (buy, sell,
+ * show, order and book requests with random ids) over a Unix socket pair
+ * in large writes, the way a client that pipelines its requests fills the
+ * server's socket buffer. The reader splits the stream into lines each way
+ * a server can:
+ *
+ *   readlineb   Rio_readlineb, one rio_read call per byte, copying
+ *   getline     rio_getline views found with memchr, as the servers frame
+ *   getline+cp  the same plus the one copy a server makes to parse a line
+ *
+ * Every mode must find the same number of lines and bytes, which are
+ * checked against the generated stream.
+ */
+#include "csapp.h"
+#include <time.h>
+
+enum { M_READLINEB, M_GETLINE, M_GETLINE_COPY, M_COUNT };
+
+typedef struct {
+	long mb;		/* Stream size */
+	int chunk;		/* Bytes per write of the writer */
+	int rounds;
+	uint64_t seed;
+	int modes;		/* Bit per M_* mode to run */
+	int csv;
+} config_t;
+
+static config_t cfg = { 64, 65536, 3, 1, 7, 0 };
+static const char *mode_name[] = { "readlineb", "getline", "getline+cp" };
+
+static char *stream;
+static size_t stream_len;
+static long stream_lines;
+static volatile long sink;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t next_rand(uint64_t *s)
+{
+	uint64_t z = (*s += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-b MB] [-w write_size] [-r rounds]\n"
+		"       [-m readlineb,getline,getline+cp] [-s seed] [-c]\n", prog);
+	exit(1);
+}
+
+/* The command mix of a pipelining trading client */
+static void generate(void)
+{
+	size_t cap = cfg.mb << 20;
+	uint64_t rng = cfg.seed;
+	char line[128];
+	int n, r;
+
+	stream = Malloc(cap);
+	while (1) {
+		r = next_rand(&rng) % 100;
+		if (r < 40)
+			n = sprintf(line, "buy %d %d\n", (int)(next_rand(&rng) % 100000),
+				    (int)(next_rand(&rng) % 100) + 1);
+		else if (r < 80)
+			n = sprintf(line, "sell %d %d\n", (int)(next_rand(&rng) % 100000),
+				    (int)(next_rand(&rng) % 100) + 1);
+		else if (r < 95)
+			n = sprintf(line, "order %s %d %d %d\n", r & 1 ? "buy" : "sell",
+				    (int)(next_rand(&rng) % 100000),
+				    (int)(next_rand(&rng) % 100) + 1,
+				    (int)(next_rand(&rng) % 20000));
+		else if (r < 98)
+			n = sprintf(line, "book %d\n", (int)(next_rand(&rng) % 100000));
+		else
+			n = sprintf(line, "show\n");
+		if (stream_len + n > cap)
+			break;
+		memcpy(stream + stream_len, line, n);
+		stream_len += n;
+		stream_lines++;
+	}
+}
+
+static void *writer(void *vargp)
+{
+	int fd = *(int *)vargp;
+	size_t off, n;
+
+	for (off = 0; off < stream_len; off += n) {
+		n = stream_len - off < (size_t)cfg.chunk ? stream_len - off : (size_t)cfg.chunk;
+		Rio_writen(fd, stream + off, n);
+	}
+	Close(fd);
+	return NULL;
+}
+
+/* The servers' refill: one read() behind what is still unread */
+static ssize_t fill(rio_t *rp)
+{
+	ssize_t n;
+
+	if (rp->rio_cnt)
+		memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+	rp->rio_bufptr = rp->rio_buf;
+	while ((n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt, RIO_BUFSIZE - rp->rio_cnt)) < 0
+	       && errno == EINTR)
+		;
+	if (n > 0)
+		rp->rio_cnt += n;
+	return n;
+}
+
+static void run(int mode)
+{
+	static rio_t rio;
+	char buf[MAXLINE], *line;
+	int sv[2];
+	pthread_t tid;
+	uint64_t t0, t1;
+	long lines = 0, bytes = 0, sum = 0;
+	ssize_t n;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		unix_error("socketpair error");
+	Pthread_create(&tid, NULL, writer, &sv[1]);
+	Rio_readinitb(&rio, sv[0]);
+
+	t0 = now_ns();
+	if (mode == M_READLINEB) {
+		while ((n = Rio_readlineb(&rio, buf, MAXLINE)) > 0) {
+			lines++;
+			bytes += n;
+			sum += buf[0];
+		}
+	} else {
+		while (1) {
+			while ((n = rio_getline(&rio, &line, MAXLINE, 0)) > 0) {
+				if (mode == M_GETLINE_COPY) {
+					memcpy(buf, line, n);
+					buf[n] = '\0';
+					line = buf;
+				}
+				lines++;
+				bytes += n;
+				sum += line[0];
+			}
+			if ((n = fill(&rio)) < 0)
+				unix_error("read error");
+			if (n == 0) {
+				if ((n = rio_getline(&rio, &line, MAXLINE, 1)) > 0) {
+					lines++;
+					bytes += n;
+					sum += line[0];
+				}
+				break;
+			}
+		}
+	}
+	t1 = now_ns();
+	Pthread_join(tid, NULL);
+	Close(sv[0]);
+	sink = sum;
+
+	if (lines != stream_lines || bytes != (long)stream_len)
+		app_error("framing lost or split lines");
+	if (cfg.csv)
+		printf("%s,%zu,%ld,%d,%.1f,%.1f\n", mode_name[mode], stream_len, lines, cfg.chunk,
+		       stream_len / 1e6 / ((t1 - t0) / 1e9), (double)(t1 - t0) / lines);
+	else
+		printf("%-10s %8.1f MB/s  %6.1f ns/line\n", mode_name[mode],
+		       stream_len / 1e6 / ((t1 - t0) / 1e9), (double)(t1 - t0) / lines);
+}
+
+int main(int argc, char **argv)
+{
+	int c, i, m;
+	char *tok;
+
+	while ((c = getopt(argc, argv, "b:w:r:m:s:c")) != -1) {
+		switch (c) {
+		case 'b': cfg.mb = atol(optarg); break;
+		case 'w': cfg.chunk = atoi(optarg); break;
+		case 'r': cfg.rounds = atoi(optarg); break;
+		case 'm':
+			cfg.modes = 0;
+			for (tok = strtok(optarg, ","); tok; tok = strtok(NULL, ","))
+				for (m = 0; m < M_COUNT; m++)
+					if (!strcmp(tok, mode_name[m]))
+						cfg.modes |= 1 << m;
+			break;
+		case 's': cfg.seed = strtoull(optarg, NULL, 10); break;
+		case 'c': cfg.csv = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (cfg.mb <= 0 || cfg.chunk <= 0 || cfg.rounds <= 0 || !cfg.modes)
+		usage(argv[0]);
+	Signal(SIGPIPE, SIG_IGN);
+
+	generate();
+	if (!cfg.csv)
+		printf("%.1f MB, %ld lines, %d byte writes\n", stream_len / 1e6, stream_lines,
+		       cfg.chunk);
+	/* mode,bytes,lines,write_size,mb_per_s,ns_per_line */
+	for (i = 0; i < cfg.rounds; i++)
+		for (m = 0; m < M_COUNT; m++)
+			if (cfg.modes & (1 << m))
+				run(m);
+	Free(stream);
+	return 0;
+}
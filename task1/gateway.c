@@ -0,0 +1,787 @@
+/*
+ * gateway.c - route stock requests to sharded stock servers
+ *
+ *   gateway [-c conns] <port> <host:port>...     serve clients on port
+ *   gateway -s <stock file> <host:port>...        split a table and exit
+ *
+ * Clients speak the stock server protocol to the gateway. A request naming
+ * a stock goes to the backend that owns its id on a consistent-hash ring of
+ * GW_VNODES points per backend, so adding a backend moves only its share of
+ * the ids. show goes to every backend and their id-ordered replies are
+ * merged into one; so does top, whose replies are merged by rank. A basket
+ * is forwarded whole when all its stocks share a backend and refused
+ * otherwise, since no backend could make it atomic. -s writes <file>.0 ..
+ * <file>.n-1, the stocks each backend owns, for the backends to load as
+ * their stock.txt.
+ *
+ * Each backend has a few persistent connections, and a stock always uses
+ * the same one. The requests a pass of the event loop routes to a
+ * connection are written in one send, and since a server answers in order,
+ * replies are matched to the requests queued on their connection. A
+ * client may have GW_PIPE requests in flight; its replies are sent in the
+ * order of its requests, whichever backend answers first.
+ */
+#include "csapp.h"
+#include "log.h"
+#include "basket.h"
+#include "rank.h"
+#include <limits.h>
+#include <netinet/tcp.h>
+
+#define GW_VNODES       160         /* Ring points per backend */
+#define GW_CONNS        2           /* Default connections per backend */
+#define GW_PIPE         64          /* Requests in flight per client */
+#define GW_INBUF        (8 * MAXLINE)
+#define GW_RETRY_MS     1000        /* A backend that failed is retried this often */
+#define SHOW_ROW_MAX    36          /* As in the servers: a show reply this full may be cut */
+#define MAXARGS         (2 + 3 * BASKET_MAX)    /* As in the servers */
+
+typedef struct req {
+    struct req *next;               /* Free list */
+    int client;                     /* Slot of the client, -1 once it is gone */
+    int left;                       /* Replies still to come */
+    char *part;                     /* show, top: a MAXLINE reply per backend, else NULL */
+    int rank;                       /* top: column ranked by (1 amount, 2 price), else 0 */
+    int count;                      /* top: rows asked for */
+    char reply[MAXLINE];
+} req_t;
+
+typedef struct {
+    req_t *req;
+    int part;                       /* Which backend's reply it is, for show */
+} pend_t;
+
+typedef struct {                    /* A connection to a backend */
+    int fd;                         /* -1 while down */
+    pend_t *q;                      /* Requests written, oldest first */
+    int qhead, qlen, qcap;
+    char in[GW_INBUF];              /* Replies read so far */
+    int inlen;
+    char *out;                      /* Requests not written yet */
+    size_t outoff, outlen, outcap;
+} bconn_t;
+
+typedef struct {
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+    bconn_t *conns;
+    uint64_t retry;                 /* When a failed backend may be tried again */
+    unsigned long routed;
+} backend_t;
+
+typedef struct {
+    int fd;                         /* -1 for a free slot */
+    int eof;                        /* Sent all its requests; closed once answered */
+    rio_t rio;
+    req_t *ring[GW_PIPE];           /* Requests in flight, oldest first */
+    int rhead, rlen;
+    char *out;                      /* Replies not written yet */
+    size_t outoff, outlen, outcap;
+} client_t;
+
+static backend_t *backends;
+static int nbackends, nconns = GW_CONNS;
+static client_t *clients;
+static int maxclient = -1, nclients = 0;
+static req_t *freeReqs = NULL;
+
+static void close_client(int ci);
+
+static struct { uint64_t point; int backend; } *ring;
+static int npoints;
+
+static uint64_t now_ms(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t mix64(uint64_t z) {
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static int cmp_point(const void *a, const void *b) {
+
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* GW_VNODES points per backend, hashed from its address so every gateway agrees */
+static void build_ring(void) {
+
+    char name[NI_MAXHOST + NI_MAXSERV + 16], *c;
+    uint64_t h;
+    int b, v;
+
+    ring = Malloc(nbackends * GW_VNODES * sizeof(*ring));
+    for (b = 0; b < nbackends; b++) {
+        for (v = 0; v < GW_VNODES; v++) {
+            sprintf(name, "%s:%s#%d", backends[b].host, backends[b].port, v);
+            for (h = 0xcbf29ce484222325ULL, c = name; *c; c++)
+                h = (h ^ (unsigned char)*c) * 0x100000001b3ULL;
+            ring[npoints].point = mix64(h);
+            ring[npoints].backend = b;
+            npoints++;
+        }
+    }
+    qsort(ring, npoints, sizeof(*ring), cmp_point);
+}
+
+/* The backend owning id: the first ring point at or after the id's hash */
+static int owner(int id) {
+
+    uint64_t h = mix64((uint64_t)(unsigned)id + 0x9e3779b97f4a7c15ULL);
+    int lo = 0, hi = npoints;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].point < h) lo = mid + 1;
+        else hi = mid;
+    }
+    return ring[lo == npoints ? 0 : lo].backend;
+}
+
+static void grow(char **buf, size_t *cap, size_t need) {
+
+    size_t n = *cap ? *cap : 4096;
+
+    if (need <= *cap) return;
+    while (n < need) n *= 2;
+    *buf = Realloc(*buf, n);
+    *cap = n;
+}
+
+static void out_append(char **out, size_t *off, size_t *len, size_t *cap,
+                       const char *p, size_t n) {
+
+    if (*off && *len + n > *cap) {
+        memmove(*out, *out + *off, *len - *off);
+        *len -= *off;
+        *off = 0;
+    }
+    grow(out, cap, *len + n);
+    memcpy(*out + *len, p, n);
+    *len += n;
+}
+
+/* Write what the socket takes without blocking; -1 if the connection is broken */
+static int out_flush(int fd, char *out, size_t *off, size_t *len) {
+
+    ssize_t n;
+
+    while (*off < *len) {
+        n = send(fd, out + *off, *len - *off, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        *off += n;
+    }
+    if (*off == *len)
+        *off = *len = 0;
+    return *len - *off;
+}
+
+static req_t *req_new(int client, int show) {
+
+    req_t *r = freeReqs;
+
+    if (r) freeReqs = r->next;
+    else r = Malloc(sizeof(req_t));
+    r->client = client;
+    r->left = show ? nbackends : 1;
+    r->part = show ? Malloc(nbackends * MAXLINE) : NULL;
+    r->rank = 0;
+    return r;
+}
+
+static void req_free(req_t *r) {
+
+    Free(r->part);
+    r->next = freeReqs;
+    freeReqs = r;
+}
+
+static const char *last_row(const char *text, size_t len) {
+
+    const char *p = text + len - 1;
+
+    while (p > text && p[-1] != '\n')
+        p--;
+    return p;
+}
+
+static long last_id(const char *text, size_t len) {
+    return strtol(last_row(text, len), NULL, 10);
+}
+
+/*
+ * Merge the backends' show replies, each ascending by id, into one. A reply
+ * that filled its block was cut by its server, so rows past its last id
+ * could be missing from the merge: the merged reply stops there too.
+ */
+static void merge_show(req_t *r) {
+
+    char *head[nbackends], *nl, *end;
+    long id, best, bound = LONG_MAX;
+    int b, k, len = 0;
+    size_t n;
+
+    for (b = 0; b < nbackends; b++) {
+        head[b] = r->part + b * MAXLINE;
+        n = strnlen(head[b], MAXLINE);
+        if (n >= MAXLINE - SHOW_ROW_MAX && last_id(head[b], n) < bound)
+            bound = last_id(head[b], n);
+    }
+    memset(r->reply, '\0', MAXLINE);
+    while (1) {
+        for (k = -1, b = 0, best = LONG_MAX; b < nbackends; b++) {
+            if (!head[b] || !*head[b]) continue;
+            id = strtol(head[b], &end, 10);
+            if (end == head[b]) {
+                head[b] = NULL;     /* An error instead of rows */
+                continue;
+            }
+            if (id < best) {
+                best = id;
+                k = b;
+            }
+        }
+        if (k < 0 || best > bound)
+            break;
+        nl = strchr(head[k], '\n');
+        n = nl ? nl - head[k] + 1 : strlen(head[k]);
+        if (len + n >= MAXLINE)
+            break;
+        memcpy(r->reply + len, head[k], n);
+        len += n;
+        head[k] += n;
+    }
+}
+
+/* Whether row a comes before row b of a top reply ranked by column col */
+static int ranks_before(const char *a, const char *b, int col) {
+
+    long x[3] = {0}, y[3] = {0};
+
+    sscanf(a, "%ld %ld %ld", &x[0], &x[1], &x[2]);
+    sscanf(b, "%ld %ld %ld", &y[0], &y[1], &y[2]);
+    return x[col] > y[col] || (x[col] == y[col] && x[0] < y[0]);
+}
+
+/*
+ * Merge the backends' top replies, each ranked by the column, into the
+ * first count rows. As with show, a reply its server cut bounds the merge:
+ * rows ranked after its last one could be missing.
+ */
+static void merge_top(req_t *r) {
+
+    const char *head[nbackends], *bound = NULL, *last, *nl;
+    int b, k, n = r->count, len = 0;
+    size_t m;
+
+    for (b = 0; b < nbackends; b++) {
+        head[b] = r->part + b * MAXLINE;
+        m = strnlen(head[b], MAXLINE);
+        if (m && !isdigit((unsigned char)*head[b]))
+            head[b] = NULL;     /* An error instead of rows */
+        else if (m >= MAXLINE - SHOW_ROW_MAX) {
+            last = last_row(head[b], m);
+            if (!bound || ranks_before(last, bound, r->rank))
+                bound = last;
+        }
+    }
+    memset(r->reply, '\0', MAXLINE);
+    while (n-- > 0) {
+        for (k = -1, b = 0; b < nbackends; b++)
+            if (head[b] && *head[b] && (k < 0 || ranks_before(head[b], head[k], r->rank)))
+                k = b;
+        if (k < 0 || (bound && ranks_before(bound, head[k], r->rank)))
+            break;
+        nl = strchr(head[k], '\n');
+        m = nl ? nl - head[k] + 1 : strlen(head[k]);
+        if (len + m >= MAXLINE)
+            break;
+        memcpy(r->reply + len, head[k], m);
+        len += m;
+        head[k] += m;
+    }
+}
+
+/* Send the client its finished replies, in the order it asked */
+static void drain_client(client_t *c) {
+
+    req_t *r;
+
+    while (c->rlen && (r = c->ring[c->rhead])->left == 0) {
+        if (r->rank)
+            merge_top(r);
+        else if (r->part)
+            merge_show(r);
+        out_append(&c->out, &c->outoff, &c->outlen, &c->outcap, r->reply, MAXLINE);
+        c->rhead = (c->rhead + 1) % GW_PIPE;
+        c->rlen--;
+        req_free(r);
+    }
+    if (c->outlen > c->outoff && out_flush(c->fd, c->out, &c->outoff, &c->outlen) < 0)
+        close_client(c - clients);
+    else if (c->eof && !c->rlen && c->outlen == c->outoff)
+        close_client(c - clients);
+}
+
+/* One reply for a request arrived; a client that is gone just drops it */
+static void complete(pend_t *pd, const char *reply) {
+
+    req_t *r = pd->req;
+
+    memcpy(r->part ? r->part + pd->part * MAXLINE : r->reply, reply, MAXLINE);
+    if (--r->left)
+        return;
+    if (r->client < 0)
+        req_free(r);
+    else
+        drain_client(&clients[r->client]);
+}
+
+static void fail(pend_t *pd, const char *msg) {
+
+    char buf[MAXLINE] = "";
+
+    strcpy(buf, msg);
+    complete(pd, buf);
+}
+
+/* Answer what the connection still owes with an error and close it */
+static void conn_down(backend_t *b, bconn_t *bc) {
+
+    pend_t pd;
+
+    LOG_TEXT(LOG_LVL_WARN, "backend %s:%s lost, %d requests failed", b->host, b->port, bc->qlen);
+    Close(bc->fd);
+    bc->fd = -1;
+    bc->inlen = 0;
+    bc->outoff = bc->outlen = 0;
+    b->retry = now_ms() + GW_RETRY_MS;
+    while (bc->qlen) {
+        pd = bc->q[bc->qhead];
+        bc->qhead = (bc->qhead + 1) % bc->qcap;
+        bc->qlen--;
+        fail(&pd, "Backend unavailable\n");
+    }
+}
+
+static int conn_up(backend_t *b, bconn_t *bc) {
+
+    int one = 1;
+
+    if (bc->fd >= 0) return 0;
+    if (now_ms() < b->retry || (bc->fd = open_clientfd(b->host, b->port)) < 0) {
+        b->retry = now_ms() + GW_RETRY_MS;
+        return -1;
+    }
+    if (bc->fd >= FD_SETSIZE) {
+        Close(bc->fd);
+        bc->fd = -1;
+        return -1;
+    }
+    setsockopt(bc->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return 0;
+}
+
+/* Queue one request line on the backend connection a stock uses */
+static void forward(int backend, int id, req_t *r, int part, const char *line, size_t n) {
+
+    backend_t *b = &backends[backend];
+    bconn_t *bc = &b->conns[(unsigned)id % nconns];
+    pend_t pd = { r, part };
+
+    if (conn_up(b, bc) < 0) {
+        fail(&pd, "Backend unavailable\n");
+        return;
+    }
+    if (bc->qlen == bc->qcap) {
+        pend_t *q = Malloc((bc->qcap ? bc->qcap * 2 : 64) * sizeof(pend_t));
+        int i;
+        for (i = 0; i < bc->qlen; i++)
+            q[i] = bc->q[(bc->qhead + i) % bc->qcap];
+        Free(bc->q);
+        bc->q = q;
+        bc->qhead = 0;
+        bc->qcap = bc->qcap ? bc->qcap * 2 : 64;
+    }
+    bc->q[(bc->qhead + bc->qlen++) % bc->qcap] = pd;
+    out_append(&bc->out, &bc->outoff, &bc->outlen, &bc->outcap, line, n);
+    if (line[n - 1] != '\n')
+        out_append(&bc->out, &bc->outoff, &bc->outlen, &bc->outcap, "\n", 1);
+    b->routed++;
+}
+
+static int gw_report(char *buf, size_t cap) {
+
+    int b, k, inflight, up, len;
+
+    len = snprintf(buf, cap, "gateway backends %d clients %d\n", nbackends, nclients);
+    for (b = 0; b < nbackends && len < cap; b++) {
+        for (k = 0, inflight = up = 0; k < nconns; k++) {
+            inflight += backends[b].conns[k].qlen;
+            up += backends[b].conns[k].fd >= 0;
+        }
+        len += snprintf(buf + len, cap - len, "%s:%s conns %d/%d routed %lu inflight %d\n",
+                        backends[b].host, backends[b].port, up, nconns,
+                        backends[b].routed, inflight);
+    }
+    return len;
+}
+
+/* Which argument names the stock, for the requests a server answers once */
+static int stock_arg(int argc, char **argv) {
+
+    if (!strcmp(argv[0], "order"))
+        return argc == 5 && (!strcmp(argv[1], "buy") || !strcmp(argv[1], "sell")) ? 2 : -1;
+    if (!strcmp(argv[0], "book"))
+        return argc >= 2 ? 1 : -1;
+    if (!strcmp(argv[0], "list"))
+        return argc == 4 ? 1 : -1;
+    if (!strcmp(argv[0], "delist"))
+        return argc == 2 ? 1 : -1;
+    return argc == 3 ? 1 : -1;      /* buy, sell and cancel */
+}
+
+/*
+ * Route one request line (a view into the client's buffer). Lines a server
+ * would not answer get no reply here either, so replies stay in step.
+ */
+static void route(int ci, char *line, size_t n) {
+
+    client_t *c = &clients[ci];
+    char text[MAXLINE], *argv[MAXARGS] = {0}, *tok;
+    int argc = 0, b, arg, i, nlegs;
+    basket_leg_t legs[BASKET_MAX];
+    req_t *r;
+
+    memcpy(text, line, n);
+    text[n] = '\0';
+    for (tok = strtok(text, " \n"); tok && argc < MAXARGS; tok = strtok(NULL, " \n"))
+        argv[argc++] = tok;
+    if (!argc)
+        return;
+
+    if (!strcmp(argv[0], "show")) {
+        r = req_new(ci, 1);
+        c->ring[(c->rhead + c->rlen++) % GW_PIPE] = r;
+        for (b = 0; b < nbackends; b++)
+            forward(b, b, r, b, line, n);
+        return;
+    }
+
+    if (!strcmp(argv[0], "top") && argc == 3 && atoi(argv[1]) > 0
+        && (!strcmp(argv[2], "amount") || !strcmp(argv[2], "price"))) {
+        r = req_new(ci, 1);
+        r->rank = strcmp(argv[2], "amount") ? 2 : 1;
+        r->count = atoi(argv[1]);
+        c->ring[(c->rhead + c->rlen++) % GW_PIPE] = r;
+        for (b = 0; b < nbackends; b++)
+            forward(b, b, r, b, line, n);
+        return;
+    }
+
+    r = req_new(ci, 0);
+    c->ring[(c->rhead + c->rlen++) % GW_PIPE] = r;
+    memset(r->reply, '\0', MAXLINE);
+    if (!strcmp(argv[0], "stats")) {
+        gw_report(r->reply, MAXLINE - 1);
+        r->left = 0;
+    }
+    else if (!strcmp(argv[0], "subscribe") || !strcmp(argv[0], "attach")
+             || !strcmp(argv[0], "lockstat") || !strcmp(argv[0], "replicate")
+             || !strcmp(argv[0], "promote") || !strcmp(argv[0], "login")
+             || !strcmp(argv[0], "account")) {
+        strcpy(r->reply, "Not supported by the gateway\n");
+        r->left = 0;
+    }
+    else if (!strcmp(argv[0], "top")) {
+        strcpy(r->reply, RANK_USAGE);
+        r->left = 0;
+    }
+    else if (!strcmp(argv[0], "basket")) {
+        /* Atomic only within one server, so every stock must live on one */
+        if ((nlegs = basket_parse(argc, argv, legs)) < 0)
+            strcpy(r->reply, BASKET_USAGE);
+        else {
+            b = owner(legs[0].id);
+            for (i = 1; i < nlegs && owner(legs[i].id) == b; i++)
+                ;
+            if (i == nlegs) {
+                forward(b, legs[0].id, r, 0, line, n);
+                return;
+            }
+            strcpy(r->reply, "Basket spans shards\n");
+        }
+        r->left = 0;
+    }
+    else if ((arg = stock_arg(argc, argv)) > 0) {
+        forward(owner(atoi(argv[arg])), atoi(argv[arg]), r, 0, line, n);
+        return;
+    }
+    else {
+        c->rlen--;
+        req_free(r);
+        return;
+    }
+    drain_client(c);
+}
+
+static void close_client(int ci) {
+
+    client_t *c = &clients[ci];
+    int i;
+
+    for (i = 0; i < c->rlen; i++) {
+        req_t *r = c->ring[(c->rhead + i) % GW_PIPE];
+        if (r->left) r->client = -1;    /* Freed when its replies come */
+        else req_free(r);
+    }
+    Close(c->fd);
+    Free(c->out);
+    c->out = NULL;
+    c->outoff = c->outlen = c->outcap = 0;
+    c->rhead = c->rlen = 0;
+    c->eof = 0;
+    c->fd = -1;
+    nclients--;
+}
+
+/* Route the whole lines in the client's buffer while it has room in flight */
+static void serve_buffered(int ci) {
+
+    client_t *c = &clients[ci];
+    char *line;
+    ssize_t n;
+
+    while (c->fd >= 0 && c->rlen < GW_PIPE
+           && (n = rio_getline(&c->rio, &line, MAXLINE, c->eof)) > 0)
+        route(ci, line, n);
+    if (c->fd >= 0 && c->eof)
+        drain_client(c);
+}
+
+/* Read what the client sent; after it shuts down writing, answer the rest first */
+static void serve_client(int ci) {
+
+    client_t *c = &clients[ci];
+    rio_t *rp = &c->rio;
+    ssize_t n;
+
+    if (rp->rio_cnt)
+        memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+    rp->rio_bufptr = rp->rio_buf;
+    while ((n = read(c->fd, rp->rio_buf + rp->rio_cnt, RIO_BUFSIZE - rp->rio_cnt)) < 0
+           && errno == EINTR)
+        ;
+    if (n < 0) {
+        close_client(ci);
+        return;
+    }
+    if (n == 0)
+        c->eof = 1;
+    rp->rio_cnt += n;
+    serve_buffered(ci);
+}
+
+/* Match the replies that arrived on a backend connection to its requests */
+static void serve_backend(backend_t *b, bconn_t *bc) {
+
+    ssize_t n;
+    int off = 0, one = 1;
+    pend_t pd;
+
+    while ((n = read(bc->fd, bc->in + bc->inlen, GW_INBUF - bc->inlen)) < 0 && errno == EINTR)
+        ;
+    if (n <= 0) {
+        conn_down(b, bc);
+        return;
+    }
+    /*
+     * The server writes one reply per request, so behind a pipelined batch
+     * Nagle holds its next reply until this side acks; do not delay the ack
+     */
+    setsockopt(bc->fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+    bc->inlen += n;
+    while (bc->inlen - off >= MAXLINE) {
+        if (!bc->qlen) {                /* A reply nobody asked for */
+            conn_down(b, bc);
+            return;
+        }
+        pd = bc->q[bc->qhead];
+        bc->qhead = (bc->qhead + 1) % bc->qcap;
+        bc->qlen--;
+        complete(&pd, bc->in + off);
+        off += MAXLINE;
+    }
+    memmove(bc->in, bc->in + off, bc->inlen - off);
+    bc->inlen -= off;
+}
+
+static void add_backend(char *arg) {
+
+    char *colon = strrchr(arg, ':');
+    backend_t *b;
+    int k;
+
+    if (!colon || colon == arg || colon - arg >= NI_MAXHOST || strlen(colon + 1) >= NI_MAXSERV)
+        app_error("backends are <host>:<port>");
+    backends = Realloc(backends, (nbackends + 1) * sizeof(backend_t));
+    b = &backends[nbackends++];
+    memset(b, 0, sizeof(*b));
+    memcpy(b->host, arg, colon - arg);
+    strcpy(b->port, colon + 1);
+    b->conns = Calloc(nconns, sizeof(bconn_t));
+    for (k = 0; k < nconns; k++)
+        b->conns[k].fd = -1;
+}
+
+/* Write each backend's share of a stock file next to it */
+static void split(char *file) {
+
+    char name[MAXLINE];
+    FILE *in = fopen(file, "r"), **out = Malloc(nbackends * sizeof(FILE *));
+    int b, id, amount, price;
+
+    if (!in)
+        unix_error("cannot open the stock file");
+    for (b = 0; b < nbackends; b++) {
+        snprintf(name, sizeof(name), "%s.%d", file, b);
+        if (!(out[b] = fopen(name, "w")))
+            unix_error("cannot write a share");
+    }
+    while (fscanf(in, "%d %d %d", &id, &amount, &price) == 3)
+        fprintf(out[owner(id)], "%d %d %d\n", id, amount, price);
+    for (b = 0; b < nbackends; b++)
+        fclose(out[b]);
+    fclose(in);
+    Free(out);
+}
+
+static void usage(char *prog) {
+
+    fprintf(stderr, "usage: %s [-c conns] <port> <host:port>...\n"
+                    "       %s -s <stock file> <host:port>...\n", prog, prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+
+    char *splitFile = NULL;
+    int listenfd, connfd, opt, i, k, b, maxfd, nready;
+    fd_set read_set, write_set;
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+
+    while ((opt = getopt(argc, argv, "c:s:")) != -1) {
+        switch (opt) {
+        case 'c': nconns = atoi(optarg); break;
+        case 's': splitFile = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (nconns < 1 || argc - optind < (splitFile ? 1 : 2))
+        usage(argv[0]);
+    for (i = optind + !splitFile; i < argc; i++)
+        add_backend(argv[i]);
+    build_ring();
+    if (splitFile) {
+        split(splitFile);
+        return 0;
+    }
+
+    log_init(stdout);
+    Signal(SIGPIPE, SIG_IGN);
+    clients = Calloc(FD_SETSIZE, sizeof(client_t));
+    for (i = 0; i < FD_SETSIZE; i++)
+        clients[i].fd = -1;
+    listenfd = Open_listenfd(argv[optind]);
+    LOG_TEXT(LOG_LVL_INFO, "routing to %d backends, %d connections each", nbackends, nconns);
+
+    while (1) {
+        FD_ZERO(&read_set);
+        FD_ZERO(&write_set);
+        FD_SET(listenfd, &read_set);
+        maxfd = listenfd;
+
+        /* A client with a full pipeline or a backlog of replies waits */
+        for (i = 0; i <= maxclient; i++) {
+            client_t *c = &clients[i];
+            if (c->fd < 0) continue;
+            if (!c->eof && c->rlen < GW_PIPE && c->outlen - c->outoff < GW_PIPE * MAXLINE)
+                FD_SET(c->fd, &read_set);
+            if (c->outlen > c->outoff)
+                FD_SET(c->fd, &write_set);
+            if (c->fd > maxfd) maxfd = c->fd;
+        }
+        for (b = 0; b < nbackends; b++) {
+            for (k = 0; k < nconns; k++) {
+                bconn_t *bc = &backends[b].conns[k];
+                if (bc->fd < 0) continue;
+                FD_SET(bc->fd, &read_set);
+                if (bc->outlen > bc->outoff)
+                    FD_SET(bc->fd, &write_set);
+                if (bc->fd > maxfd) maxfd = bc->fd;
+            }
+        }
+        nready = Select(maxfd + 1, &read_set, &write_set, NULL, NULL);
+
+        if (FD_ISSET(listenfd, &read_set)) {
+            clientlen = sizeof(clientaddr);
+            connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+            if (connfd >= FD_SETSIZE) {
+                Close(connfd);
+            }
+            else {
+                for (i = 0; clients[i].fd >= 0; i++)
+                    ;
+                clients[i].fd = connfd;
+                Rio_readinitb(&clients[i].rio, connfd);
+                nclients++;
+                if (i > maxclient) maxclient = i;
+            }
+            nready--;
+        }
+
+        /* Replies first, so the clients they free up can send more below */
+        for (b = 0; b < nbackends && nready > 0; b++) {
+            for (k = 0; k < nconns; k++) {
+                bconn_t *bc = &backends[b].conns[k];
+                if (bc->fd >= 0 && FD_ISSET(bc->fd, &read_set)) {
+                    nready--;
+                    serve_backend(&backends[b], bc);
+                }
+            }
+        }
+        for (i = 0; i <= maxclient; i++) {
+            client_t *c = &clients[i];
+            if (c->fd < 0) continue;
+            if (FD_ISSET(c->fd, &write_set))
+                drain_client(c);
+            if (c->fd >= 0 && FD_ISSET(c->fd, &read_set))
+                serve_client(i);
+            else if (c->fd >= 0)
+                serve_buffered(i);
+        }
+
+        /* Everything routed this pass goes out in one write per connection */
+        for (b = 0; b < nbackends; b++) {
+            for (k = 0; k < nconns; k++) {
+                bconn_t *bc = &backends[b].conns[k];
+                if (bc->fd >= 0 && bc->outlen > bc->outoff
+                    && out_flush(bc->fd, bc->out, &bc->outoff, &bc->outlen) < 0)
+                    conn_down(&backends[b], bc);
+            }
+        }
+    }
+}
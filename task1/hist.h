@@ -0,0 +1,31 @@
+/* $begin hist.h */
+#ifndef __HIST_H__
+#define __HIST_H__
+
+#include <stdint.h>
+
+/*
+ * Log-linear (HDR style) latency histogram. Values below 2^HIST_SUB_BITS
+ * get a bucket each; above that every power of two is split into
+ * 2^HIST_SUB_BITS equal buckets, so the relative error stays under ~3%
+ * from nanoseconds up to HIST_MAX_EXP (about a minute).
+ */
+#define HIST_SUB_BITS   5
+#define HIST_SUB_COUNT  (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP    36
+#define HIST_BUCKETS    ((HIST_MAX_EXP - HIST_SUB_BITS + 2) * HIST_SUB_COUNT)
+
+typedef struct {
+    uint64_t count;                 /* Number of recorded values */
+    uint64_t sum;                   /* Sum of recorded values */
+    uint64_t max;                   /* Largest recorded value */
+    uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+void hist_record(hist_t *h, uint64_t v);
+void hist_merge(hist_t *dst, const hist_t *src);
+void hist_sub(hist_t *dst, const hist_t *src);
+uint64_t hist_percentile(const hist_t *h, double p);
+
+#endif /* __HIST_H__ */
+/* $end hist.h */
@@ -0,0 +1,57 @@
+/* $begin hp.h */
+#ifndef __HP_H__
+#define __HP_H__
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Huge-page backed memory for the stock table and connection buffers.
+ * Allocated one by one, millions of stock nodes end up scattered over the
+ * heap and a lookup or a show scan takes a TLB miss at almost every node.
+ * An arena instead carves them out of 2 MB regions, so the whole table
+ * fits in a few TLB entries. STOCK_HUGEPAGES picks the backing:
+ *
+ *   0, unset       malloc, as before
+ *   thp            regions of ordinary pages, madvised for transparent
+ *                  huge pages
+ *   1              regions of reserved huge pages (MAP_HUGETLB), or thp
+ *                  while none are left
+ *
+ * Freed blocks go on a free list per size class and are reused; regions
+ * are never returned, and hp_carve blocks (buffers that live as long as
+ * their thread) are never freed. On a machine with more than one NUMA
+ * node a region is bound where the memory is used: an arena shared by
+ * every thread is interleaved over all nodes, and a HP_LOCAL one prefers
+ * the node of the thread that maps each region.
+ */
+
+#define HP_PAGE         (2UL << 20)
+#define HP_CLASS        16      /* Size classes are multiples of this */
+#define HP_CLASSES      64      /* hp_alloc takes larger blocks from malloc */
+
+enum { HP_OFF, HP_THP, HP_HUGETLB };
+enum { HP_LOCAL, HP_INTERLEAVE };
+
+typedef struct {
+    pthread_mutex_t lock;
+    int place;                  /* HP_LOCAL or HP_INTERLEAVE */
+    char *cur, *end;            /* Unused rest of the current region */
+    void *free[HP_CLASSES];     /* Freed blocks of each size class */
+    size_t regions;             /* Regions mapped so far */
+} hp_arena_t;
+
+extern int hp_mode;
+extern const char *hp_mode_name[];
+
+void hp_config(void);
+int hp_nodes(void);
+int hp_node(void);
+void *hp_map(size_t size, int place);
+void hp_arena_init(hp_arena_t *a, int place);
+void *hp_alloc(hp_arena_t *a, size_t size);
+void hp_free(hp_arena_t *a, void *p, size_t size);
+void *hp_carve(hp_arena_t *a, size_t size);
+
+#endif /* __HP_H__ */
+/* $end hp.h */
@@ -0,0 +1,213 @@
+/*
+ * log.c - asynchronous per-thread ring buffer logger
+ */
+/* $begin log.c */
+#include "csapp.h"
+#include "log.h"
+#include <time.h>
+
+typedef struct {
+    struct timespec ts;         /* Coarse wall clock at the call site */
+    const char *fmt;            /* Deferred format, NULL if text is used */
+    int level;
+    union {
+        long args[4];           /* Deferred integer arguments */
+        char text[LOG_TEXT_MAX];/* Eagerly formatted message */
+    } u;
+} log_rec_t;
+
+typedef struct _log_ring_ {
+    log_rec_t recs[LOG_RING_SIZE];
+    unsigned long head;         /* Next slot the owner writes (producer) */
+    unsigned long tail;         /* Next slot the drainer reads (consumer) */
+    unsigned long dropped;      /* Records lost to a full ring */
+    unsigned long suppressed;   /* Records refused by the rate limiter */
+    int in_use;                 /* Owned by a live thread */
+    int id;                     /* Short thread id printed in every line */
+    long tokens;                /* Rate limiter: records left this second */
+    time_t window;              /* Rate limiter: second the tokens belong to */
+    struct _log_ring_ *next;
+} log_ring_t;
+
+int log_threshold = LOG_LVL_INFO;
+
+static log_ring_t *rings = NULL;        /* Every ring ever created */
+static int ring_cnt = 0;
+static FILE *log_out = NULL;
+static pthread_t drainer_tid;
+static int drainer_running = 0;
+static volatile int drainer_stop = 0;
+static pthread_key_t ring_key;
+static __thread log_ring_t *my_ring = NULL;
+
+static const char *level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+static void ring_release(void *vp) {
+    log_ring_t *r = vp;
+    __atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/* Claim an orphaned ring or allocate a new one for the calling thread */
+static log_ring_t *ring_acquire(void) {
+
+    log_ring_t *r;
+
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&r->in_use, &expected, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            goto done;
+    }
+
+    r = Calloc(1, sizeof(log_ring_t));
+    r->in_use = 1;
+    r->id = __atomic_add_fetch(&ring_cnt, 1, __ATOMIC_RELAXED);
+    r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &r->next, r, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+done:
+    pthread_setspecific(ring_key, r);
+    my_ring = r;
+    return r;
+}
+
+/* Reserve the next slot of this thread's ring, or NULL if the record is lost */
+static log_rec_t *rec_reserve(int level) {
+
+    log_ring_t *r = my_ring ? my_ring : ring_acquire();
+    log_rec_t *rec;
+    struct timespec ts;
+    unsigned long head = r->head;
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    if (ts.tv_sec != r->window) {
+        r->window = ts.tv_sec;
+        r->tokens = LOG_RATE_LIMIT;
+    }
+    if (r->tokens <= 0 && level < LOG_LVL_ERROR) {
+        __atomic_store_n(&r->suppressed, r->suppressed + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    r->tokens--;
+
+    rec = &r->recs[head & (LOG_RING_SIZE - 1)];
+    rec->ts = ts;
+    rec->level = level;
+    return rec;
+}
+
+static void rec_publish(void) {
+    __atomic_store_n(&my_ring->head, my_ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void log_event(int level, const char *fmt, long a0, long a1, long a2, long a3) {
+
+    log_rec_t *rec = rec_reserve(level);
+
+    if (!rec) return;
+    rec->fmt = fmt;
+    rec->u.args[0] = a0;
+    rec->u.args[1] = a1;
+    rec->u.args[2] = a2;
+    rec->u.args[3] = a3;
+    rec_publish();
+}
+
+void log_text(int level, const char *fmt, ...) {
+
+    log_rec_t *rec = rec_reserve(level);
+    va_list ap;
+
+    if (!rec) return;
+    rec->fmt = NULL;
+    va_start(ap, fmt);
+    vsnprintf(rec->u.text, LOG_TEXT_MAX, fmt, ap);
+    va_end(ap);
+    rec_publish();
+}
+
+static void rec_print(log_ring_t *r, log_rec_t *rec) {
+
+    struct tm tm;
+    char stamp[32];
+
+    localtime_r(&rec->ts.tv_sec, &tm);
+    strftime(stamp, sizeof(stamp), "%H:%M:%S", &tm);
+    fprintf(log_out, "%s.%03ld %-5s [t%d] ", stamp, rec->ts.tv_nsec / 1000000,
+            level_names[rec->level], r->id);
+    if (rec->fmt)
+        fprintf(log_out, rec->fmt, rec->u.args[0], rec->u.args[1],
+                rec->u.args[2], rec->u.args[3]);
+    else
+        fputs(rec->u.text, log_out);
+    fputc('\n', log_out);
+}
+
+/* Drain every ring once; returns the number of records written */
+static int drain_all(void) {
+
+    log_ring_t *r;
+    int n = 0;
+
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        unsigned long tail = r->tail;
+        unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        unsigned long lost;
+
+        for (; tail != head; tail++, n++)
+            rec_print(r, &r->recs[tail & (LOG_RING_SIZE - 1)]);
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+        if ((lost = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED)))
+            fprintf(log_out, "log: t%d dropped %lu records (ring full)\n", r->id, lost);
+        if ((lost = __atomic_exchange_n(&r->suppressed, 0, __ATOMIC_RELAXED)))
+            fprintf(log_out, "log: t%d suppressed %lu records (rate limit)\n", r->id, lost);
+    }
+    if (n) fflush(log_out);
+    return n;
+}
+
+static void *drainer(void *vargp) {
+
+    while (!drainer_stop) {
+        if (drain_all() == 0)
+            usleep(2000);
+    }
+    drain_all();
+    return NULL;
+}
+
+/* Parse STOCK_LOG (debug|info|warn|error|off) and start the drainer */
+void log_init(FILE *out) {
+
+    char *env = getenv("STOCK_LOG");
+
+    if (env) {
+        if (!strcmp(env, "debug")) log_threshold = LOG_LVL_DEBUG;
+        else if (!strcmp(env, "info")) log_threshold = LOG_LVL_INFO;
+        else if (!strcmp(env, "warn")) log_threshold = LOG_LVL_WARN;
+        else if (!strcmp(env, "error")) log_threshold = LOG_LVL_ERROR;
+        else if (!strcmp(env, "off")) log_threshold = LOG_LVL_OFF;
+    }
+
+    log_out = out;
+    pthread_key_create(&ring_key, ring_release);
+    Pthread_create(&drainer_tid, NULL, drainer, NULL);
+    drainer_running = 1;
+    atexit(log_shutdown);
+}
+
+/* Stop the drainer after it has written everything still queued */
+void log_shutdown(void) {
+
+    if (!drainer_running) return;
+    drainer_running = 0;
+    drainer_stop = 1;
+    Pthread_join(drainer_tid, NULL);
+}
+/* $end log.c */
@@ -0,0 +1,53 @@
+/* $begin log.h */
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdio.h>
+
+/*
+ * Asynchronous logger. Every thread appends fixed-size records to its own
+ * single-producer ring; a background drainer thread formats them and writes
+ * them out in batches, so the request path never touches stdio.
+ *
+ * LOG_DEBUG/INFO/WARN/ERROR defer formatting: they store the format pointer
+ * and up to four integer arguments, which are widened to long, so the format
+ * string must use %ld / %lu / %lx. Use LOG_TEXT for anything with strings.
+ */
+
+#define LOG_LVL_DEBUG   0
+#define LOG_LVL_INFO    1
+#define LOG_LVL_WARN    2
+#define LOG_LVL_ERROR   3
+#define LOG_LVL_OFF     4
+
+#define LOG_RING_SIZE   1024    /* Records per thread ring (power of two) */
+#define LOG_TEXT_MAX    88      /* Bytes of pre-formatted text per record */
+#define LOG_RATE_LIMIT  20000   /* Records per second per thread */
+
+extern int log_threshold;
+
+void log_init(FILE *out);
+void log_shutdown(void);
+void log_event(int level, const char *fmt, long a0, long a1, long a2, long a3);
+void log_text(int level, const char *fmt, ...);
+
+#define _LOG_FMT_ARGS(fmt, a0, a1, a2, a3, ...) \
+    (fmt), (long)(a0), (long)(a1), (long)(a2), (long)(a3)
+
+#define LOG_EVENT(level, ...) do { \
+    if ((level) >= log_threshold) \
+        log_event((level), _LOG_FMT_ARGS(__VA_ARGS__, 0, 0, 0, 0, 0)); \
+} while (0)
+
+#define LOG_DEBUG(...)  LOG_EVENT(LOG_LVL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...)   LOG_EVENT(LOG_LVL_INFO, __VA_ARGS__)
+#define LOG_WARN(...)   LOG_EVENT(LOG_LVL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...)  LOG_EVENT(LOG_LVL_ERROR, __VA_ARGS__)
+
+#define LOG_TEXT(level, ...) do { \
+    if ((level) >= log_threshold) \
+        log_text((level), __VA_ARGS__); \
+} while (0)
+
+#endif /* __LOG_H__ */
+/* $end log.h */
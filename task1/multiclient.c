@@ -1,133 +1,506 @@
+/*
+ * multiclient.c - load generator for the stock servers
+ *
+ * Multiplexes many client connections over a few threads with epoll.
+ * In closed-loop mode (the default) every connection sends its next order
+ * as soon as the previous reply arrives. In open-loop mode (-r) orders are
+ * scheduled at a fixed total arrival rate, and latency is measured from the
+ * scheduled send time so a slow server cannot hide queueing delay
+ * (no coordinated omission).
+ *
+ * With -b, every buy or sell is a basket of that many legs on random
+ * stocks, to compare all-or-nothing baskets against single orders. With
+ * -L, connection i logs in to account <base> + i before its first order,
+ * so every trade is checked against and booked to that account.
+ *
+ * A host of unix:<path> connects to the server's Unix domain socket instead,
+ * and shm:<path> attaches a shared-memory channel over it for every client.
+ */
 #include "csapp.h"
+#include "hist.h"
+#include "shm.h"
+#include "basket.h"
 #include <time.h>
+#include <sys/epoll.h>
 
-#define MAX_CLIENT 100
+#define MAX_CLIENT 100000
 #define ORDER_PER_CLIENT 10
 #define STOCK_NUM 10
 #define BUY_SELL_MAX 10
+#define NTHREADS_DEFAULT 4
+#define MAX_EVENTS 256
+
+enum { OP_SHOW, OP_BUY, OP_SELL, OP_NTYPES };
+
+typedef struct {
+	char *host, *port;
+	char *unix_path;	/* Unix socket to connect to instead, or NULL */
+	int shm;		/* Attach shared-memory channels over it */
+	int num_client;
+	int nthreads;
+	int orders;		/* Orders per client, when no duration is given */
+	double duration;	/* Seconds to run, 0 to use orders */
+	double rate;		/* Total orders/sec, 0 for closed loop */
+	int mix[OP_NTYPES];	/* Relative weights of show/buy/sell */
+	int stock_num;
+	double zipf;		/* Zipf exponent of stock popularity, 0 = uniform */
+	int amount_max;
+	int basket;		/* Legs per buy/sell basket, 0 for single orders */
+	int login;		/* First account to log in to, 0 for none */
+	uint64_t seed;
+	long think_us;		/* Closed loop pause between orders */
+	int verbose;		/* Print every reply */
+	int csv;		/* Print one machine-readable result line */
+} config_t;
+
+typedef struct {
+	int fd;
+	int account;		/* Account to log in to, 0 for none */
+	uint64_t rng;
+	int done;		/* Orders completed */
+	int busy;		/* An order is in flight */
+	uint64_t intended;	/* When the in-flight order was due */
+	uint64_t next_due;	/* When the next order is due */
+	int op;
+	char req[32 * (BASKET_MAX + 1)];
+	int req_len, req_sent;
+	int resp_got;		/* Bytes of the MAXLINE reply received */
+	char first;		/* First reply byte, to spot failures */
+} conn_t;
+
+typedef struct {
+	int id;
+	int nconn;
+	conn_t *conns;
+	hist_t lat[OP_NTYPES];
+	uint64_t failed;
+	pthread_t tid;
+} worker_t;
+
+static config_t cfg;
+static double *zipf_cdf;
+static uint64_t start_ns, stop_ns;	/* stop_ns is 0 unless -d is set */
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* splitmix64: seeds and steps the per-connection generators */
+static uint64_t next_rand(uint64_t *s)
+{
+	uint64_t z = (*s += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static double next_unit(uint64_t *s)
+{
+	return (next_rand(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void zipf_init(void)
+{
+	int i;
+	double sum = 0;
+
+	zipf_cdf = Malloc(cfg.stock_num * sizeof(double));
+	for (i = 0; i < cfg.stock_num; i++) {
+		sum += 1.0 / pow(i + 1, cfg.zipf);
+		zipf_cdf[i] = sum;
+	}
+	for (i = 0; i < cfg.stock_num; i++)
+		zipf_cdf[i] /= sum;
+}
+
+/* Stock id 1..stock_num; id 1 is the most popular */
+static int pick_stock(uint64_t *s)
+{
+	double u = next_unit(s);
+	int lo = 0, hi = cfg.stock_num - 1;
+
+	if (cfg.zipf == 0)
+		return next_rand(s) % cfg.stock_num + 1;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (zipf_cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo + 1;
+}
+
+static void make_order(conn_t *c)
+{
+	int total = cfg.mix[OP_SHOW] + cfg.mix[OP_BUY] + cfg.mix[OP_SELL];
+	int r = next_rand(&c->rng) % total;
+	int i;
+
+	if (r < cfg.mix[OP_SHOW]) {
+		c->op = OP_SHOW;
+		c->req_len = sprintf(c->req, "show\n");
+	}
+	else if (!cfg.basket) {
+		c->op = r < cfg.mix[OP_SHOW] + cfg.mix[OP_BUY] ? OP_BUY : OP_SELL;
+		c->req_len = sprintf(c->req, "%s %d %d\n", c->op == OP_BUY ? "buy" : "sell",
+				     pick_stock(&c->rng),
+				     (int)(next_rand(&c->rng) % cfg.amount_max) + 1);
+	}
+	else {
+		c->op = r < cfg.mix[OP_SHOW] + cfg.mix[OP_BUY] ? OP_BUY : OP_SELL;
+		c->req_len = sprintf(c->req, "basket");
+		for (i = 0; i < cfg.basket; i++)
+			c->req_len += sprintf(c->req + c->req_len, " %s %d %d",
+					      c->op == OP_BUY ? "buy" : "sell", pick_stock(&c->rng),
+					      (int)(next_rand(&c->rng) % cfg.amount_max) + 1);
+		c->req[c->req_len++] = '\n';
+	}
+	c->req_sent = 0;
+	c->resp_got = 0;
+}
+
+static int finished(conn_t *c, uint64_t now)
+{
+	if (cfg.duration > 0)
+		return now >= stop_ns;
+	return c->done >= cfg.orders;
+}
+
+static void flush_request(conn_t *c)
+{
+	while (c->req_sent < c->req_len) {
+		ssize_t n = write(c->fd, c->req + c->req_sent, c->req_len - c->req_sent);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return;	/* EPOLLOUT will resume it */
+			unix_error("write error");
+		}
+		c->req_sent += n;
+	}
+}
+
+static void send_order(conn_t *c, uint64_t intended)
+{
+	make_order(c);
+	c->busy = 1;
+	c->intended = intended;
+	flush_request(c);
+}
+
+/* Drain reply bytes; returns 1 once a full reply has arrived */
+static int read_reply(conn_t *c)
+{
+	char buf[MAXLINE];
+
+	while (c->resp_got < MAXLINE) {
+		ssize_t n = read(c->fd, buf, MAXLINE - c->resp_got);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 0;
+			unix_error("read error");
+		}
+		if (n == 0)
+			app_error("server closed the connection");
+		if (c->resp_got == 0)
+			c->first = buf[0];
+		if (cfg.verbose)
+			Fwrite(buf, 1, strnlen(buf, n), stdout);
+		c->resp_got += n;
+	}
+	return 1;
+}
+
+/* Log a connection in before its first order; the reply is not timed */
+static void login(int fd, int account)
+{
+	char buf[MAXLINE];
+	int n = sprintf(buf, "login %d\n", account);
+
+	Rio_writen(fd, buf, n);
+	if (Rio_readn(fd, buf, MAXLINE) != MAXLINE)
+		app_error("server closed the connection");
+}
+
 /*
-#define RANDOM 1
-#define SHOW 2
-#define BUY_SELL 3
-*/
-int main(int argc, char **argv) {
-
-	pid_t pids[MAX_CLIENT];
-	int runprocess = 0, status, i;
-
-	int clientfd, num_client;
-	char *host, *port, buf[MAXLINE], tmp[3];
-	rio_t rio;
-	/*
-	struct timeval start;	
-	struct timeval end;		
-	unsigned long e_usec;	
-	gettimeofday(&start, 0);
-	int mode = BUY_SELL;
-	*/
-	if (argc != 4) {
-		fprintf(stderr, "usage: %s <host> <port> <client#>\n", argv[0]);
-		exit(0);
-	}
-
-	host = argv[1];
-	port = argv[2];
-	num_client = atoi(argv[3]);
-
-/*	fork for each client process	*/
-	while(runprocess < num_client){
-		//wait(&state);
-		pids[runprocess] = fork();
-
-		if(pids[runprocess] < 0)
-			return -1;
-		/*	child process		*/
-		else if(pids[runprocess] == 0){
-			//printf("child %ld\n", (long)getpid());
-
-			clientfd = Open_clientfd(host, port);
-			Rio_readinitb(&rio, clientfd);
-			srand((unsigned int) getpid());
-
-			for(i=0;i<ORDER_PER_CLIENT;i++){
-				int option = rand() % 3;
-				/*
-				if (mode == RANDOM) { option = rand() % 3; }
-				else if (mode == SHOW) { option = 0; }
-				else if (mode == BUY_SELL) { option = rand() % 2 + 1; }
-				else exit(0);
-				*/
-				if(option == 0){//show
-					strcpy(buf, "show\n");
-				}
-				else if(option == 1){//buy
-					int list_num = rand() % STOCK_NUM + 1;
-					int num_to_buy = rand() % BUY_SELL_MAX + 1;//1~10
-
-					strcpy(buf, "buy ");
-					sprintf(tmp, "%d", list_num);
-					strcat(buf, tmp);
-					strcat(buf, " ");
-					sprintf(tmp, "%d", num_to_buy);
-					strcat(buf, tmp);
-					strcat(buf, "\n");
-				}
-				else if(option == 2){//sell
-					int list_num = rand() % STOCK_NUM + 1; 
-					int num_to_sell = rand() % BUY_SELL_MAX + 1;//1~10
-					
-					strcpy(buf, "sell ");
-					sprintf(tmp, "%d", list_num);
-					strcat(buf, tmp);
-					strcat(buf, " ");
-					sprintf(tmp, "%d", num_to_sell);
-					strcat(buf, tmp);
-					strcat(buf, "\n");
-				}
-				//strcpy(buf, "buy 1 2\n");
-			
-				Rio_writen(clientfd, buf, strlen(buf));
-				// Rio_readlineb(&rio, buf, MAXLINE);
-				Rio_readnb(&rio, buf, MAXLINE);
-				Fputs(buf, stdout);
-
-				usleep(1000000);
-			}
+ * A client on a shared-memory channel cannot be waited for with epoll, so
+ * each gets a thread of its own that sleeps on the channel.
+ */
+static void shm_worker(worker_t *w)
+{
+	conn_t *c = &w->conns[0];
+	shm_chan_t *chan = shm_connect(cfg.unix_path);
+	uint64_t interval = 0, now;
+	char buf[MAXLINE];
+	ssize_t n = 0;
+
+	if (cfg.rate > 0)
+		interval = (uint64_t)(1e9 * cfg.num_client / cfg.rate);
+	c->next_due = start_ns + (interval ? next_rand(&c->rng) % interval : 0);
+	if (c->account) {
+		n = sprintf(buf, "login %d\n", c->account);
+		if (shm_send(chan, &chan->seg->req, buf, n) < 0
+		    || shm_recv(chan, &chan->seg->resp, buf, MAXLINE, -1) <= 0)
+			app_error("server closed the connection");
+	}
 
-			Close(clientfd);
-			exit(0);
+	while (!finished(c, now = now_ns())) {
+		if (c->next_due > now) {
+			struct timespec ts = { (c->next_due - now) / 1000000000,
+					       (c->next_due - now) % 1000000000 };
+			nanosleep(&ts, NULL);
+			continue;
 		}
-		/*	parten process		*/
-		/*else{
-			for(i=0;i<num_client;i++){
-				waitpid(pids[i], &status, 0);
+		make_order(c);
+		c->intended = interval ? c->next_due : now;
+		c->next_due += interval;
+		if (shm_send(chan, &chan->seg->req, c->req, c->req_len) < 0
+		    || (n = shm_recv(chan, &chan->seg->resp, buf, MAXLINE, -1)) <= 0)
+			app_error("server closed the connection");
+		if (cfg.verbose)
+			Fwrite(buf, 1, strnlen(buf, n), stdout);
+
+		now = now_ns();
+		hist_record(&w->lat[c->op], now - c->intended);
+		if (buf[0] == 'N' || buf[0] == 'b')	/* "Not enough left stock", "busy" */
+			w->failed++;
+		c->done++;
+		if (!interval)
+			c->next_due = now + cfg.think_us * 1000;
+	}
+	shm_close(chan);
+}
+
+static void *worker(void *vargp)
+{
+	worker_t *w = vargp;
+	struct epoll_event ev, events[MAX_EVENTS];
+	uint64_t interval = 0, now;
+	int i, n, epfd, open = w->nconn;
+
+	if (cfg.shm) {
+		shm_worker(w);
+		return NULL;
+	}
+	epfd = epoll_create1(0);
+	if (epfd < 0)
+		unix_error("epoll_create1 error");
+	if (cfg.rate > 0)	/* Each connection gets an equal share of the rate */
+		interval = (uint64_t)(1e9 * cfg.num_client / cfg.rate);
+
+	for (i = 0; i < w->nconn; i++) {
+		conn_t *c = &w->conns[i];
+		c->fd = cfg.unix_path ? Open_unix_clientfd(cfg.unix_path)
+				      : Open_clientfd(cfg.host, cfg.port);
+		if (c->account)
+			login(c->fd, c->account);
+		fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		ev.data.ptr = c;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+			unix_error("epoll_ctl error");
+		/* Stagger the first send across one interval */
+		c->next_due = start_ns + (interval ? next_rand(&c->rng) % interval : 0);
+	}
+
+	while (open > 0) {
+		int timeout = -1;
+
+		/* Start every idle connection whose next order is due */
+		now = now_ns();
+		for (i = 0; i < w->nconn; i++) {
+			conn_t *c = &w->conns[i];
+			if (c->fd < 0 || c->busy)
+				continue;
+			if (finished(c, now)) {
+				Close(c->fd);
+				c->fd = -1;
+				open--;
+				continue;
+			}
+			if (c->next_due <= now) {
+				send_order(c, interval ? c->next_due : now);
+				c->next_due += interval;
+			}
+			else {
+				int ms = (c->next_due - now + 999999) / 1000000;
+				if (timeout < 0 || ms < timeout)
+					timeout = ms;
 			}
-		}*/
-		runprocess++;
+		}
+		if (open == 0)
+			break;
+
+		n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+		if (n < 0 && errno != EINTR)
+			unix_error("epoll_wait error");
+		now = now_ns();
+		for (i = 0; i < n; i++) {
+			conn_t *c = events[i].data.ptr;
+			if (!c->busy)
+				continue;
+			if (events[i].events & EPOLLOUT)
+				flush_request(c);
+			if (!(events[i].events & EPOLLIN) || !read_reply(c))
+				continue;
+
+			now = now_ns();
+			hist_record(&w->lat[c->op], now - c->intended);
+			if (c->first == 'N' || c->first == 'b')	/* "Not enough left stock", "busy" */
+				w->failed++;
+			c->busy = 0;
+			c->done++;
+			if (!interval)
+				c->next_due = now + cfg.think_us * 1000;
+		}
 	}
-	for(i=0;i<num_client;i++){
-		waitpid(pids[i], &status, 0);
+	close(epfd);
+	return NULL;
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr, "usage: %s <host|unix:path|shm:path> <port> <client#> [-t threads]\n"
+		"       [-n orders | -d seconds] [-r rate] [-m show:buy:sell] [-k stocks]\n"
+		"       [-z zipf] [-a max_amount] [-b basket_legs] [-L first_account]\n"
+		"       [-s seed] [-T think_us] [-v] [-c]\n", prog);
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	worker_t *workers;
+	hist_t all;
+	uint64_t elapsed, total = 0, failed = 0;
+	int i, o, opt, next = 0;
+	double tput;
+
+	cfg.nthreads = NTHREADS_DEFAULT;
+	cfg.orders = ORDER_PER_CLIENT;
+	cfg.mix[OP_SHOW] = cfg.mix[OP_BUY] = cfg.mix[OP_SELL] = 1;
+	cfg.stock_num = STOCK_NUM;
+	cfg.amount_max = BUY_SELL_MAX;
+	cfg.seed = 1;
+
+	while ((opt = getopt(argc, argv, "t:n:d:r:m:k:z:a:b:L:s:T:vc")) != -1) {
+		switch (opt) {
+		case 't': cfg.nthreads = atoi(optarg); break;
+		case 'n': cfg.orders = atoi(optarg); break;
+		case 'd': cfg.duration = atof(optarg); break;
+		case 'r': cfg.rate = atof(optarg); break;
+		case 'm':
+			if (sscanf(optarg, "%d:%d:%d", &cfg.mix[OP_SHOW], &cfg.mix[OP_BUY],
+				   &cfg.mix[OP_SELL]) != 3)
+				usage(argv[0]);
+			break;
+		case 'k': cfg.stock_num = atoi(optarg); break;
+		case 'z': cfg.zipf = atof(optarg); break;
+		case 'a': cfg.amount_max = atoi(optarg); break;
+		case 'b': cfg.basket = atoi(optarg); break;
+		case 'L': cfg.login = atoi(optarg); break;
+		case 's': cfg.seed = strtoull(optarg, NULL, 10); break;
+		case 'T': cfg.think_us = atol(optarg); break;
+		case 'v': cfg.verbose = 1; break;
+		case 'c': cfg.csv = 1; break;
+		default: usage(argv[0]);
+		}
 	}
+	if (argc - optind != 3)
+		usage(argv[0]);
 
-	/*clientfd = Open_clientfd(host, port);
-	Rio_readinitb(&rio, clientfd);
+	cfg.host = argv[optind];
+	cfg.port = argv[optind + 1];
+	cfg.num_client = atoi(argv[optind + 2]);
+	if (cfg.num_client < 1 || cfg.num_client > MAX_CLIENT || cfg.nthreads < 1
+	    || cfg.stock_num < 1 || cfg.amount_max < 1 || cfg.basket < 0 || cfg.basket > BASKET_MAX
+	    || cfg.mix[OP_SHOW] + cfg.mix[OP_BUY] + cfg.mix[OP_SELL] <= 0)
+		usage(argv[0]);
+	if (!strncmp(cfg.host, "unix:", 5))
+		cfg.unix_path = cfg.host + 5;
+	else if (!strncmp(cfg.host, "shm:", 4)) {
+		cfg.unix_path = cfg.host + 4;
+		cfg.shm = 1;
+		cfg.nthreads = cfg.num_client;	/* One channel per thread */
+	}
+	if (cfg.nthreads > cfg.num_client)
+		cfg.nthreads = cfg.num_client;
+	zipf_init();
+	Signal(SIGPIPE, SIG_IGN);
 
-	while (Fgets(buf, MAXLINE, stdin) != NULL) {
-		Rio_writen(clientfd, buf, strlen(buf));
-		Rio_readlineb(&rio, buf, MAXLINE);
-		Fputs(buf, stdout);
+	/* Deal connections out round-robin; each is seeded by its own index */
+	workers = Calloc(cfg.nthreads, sizeof(worker_t));
+	for (i = 0; i < cfg.nthreads; i++) {
+		workers[i].id = i;
+		workers[i].nconn = cfg.num_client / cfg.nthreads
+				   + (i < cfg.num_client % cfg.nthreads);
+		workers[i].conns = Calloc(workers[i].nconn, sizeof(conn_t));
+		for (o = 0; o < workers[i].nconn; o++) {
+			uint64_t s = cfg.seed + (uint64_t)next;
+			workers[i].conns[o].rng = next_rand(&s);
+			workers[i].conns[o].account = cfg.login ? cfg.login + next : 0;
+			next++;
+		}
 	}
 
-	Close(clientfd); //line:netp:echoclient:close
-	exit(0);*/
-	/*
-	gettimeofday(&end, 0);
+	start_ns = now_ns();
+	if (cfg.duration > 0)
+		stop_ns = start_ns + (uint64_t)(cfg.duration * 1e9);
+	for (i = 0; i < cfg.nthreads; i++)
+		Pthread_create(&workers[i].tid, NULL, worker, &workers[i]);
+	for (i = 0; i < cfg.nthreads; i++)
+		Pthread_join(workers[i].tid, NULL);
+	elapsed = now_ns() - start_ns;
+
+	memset(&all, 0, sizeof(all));
+	for (i = 0; i < cfg.nthreads; i++) {
+		for (o = 0; o < OP_NTYPES; o++)
+			hist_merge(&all, &workers[i].lat[o]);
+		failed += workers[i].failed;
+	}
+	total = all.count;
+	tput = total / (elapsed / 1e9);
 
-	e_usec = ((end.tv_sec * 1000000) + end.tv_usec) - ((start.tv_sec * 1000000) + start.tv_usec);
-	if (mode == RANDOM) {printf("[RANDOM] THREAD# %d | ", NTHREADS);}
-	else if (mode == SHOW) {printf("[SHOW] THREAD# %d | ", NTHREADS);}
-	else if (mode == BUY_SELL) {printf("[BUY_SELL] THREAD# %d | ", NTHREADS);}
-	printf("elasped time: %lu microseconds \n", e_usec);
-	*/
+	if (cfg.csv) {
+		/* clients,orders,failed,seconds,ops_per_sec,p50_us,p90_us,p99_us,p999_us,max_us */
+		printf("%d,%lu,%lu,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n", cfg.num_client,
+		       (unsigned long)total, (unsigned long)failed, elapsed / 1e9, tput,
+		       hist_percentile(&all, 0.50) / 1e3, hist_percentile(&all, 0.90) / 1e3,
+		       hist_percentile(&all, 0.99) / 1e3, hist_percentile(&all, 0.999) / 1e3,
+		       all.max / 1e3);
+		return 0;
+	}
+
+	printf("%s loop, %d clients on %d threads, %lu orders (%lu failed) in %.3f s\n",
+	       cfg.rate > 0 ? "open" : "closed", cfg.num_client, cfg.nthreads,
+	       (unsigned long)total, (unsigned long)failed, elapsed / 1e9);
+	printf("throughput %.1f orders/s\n", tput);
+	if (cfg.basket) {
+		uint64_t trades = 0;
+		for (i = 0; i < cfg.nthreads; i++)
+			trades += workers[i].lat[OP_BUY].count + workers[i].lat[OP_SELL].count;
+		printf("baskets of %d legs, %.1f legs/s\n", cfg.basket,
+		       trades * cfg.basket / (elapsed / 1e9));
+	}
+	printf("latency us   p50 %.1f  p90 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+	       hist_percentile(&all, 0.50) / 1e3, hist_percentile(&all, 0.90) / 1e3,
+	       hist_percentile(&all, 0.99) / 1e3, hist_percentile(&all, 0.999) / 1e3,
+	       all.max / 1e3);
+	for (o = 0; o < OP_NTYPES; o++) {
+		hist_t op;
+		memset(&op, 0, sizeof(op));
+		for (i = 0; i < cfg.nthreads; i++)
+			hist_merge(&op, &workers[i].lat[o]);
+		if (op.count == 0)
+			continue;
+		printf("  %-5s n %-8lu p50 %.1f  p99 %.1f  p999 %.1f\n",
+		       o == OP_SHOW ? "show" : o == OP_BUY ? "buy" : "sell",
+		       (unsigned long)op.count, hist_percentile(&op, 0.50) / 1e3,
+		       hist_percentile(&op, 0.99) / 1e3, hist_percentile(&op, 0.999) / 1e3);
+	}
 	return 0;
 }
@@ -0,0 +1,160 @@
+/*
+ * pmu.c - per-thread perf_event counter groups, see pmu.h
+ */
+/* $begin pmu.c */
+#include "csapp.h"
+#include "pmu.h"
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+typedef struct {
+    uint32_t type;
+    uint64_t config;
+} pmu_event_t;
+
+static const pmu_event_t hw_events[] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+static const pmu_event_t sw_events[] = {
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+int pmu_every = 0;
+int pmu_kind = PMU_OFF;
+const char *pmu_kind_name[] = { "off", "hardware", "software" };
+
+static int exclude_kernel;
+static uint64_t read_cost[PMU_MAX_EVENTS];
+static __thread int my_group = -1;      /* Leader fd; -2 if it would not open */
+
+static int nevents(int kind) {
+    return kind == PMU_HW ? sizeof(hw_events) / sizeof(hw_events[0])
+                          : sizeof(sw_events) / sizeof(sw_events[0]);
+}
+
+/* Open kind's group counting the calling thread; returns the leader or -1 */
+static int group_open(int kind, int exk) {
+
+    const pmu_event_t *ev = kind == PMU_HW ? hw_events : sw_events;
+    struct perf_event_attr a;
+    int fds[PMU_MAX_EVENTS], i;
+
+    for (i = 0; i < nevents(kind); i++) {
+        memset(&a, 0, sizeof(a));
+        a.size = sizeof(a);
+        a.type = ev[i].type;
+        a.config = ev[i].config;
+        a.exclude_kernel = exk;
+        a.exclude_hv = 1;
+        a.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED
+                        | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[i] = syscall(SYS_perf_event_open, &a, 0, -1, i ? fds[0] : -1, PERF_FLAG_FD_CLOEXEC);
+        if (fds[i] < 0) {
+            while (i--)
+                close(fds[i]);
+            return -1;
+        }
+    }
+    return fds[0];
+}
+
+static int cmp_u64(const void *a, const void *b) {
+
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Sample one request in STOCK_PMU_SAMPLE per thread (default 0, off) */
+void pmu_config(void) {
+
+    char *v = getenv("STOCK_PMU_SAMPLE");
+    pmu_count_t a, b;
+    uint64_t costs[PMU_MAX_EVENTS][PMU_CALIBRATE];
+    int kind, exk, i, e;
+
+    if (!v || (pmu_every = atoi(v)) <= 0) {
+        pmu_every = 0;
+        return;
+    }
+    /* The probe's group is kept as the calling thread's */
+    for (kind = PMU_HW; kind <= PMU_SW && my_group < 0; kind++)
+        for (exk = 0; exk <= 1 && my_group < 0; exk++)
+            if ((my_group = group_open(kind, exk)) >= 0) {
+                pmu_kind = kind;
+                exclude_kernel = exk;
+            }
+    if (my_group < 0) {
+        pmu_every = 0;
+        my_group = -2;
+        return;
+    }
+
+    /* The median of back-to-back reads is what a lap's own read adds */
+    for (i = 0; i < PMU_CALIBRATE && pmu_read(&a) == 0 && pmu_read(&b) == 0; i++)
+        for (e = 0; e < PMU_MAX_EVENTS; e++)
+            costs[e][i] = b.v[e] - a.v[e];
+    for (e = 0; i == PMU_CALIBRATE && e < PMU_MAX_EVENTS; e++) {
+        qsort(costs[e], PMU_CALIBRATE, sizeof(uint64_t), cmp_u64);
+        read_cost[e] = costs[e][PMU_CALIBRATE / 2];
+    }
+}
+
+/* The calling thread's counters so far; -1 if it has none */
+int pmu_read(pmu_count_t *c) {
+
+    uint64_t buf[3 + PMU_MAX_EVENTS];
+    int i, n = nevents(pmu_kind);
+
+    if (my_group == -1 && (pmu_kind == PMU_OFF || (my_group = group_open(pmu_kind, exclude_kernel)) < 0))
+        my_group = -2;
+    if (my_group < 0 || read(my_group, buf, sizeof(buf)) != (ssize_t)((3 + n) * sizeof(uint64_t)))
+        return -1;
+    c->enabled = buf[1];
+    c->running = buf[2];
+    for (i = 0; i < n; i++)
+        c->v[i] = buf[3 + i];
+    return 0;
+}
+
+/* Counts from one read to another, less what the reads in between added */
+void pmu_delta(const pmu_count_t *from, const pmu_count_t *to, int reads, uint64_t *d) {
+
+    uint64_t v;
+    int e;
+
+    for (e = 0; e < PMU_MAX_EVENTS; e++) {
+        v = to->v[e] - from->v[e];
+        d[e] = v > reads * read_cost[e] ? v - reads * read_cost[e] : 0;
+    }
+}
+
+/* Per-request averages of s as one line; returns the bytes written */
+int pmu_format(const pmu_sum_t *s, char *buf, size_t cap) {
+
+    double n = s->samples;
+    int len;
+
+    if (pmu_kind == PMU_HW) {
+        len = snprintf(buf, cap, "pmu %lu: cycles %.0f ipc %.2f cache-miss/kinst %.2f br-miss %.2f%%",
+                       (unsigned long)s->samples, s->v[0] / n,
+                       s->v[0] ? (double)s->v[1] / s->v[0] : 0,
+                       s->v[1] ? s->v[2] * 1000.0 / s->v[1] : 0,
+                       s->v[3] ? s->v[4] * 100.0 / s->v[3] : 0);
+    }
+    else {
+        len = snprintf(buf, cap, "pmu %lu: cpu-ns %.0f faults %.3f cs %.3f%s",
+                       (unsigned long)s->samples, s->v[0] / n, s->v[1] / n, s->v[2] / n,
+                       exclude_kernel ? " (user only)" : "");
+    }
+    if (len < 0 || !cap)
+        return 0;
+    return (size_t)len < cap ? len : (int)cap - 1;
+}
+/* $end pmu.c */
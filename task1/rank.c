@@ -0,0 +1,100 @@
+/*
+ * rank.c - skip lists of the stocks ordered by amount or price
+ */
+/* $begin rank.c */
+#include "csapp.h"
+#include "rank.h"
+#include <stdint.h>
+
+void rank_init(rank_t *r) {
+
+    r->head = Calloc(1, sizeof(rank_node_t) + RANK_MAX_LEVEL * sizeof(rank_node_t *));
+    r->head->level = RANK_MAX_LEVEL;
+    r->level = 1;
+    r->rng = (unsigned long long)(uintptr_t)r * 0x9e3779b97f4a7c15ULL | 1;
+}
+
+/* Geometric level with p = 1/4, as in the stock index */
+static int random_level(rank_t *r) {
+
+    unsigned long long x;
+    int level = 1;
+
+    r->rng ^= r->rng << 13;
+    r->rng ^= r->rng >> 7;
+    r->rng ^= r->rng << 17;
+    for (x = r->rng; level < RANK_MAX_LEVEL && (x & 3) == 0; x >>= 2)
+        level++;
+    return level;
+}
+
+/* Whether a comes before b: higher values first, then lower ids */
+static int before(const rank_node_t *a, int value, int id) {
+    return a->value > value || (a->value == value && a->id < id);
+}
+
+/* Last entry before (value, id) on every level in use */
+static void find_preds(rank_t *r, int value, int id, rank_node_t **preds) {
+
+    rank_node_t *e = r->head;
+    int i;
+
+    for (i = r->level - 1; i >= 0; i--) {
+        while (e->next[i] && before(e->next[i], value, id))
+            e = e->next[i];
+        preds[i] = e;
+    }
+}
+
+static void link_entry(rank_t *r, rank_node_t *e) {
+
+    rank_node_t *preds[RANK_MAX_LEVEL];
+    int i;
+
+    if (e->level > r->level)
+        r->level = e->level;
+    find_preds(r, e->value, e->id, preds);
+    for (i = 0; i < e->level; i++) {
+        e->next[i] = preds[i]->next[i];
+        preds[i]->next[i] = e;
+    }
+}
+
+static void unlink_entry(rank_t *r, rank_node_t *e) {
+
+    rank_node_t *preds[RANK_MAX_LEVEL];
+    int i;
+
+    find_preds(r, e->value, e->id, preds);
+    for (i = 0; i < e->level; i++)
+        preds[i]->next[i] = e->next[i];
+}
+
+rank_node_t *rank_insert(rank_t *r, int id, int value, void *item) {
+
+    int level = random_level(r);
+    rank_node_t *e = Malloc(sizeof(rank_node_t) + level * sizeof(rank_node_t *));
+
+    e->value = value;
+    e->id = id;
+    e->level = level;
+    e->item = item;
+    link_entry(r, e);
+    return e;
+}
+
+void rank_remove(rank_t *r, rank_node_t *e) {
+
+    unlink_entry(r, e);
+    Free(e);
+}
+
+/* Give the entry a new value; it keeps its level, so nothing is allocated */
+void rank_move(rank_t *r, rank_node_t *e, int value) {
+
+    if (e->value == value) return;
+    unlink_entry(r, e);
+    e->value = value;
+    link_entry(r, e);
+}
+/* $end rank.c */
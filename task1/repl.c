@@ -0,0 +1,284 @@
+/*
+ * repl.c - primary/follower replication of the stock table
+ */
+/* $begin repl.c */
+#include "csapp.h"
+#include "repl.h"
+#include "log.h"
+#include <time.h>
+
+int repl_role = REPL_PRIMARY;
+unsigned long repl_seq = 0;
+int repl_followers = 0;
+
+/* Records logged since the last pass of the event loop, rendered once */
+static char *batch = NULL;
+static size_t batchlen = 0, batchcap = 0;
+static uint64_t nextBeat = 0;       /* tw_now_ms() of the next heartbeat */
+
+/* Follower side: what the primary's last heartbeat said */
+static struct {
+    int synced;                     /* The snapshot has been applied */
+    int gone;                       /* The primary closed or broke the stream */
+    uint64_t beatAt;                /* Local microseconds the last beat was applied */
+    long lagUs;                     /* How old that beat was by then */
+} follower;
+
+static uint64_t wall_us(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void grow(char **buf, size_t *cap, size_t need) {
+
+    size_t n = *cap ? *cap : 4096;
+
+    if (need <= *cap) return;
+    while (n < need) n *= 2;
+    *buf = Realloc(*buf, n);
+    *cap = n;
+}
+
+static int out_append(repl_t *r, const char *p, size_t n) {
+
+    if (r->outlen - r->outoff + n > r->limit)
+        return -1;
+    if (r->outoff && r->outlen + n > r->outcap) {
+        memmove(r->out, r->out + r->outoff, r->outlen - r->outoff);
+        r->outlen -= r->outoff;
+        r->outoff = 0;
+    }
+    grow(&r->out, &r->outcap, r->outlen + n);
+    memcpy(r->out + r->outlen, p, n);
+    r->outlen += n;
+    return 0;
+}
+
+/* Log the stock's new state; costs a counter while nobody follows */
+void repl_set(TreeNode *node) {
+
+    repl_seq++;
+    if (!repl_followers) return;
+    grow(&batch, &batchcap, batchlen + 64);
+    batchlen += sprintf(batch + batchlen, "set %lu %d %d %d\n", repl_seq, node->stockItem.id,
+                        node->stockItem.amount, node->stockItem.price);
+}
+
+void repl_del(int id) {
+
+    repl_seq++;
+    if (!repl_followers) return;
+    grow(&batch, &batchcap, batchlen + 40);
+    batchlen += sprintf(batch + batchlen, "del %lu %d\n", repl_seq, id);
+}
+
+/* Parents before children, so inserting the rows in order rebuilds the same tree */
+static void render_rows(repl_t *r, TreeNode *node) {
+
+    while (node) {
+        grow(&r->out, &r->outcap, r->outlen + 40);
+        r->outlen += sprintf(r->out + r->outlen, "%d %d %d\n", node->stockItem.id,
+                             node->stockItem.amount, node->stockItem.price);
+        render_rows(r, node->left);
+        node = node->right;
+    }
+}
+
+/*
+ * Turn the connection into a replication stream and queue a snapshot of the
+ * table. Records already in this pass's batch are older than the snapshot.
+ */
+int repl_start(repl_t *r, TreeNode *root) {
+
+    if (r->on) return 0;
+    if (!repl_followers++)
+        nextBeat = 0;
+    r->on = 1;
+    r->acked = repl_seq;
+    r->start = batchlen;
+    grow(&r->out, &r->outcap, 64);
+    r->outlen = sprintf(r->out, "snap %lu\n", repl_seq);
+    render_rows(r, root);
+    grow(&r->out, &r->outcap, r->outlen + 4);
+    r->outlen += sprintf(r->out + r->outlen, "end\n");
+    r->limit = r->outlen + REPL_OUTBUF_MAX;
+    return 0;
+}
+
+void repl_ack(repl_t *r, unsigned long seq) {
+    if (seq > r->acked && seq <= repl_seq)
+        r->acked = seq;
+}
+
+void repl_close(repl_t *r) {
+
+    if (r->on) repl_followers--;
+    Free(r->out);
+    memset(r, 0, sizeof(*r));
+}
+
+/*
+ * Write as much queued output as the socket takes without blocking. Returns
+ * the number of bytes still queued, or -1 if the connection is broken.
+ */
+int repl_flush(repl_t *r, int fd) {
+
+    ssize_t n;
+
+    while (r->outoff < r->outlen) {
+        n = send(fd, r->out + r->outoff, r->outlen - r->outoff, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        r->outoff += n;
+    }
+    if (r->outoff == r->outlen)
+        r->outoff = r->outlen = 0;
+    return r->outlen - r->outoff;
+}
+
+/* Milliseconds until the next heartbeat, -1 while nobody follows */
+long repl_next_ms(uint64_t now) {
+
+    if (!repl_followers) return -1;
+    return now >= nextBeat ? 0 : nextBeat - now;
+}
+
+int repl_due(uint64_t now) {
+    return repl_followers && (batchlen || now >= nextBeat);
+}
+
+/* Close the batch, with a heartbeat if one is due, for repl_send */
+void repl_publish_begin(uint64_t now) {
+
+    if (now < nextBeat) return;
+    grow(&batch, &batchcap, batchlen + 64);
+    batchlen += sprintf(batch + batchlen, "beat %lu %lu\n", repl_seq, (unsigned long)wall_us());
+    nextBeat = now + REPL_BEAT_MS;
+}
+
+/* Queue the batch for the follower; -1 to drop it */
+int repl_send(repl_t *r) {
+
+    size_t start = r->start;
+
+    r->start = 0;
+    if (!r->on || start >= batchlen) return 0;
+    return out_append(r, batch + start, batchlen - start);
+}
+
+void repl_publish_end(void) {
+    batchlen = 0;
+}
+
+/* Connect to the primary at host:port and ask for its log; returns the socket */
+int repl_follow(char *primary) {
+
+    char host[MAXLINE], *colon = strrchr(primary, ':');
+    int fd;
+
+    if (!colon || colon == primary || colon - primary >= MAXLINE)
+        app_error("STOCK_FOLLOW must be <host>:<port>");
+    memcpy(host, primary, colon - primary);
+    host[colon - primary] = '\0';
+    fd = Open_clientfd(host, colon + 1);
+    Rio_writen(fd, "replicate\n", 10);
+    repl_role = REPL_FOLLOWER;
+    return fd;
+}
+
+/*
+ * Parse one line of the primary's stream (a view, not terminated). Returns
+ * -1 for a line that does not belong in it, or a record out of sequence.
+ */
+int repl_parse(char *line, size_t n, repl_rec_t *rec) {
+
+    char text[128];
+    unsigned long us;
+
+    if (n >= sizeof(text)) return -1;
+    memcpy(text, line, n);
+    text[n] = '\0';
+
+    if (!follower.synced) {
+        if (sscanf(text, "%d %d %d", &rec->id, &rec->amount, &rec->price) == 3)
+            rec->op = REPL_ROW;
+        else if (sscanf(text, "snap %lu", &rec->seq) == 1)
+            rec->op = REPL_SNAP;
+        else if (!strcmp(text, "end\n"))
+            rec->op = REPL_END;
+        else
+            return -1;
+        if (rec->op == REPL_SNAP)
+            repl_seq = rec->seq;
+        if (rec->op == REPL_END) {
+            follower.synced = 1;
+            follower.beatAt = wall_us();
+        }
+        return 0;
+    }
+
+    if (sscanf(text, "set %lu %d %d %d", &rec->seq, &rec->id, &rec->amount, &rec->price) == 4)
+        rec->op = REPL_SET;
+    else if (sscanf(text, "del %lu %d", &rec->seq, &rec->id) == 2)
+        rec->op = REPL_DEL;
+    else if (sscanf(text, "beat %lu %lu", &rec->seq, &us) == 2) {
+        rec->op = REPL_BEAT;
+        follower.beatAt = wall_us();
+        follower.lagUs = follower.beatAt - us;
+        return rec->seq == repl_seq ? 0 : -1;
+    }
+    else
+        return -1;
+
+    if (rec->seq != repl_seq + 1) return -1;
+    repl_seq = rec->seq;
+    return 0;
+}
+
+int repl_synced(void) {
+    return follower.synced;
+}
+
+void repl_ack_send(int fd) {
+
+    char buf[64];
+    int n = sprintf(buf, "ack %lu\n", repl_seq);
+
+    /* The primary reads acks as fast as they come, so a full socket only skips one */
+    send(fd, buf, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+void repl_lost(void) {
+    follower.gone = 1;
+}
+
+void repl_promote(void) {
+
+    repl_role = REPL_PRIMARY;
+    follower.gone = 1;
+}
+
+/* The replication row of the stats reply */
+int repl_report(char *buf, size_t cap, const repl_t *r, int n) {
+
+    unsigned long lag = 0;
+    int i;
+
+    if (repl_role == REPL_FOLLOWER)
+        return snprintf(buf, cap, "repl follower seq %lu lag %.1f ms, last beat %lu ms ago%s\n",
+                        repl_seq, follower.lagUs / 1000.0,
+                        (unsigned long)(wall_us() - follower.beatAt) / 1000,
+                        follower.gone ? ", primary gone" : "");
+    for (i = 0; i < n; i++)
+        if (r[i].on && repl_seq - r[i].acked > lag)
+            lag = repl_seq - r[i].acked;
+    return snprintf(buf, cap, "repl primary seq %lu followers %d lag %lu records\n",
+                    repl_seq, repl_followers, lag);
+}
+/* $end repl.c */
@@ -0,0 +1,78 @@
+/* $begin repl.h */
+#ifndef __REPL_H__
+#define __REPL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "stock.h"
+
+/*
+ * Primary/follower replication of the stock table. A follower started with
+ * STOCK_FOLLOW=<host>:<port> connects to the primary's port and sends
+ * "replicate"; the connection then carries the primary's log instead of
+ * replies:
+ *
+ *     snap <seq>\n                 <- once, then the whole table
+ *     <id> <amount> <price>\n      <- one row per stock, in tree preorder
+ *     end\n
+ *     set <seq> <id> <amount> <price>\n    <- a stock was traded or listed
+ *     del <seq> <id>\n                     <- a stock was delisted
+ *     beat <seq> <usec>\n                  <- every REPL_BEAT_MS
+ *
+ * Records carry the stock's new state rather than the trade, are numbered
+ * without gaps and are sent in the order they were applied, batched once per
+ * pass of the event loop. The follower answers each beat with "ack <seq>".
+ * It serves show and subscribe from its copy and refuses trades until
+ * "promote" makes it a primary, which it may do once the primary is gone.
+ */
+
+#define REPL_BEAT_MS        100         /* Heartbeat period of the primary */
+#define REPL_OUTBUF_MAX     (16 << 20)  /* A follower further behind is dropped */
+
+enum { REPL_PRIMARY, REPL_FOLLOWER };
+enum { REPL_ROW, REPL_SNAP, REPL_END, REPL_SET, REPL_DEL, REPL_BEAT };
+
+typedef struct {
+    int op;                         /* REPL_* */
+    unsigned long seq;
+    int id, amount, price;
+} repl_rec_t;
+
+typedef struct {                    /* A follower, as its primary sees it */
+    int on;                         /* The connection sent "replicate" */
+    unsigned long acked;            /* Last seq it acknowledged */
+    size_t start;                   /* Batch bytes its snapshot already covers */
+    size_t limit;                   /* Most bytes it may have queued */
+    char *out;                      /* Bytes queued for the socket */
+    size_t outoff, outlen, outcap;
+} repl_t;
+
+extern int repl_role;
+extern unsigned long repl_seq;      /* Last record logged, or applied by a follower */
+extern int repl_followers;          /* Followers of this primary */
+
+/* Primary */
+void repl_set(TreeNode *node);
+void repl_del(int id);
+int repl_start(repl_t *r, TreeNode *root);
+void repl_ack(repl_t *r, unsigned long seq);
+void repl_close(repl_t *r);
+int repl_flush(repl_t *r, int fd);
+long repl_next_ms(uint64_t now);
+int repl_due(uint64_t now);
+void repl_publish_begin(uint64_t now);
+int repl_send(repl_t *r);
+void repl_publish_end(void);
+
+/* Follower */
+int repl_follow(char *primary);
+int repl_parse(char *line, size_t n, repl_rec_t *rec);
+int repl_synced(void);
+void repl_ack_send(int fd);
+void repl_lost(void);
+void repl_promote(void);
+
+int repl_report(char *buf, size_t cap, const repl_t *r, int n);
+
+#endif /* __REPL_H__ */
+/* $end repl.h */
@@ -0,0 +1,144 @@
+/*
+ * restart.c - hand the listening sockets and the stock table to a successor
+ */
+/* $begin restart.c */
+#include "csapp.h"
+#include "restart.h"
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>            /* csapp.h clashes with _GNU_SOURCE's memfd_create */
+
+char *restart_path = NULL;
+int restart_drain_ms = RESTART_DRAIN_MS;
+
+typedef struct {
+    unsigned magic;
+    int nfds;                       /* Listening sockets; the image fd follows them */
+    long rows;
+} restart_hdr_t;
+
+void restart_config(void) {
+
+    char *v = getenv("STOCK_RESTART_SOCKET");
+
+    restart_path = v && *v ? v : NULL;
+    if ((v = getenv("STOCK_RESTART_DRAIN_MS")) && *v)
+        restart_drain_ms = atoi(v);
+}
+
+/*
+ * Ask a running server for its sockets and table. Blocks while it drains.
+ * Returns 0 with the listening sockets in fds (TCP first) and the table
+ * mapped at *rows, or -1 if there was nobody to take over from.
+ */
+int restart_takeover(int *fds, int *nfds, restart_row_t **rows, long *nrows) {
+
+    struct sockaddr_un addr;
+    restart_hdr_t hdr;
+    char ctl[CMSG_SPACE((RESTART_MAX_FDS + 1) * sizeof(int))];
+    struct iovec iov = { &hdr, sizeof(hdr) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl,
+                          .msg_controllen = sizeof(ctl) };
+    struct cmsghdr *cm;
+    int fd, got[RESTART_MAX_FDS + 1], ngot = 0, i;
+    ssize_t n;
+
+    if (!restart_path || strlen(restart_path) >= sizeof(addr.sun_path))
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, restart_path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(fd, (SA *)&addr, sizeof(addr)) < 0) {
+        Close(fd);
+        return -1;
+    }
+
+    while ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    Close(fd);
+    for (cm = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL; cm; cm = CMSG_NXTHDR(&msg, cm))
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+            ngot = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(got, CMSG_DATA(cm), ngot * sizeof(int));
+        }
+    if (n != sizeof(hdr) || hdr.magic != RESTART_MAGIC || hdr.nfds < 1
+        || hdr.nfds > RESTART_MAX_FDS || ngot != hdr.nfds + 1) {
+        for (i = 0; i < ngot; i++)
+            Close(got[i]);
+        return -1;
+    }
+
+    *rows = NULL;
+    if ((*nrows = hdr.rows) > 0
+        && (*rows = mmap(NULL, hdr.rows * sizeof(restart_row_t), PROT_READ, MAP_PRIVATE,
+                         got[hdr.nfds], 0)) == MAP_FAILED)
+        unix_error("restart image mmap error");
+    Close(got[hdr.nfds]);
+    for (i = 0; i < hdr.nfds; i++)
+        fds[i] = got[i];
+    *nfds = hdr.nfds;
+    return 0;
+}
+
+void restart_release(restart_row_t *rows, long nrows) {
+
+    if (rows)
+        munmap(rows, nrows * sizeof(restart_row_t));
+}
+
+/* Where a successor finds this server; replaces a path a predecessor left */
+int restart_listen(void) {
+    return Open_unix_listenfd(restart_path);
+}
+
+void restart_image_open(restart_image_t *img) {
+
+    int fd;
+
+    if ((img->fd = syscall(SYS_memfd_create, "stock-table", MFD_CLOEXEC)) < 0)
+        unix_error("memfd_create error");
+    if ((fd = dup(img->fd)) < 0)
+        unix_error("dup error");
+    img->fp = Fdopen(fd, "w");
+    img->rows = 0;
+}
+
+void restart_image_add(restart_image_t *img, int id, int amount, int price) {
+
+    restart_row_t row = { id, amount, price };
+
+    fwrite(&row, sizeof(row), 1, img->fp);
+    img->rows++;
+}
+
+/* Send the sockets and the image; the caller exits after, whatever happened */
+int restart_handover(int succfd, const int *fds, int nfds, restart_image_t *img) {
+
+    restart_hdr_t hdr = { RESTART_MAGIC, nfds, img->rows };
+    char ctl[CMSG_SPACE((RESTART_MAX_FDS + 1) * sizeof(int))];
+    struct iovec iov = { &hdr, sizeof(hdr) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl,
+                          .msg_controllen = CMSG_SPACE((nfds + 1) * sizeof(int)) };
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    int all[RESTART_MAX_FDS + 1];
+    ssize_t n;
+
+    if (fclose(img->fp) != 0)
+        return -1;
+    memcpy(all, fds, nfds * sizeof(int));
+    all[nfds] = img->fd;
+    memset(ctl, 0, sizeof(ctl));
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN((nfds + 1) * sizeof(int));
+    memcpy(CMSG_DATA(cm), all, (nfds + 1) * sizeof(int));
+
+    while ((n = sendmsg(succfd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    Close(img->fd);
+    return n == sizeof(hdr) ? 0 : -1;
+}
+/* $end restart.c */
@@ -0,0 +1,52 @@
+/* $begin restart.h */
+#ifndef __RESTART_H__
+#define __RESTART_H__
+
+#include <stdio.h>
+
+/*
+ * Hot restart. A server started with STOCK_RESTART_SOCKET set listens on
+ * that unix socket for a successor. A new server started with the same
+ * setting connects to it before it opens anything. The old server then stops
+ * accepting and drains its connections: requests it already received are
+ * answered, and each connection is closed after them. It writes its stock
+ * table into a memfd and sends it, with its listening sockets, in one
+ * SCM_RIGHTS message, and exits. Clients that connect meanwhile wait in the
+ * backlog of the listening socket both processes hold, and the successor
+ * serves them from the table it was handed, so none is refused and no
+ * trade is lost. A drain that takes longer than STOCK_RESTART_DRAIN_MS
+ * (default RESTART_DRAIN_MS) closes the connections left.
+ *
+ * With nobody listening on the path the new server starts cold, from
+ * stock.txt. Either way it listens on the path for its own successor.
+ */
+
+#define RESTART_DRAIN_MS    1000
+#define RESTART_MAX_FDS     2       /* The TCP and the unix listening sockets */
+#define RESTART_MAGIC       0x53524831u
+
+typedef struct {
+    int id;
+    int amount;
+    int price;
+} restart_row_t;
+
+typedef struct {
+    int fd;                         /* memfd the rows go to */
+    FILE *fp;
+    long rows;
+} restart_image_t;
+
+extern char *restart_path;          /* NULL when hot restart is off */
+extern int restart_drain_ms;
+
+void restart_config(void);
+int restart_takeover(int *fds, int *nfds, restart_row_t **rows, long *nrows);
+void restart_release(restart_row_t *rows, long nrows);
+int restart_listen(void);
+void restart_image_open(restart_image_t *img);
+void restart_image_add(restart_image_t *img, int id, int amount, int price);
+int restart_handover(int succfd, const int *fds, int nfds, restart_image_t *img);
+
+#endif /* __RESTART_H__ */
+/* $end restart.h */
@@ -0,0 +1,148 @@
+/*
+ * rl.c - token-bucket rate limits and connection admission
+ */
+/* $begin rl.c */
+#include "csapp.h"
+#include "rl.h"
+#include "shm.h"
+#include <time.h>
+
+typedef struct {
+    uint64_t key;               /* Source address, 0 while the slot is free */
+    rl_bucket_t tat;
+} rl_addr_t;
+
+int rl_max_conns = 0;
+int rl_queue_max = 0;
+
+static uint64_t conn_interval = 0, addr_interval = 0;  /* ns per token, 0 = no limit */
+static int burst = RL_BURST;
+static rl_addr_t addrs[RL_ADDR_SLOTS];
+
+static int env_int(const char *name, int dflt) {
+
+    char *v = getenv(name);
+
+    return v && *v ? atoi(v) : dflt;
+}
+
+void rl_config(void) {
+
+    int rate;
+
+    if ((rate = env_int("STOCK_RATE_CONN", 0)) > 0)
+        conn_interval = 1000000000ULL / rate;
+    if ((rate = env_int("STOCK_RATE_ADDR", 0)) > 0)
+        addr_interval = 1000000000ULL / rate;
+    if ((burst = env_int("STOCK_RATE_BURST", RL_BURST)) < 1)
+        burst = 1;
+    rl_max_conns = env_int("STOCK_MAX_CONNS", 0);
+    rl_queue_max = env_int("STOCK_QUEUE_MAX", 0);
+}
+
+/* Nonzero key of the peer's address; the port is left out */
+uint64_t rl_addr_key(const struct sockaddr *sa) {
+
+    uint64_t h = 1469598103934665603ULL;
+    const unsigned char *p;
+    size_t i, n;
+
+    if (sa->sa_family == AF_INET) {
+        p = (const unsigned char *)&((const struct sockaddr_in *)sa)->sin_addr;
+        n = 4;
+    }
+    else if (sa->sa_family == AF_INET6) {
+        p = (const unsigned char *)&((const struct sockaddr_in6 *)sa)->sin6_addr;
+        n = 16;
+    }
+    else {
+        return 1;
+    }
+    for (i = 0; i < n; i++)
+        h = (h ^ p[i]) * 1099511628211ULL;
+    return h | 1;
+}
+
+/* Take a token from the bucket if one is left; safe against concurrent takers */
+static int take(rl_bucket_t *tat, uint64_t interval, uint64_t now) {
+
+    uint64_t old = __atomic_load_n(tat, __ATOMIC_RELAXED), next;
+
+    do {
+        next = (old > now ? old : now) + interval;
+        if (next - now > interval * burst)
+            return 0;
+    } while (!__atomic_compare_exchange_n(tat, &old, next, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/*
+ * Bucket of a source address. When the probe window is taken by other
+ * addresses, one whose bucket has refilled (and so holds no state worth
+ * keeping) is evicted; if none has, the address goes unlimited for now.
+ */
+static rl_bucket_t *addr_bucket(uint64_t key, uint64_t now) {
+
+    uint64_t h = key * 0x9e3779b97f4a7c15ULL;
+    rl_addr_t *a, *victim = NULL;
+    int i;
+
+    for (i = 0; i < RL_ADDR_PROBE; i++) {
+        uint64_t k, expected = 0;
+
+        a = &addrs[(h + i) & (RL_ADDR_SLOTS - 1)];
+        k = __atomic_load_n(&a->key, __ATOMIC_RELAXED);
+        if (k == key)
+            return &a->tat;
+        if (k == 0) {
+            if (__atomic_compare_exchange_n(&a->key, &expected, key, 0,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+                || expected == key)
+                return &a->tat;
+            continue;
+        }
+        if (!victim && __atomic_load_n(&a->tat, __ATOMIC_RELAXED) <= now)
+            victim = a;
+    }
+    if (!victim)
+        return NULL;
+    __atomic_store_n(&victim->key, key, __ATOMIC_RELAXED);
+    return &victim->tat;
+}
+
+/* 1 if a request may be served: both its connection and address have a token */
+int rl_admit(rl_bucket_t *conn, uint64_t addr) {
+
+    struct timespec ts;
+    uint64_t now;
+    rl_bucket_t *b;
+
+    if (!conn_interval && !addr_interval)
+        return 1;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    if (conn_interval && !take(conn, conn_interval, now))
+        return 0;
+    if (addr_interval && (b = addr_bucket(addr, now)) && !take(b, addr_interval, now))
+        return 0;
+    return 1;
+}
+
+/* Answer a request with the busy reply */
+void rl_busy(int fd) {
+
+    char buf[MAXLINE] = RL_BUSY_REPLY;
+
+    shm_reply(fd, buf);
+}
+
+/* Turn a new connection away without waiting on it */
+void rl_reject(int fd) {
+
+    char buf[MAXLINE] = RL_BUSY_REPLY;
+
+    send(fd, buf, MAXLINE, MSG_DONTWAIT | MSG_NOSIGNAL);
+    Close(fd);
+}
+/* $end rl.c */
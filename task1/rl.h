@@ -0,0 +1,42 @@
+/* $begin rl.h */
+#ifndef __RL_H__
+#define __RL_H__
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * Admission control and rate limiting. Requests are limited per connection
+ * and per source address by token buckets kept in GCRA form: a bucket is
+ * just the time at which it would be full again, so taking a token is one
+ * compare and add (a CAS for the shared per-address buckets). A request
+ * over either limit is answered with a RL_BUSY_REPLY block instead of being
+ * served. New connections are turned away with the same reply, without
+ * blocking the accept loop, once the server holds rl_max_conns connections
+ * or rl_queue_max of them are waiting to be served.
+ *
+ * All limits come from the environment, and 0 (the default) means none:
+ *   STOCK_RATE_CONN    requests/s per connection
+ *   STOCK_RATE_ADDR    requests/s per source address
+ *   STOCK_RATE_BURST   requests a bucket holds (default RL_BURST)
+ *   STOCK_MAX_CONNS    open connections
+ *   STOCK_QUEUE_MAX    connections with work waiting for the server
+ */
+
+#define RL_BURST        32
+#define RL_ADDR_SLOTS   4096    /* Per-address buckets (power of two) */
+#define RL_ADDR_PROBE   8       /* Slots searched before evicting a full bucket */
+#define RL_BUSY_REPLY   "busy\n"
+
+typedef uint64_t rl_bucket_t;   /* When the bucket is full again, in ns; 0 = full */
+
+extern int rl_max_conns, rl_queue_max;
+
+void rl_config(void);
+uint64_t rl_addr_key(const struct sockaddr *sa);
+int rl_admit(rl_bucket_t *conn, uint64_t addr);
+void rl_busy(int fd);
+void rl_reject(int fd);
+
+#endif /* __RL_H__ */
+/* $end rl.h */
@@ -0,0 +1,85 @@
+/* $begin shm.h */
+#ifndef __SHM_H__
+#define __SHM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Shared-memory channels for clients on the same host. A client connected
+ * over the Unix domain socket creates a POSIX shared memory segment holding
+ * two single-producer single-consumer rings, requests one way and replies
+ * the other, and hands its name to the server with "attach <name>". From
+ * then on requests and replies bypass the socket stack: a message is a
+ * length word and its bytes copied into the ring, and a reply carries only
+ * its text and terminator instead of a whole MAXLINE block.
+ *
+ * A consumer that finds its ring empty spins for a while, then says how it
+ * is going to sleep in the ring's waiting word; the producer checks that
+ * word after publishing, so a busy channel makes no system calls at all. A
+ * thread sleeps on a futex on the ring's tail. The event-driven server,
+ * which cannot wait on a futex and its sockets at once, asks for a doorbell
+ * byte on the socket instead. A producer that finds the ring full sleeps on
+ * a futex on its head the same way. The socket stays open for the doorbell
+ * and so either side notices when the other is gone.
+ */
+
+#define SHM_RING_SIZE   (1 << 16)   /* Bytes per ring (power of two) */
+#define SHM_SPIN        256         /* Polls of an empty ring before sleeping */
+#define SHM_POLL_MS     100         /* A sleeper checks on its peer this often */
+#define SHM_MAX_FD      1024        /* Connections on higher descriptors cannot attach */
+#define SHM_MAGIC       0x53544b31
+
+enum { SHM_AWAKE, SHM_WAIT_FUTEX, SHM_WAIT_DOORBELL };
+
+typedef struct {
+    uint32_t tail __attribute__((aligned(64)));     /* Bytes produced */
+    uint32_t head __attribute__((aligned(64)));     /* Bytes consumed */
+    uint32_t waiting __attribute__((aligned(64)));  /* SHM_WAIT_* of a sleeping consumer */
+    uint32_t full;                                  /* The producer sleeps for space */
+    char data[SHM_RING_SIZE] __attribute__((aligned(64)));
+} shm_ring_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;          /* sizeof(shm_seg_t), checked on attach */
+    shm_ring_t req;         /* Client to server */
+    shm_ring_t resp;        /* Server to client */
+} shm_seg_t;
+
+typedef struct {
+    shm_seg_t *seg;
+    int fd;                 /* The Unix socket the channel was attached on */
+    int timeout_ms;         /* How long a send waits for space, -1 for ever */
+    int broken;             /* A send timed out or the peer corrupted a ring */
+} shm_chan_t;
+
+extern shm_chan_t *shm_chans[SHM_MAX_FD];
+extern int shm_count;       /* Channels attached to this server */
+
+/* Server side */
+int shm_attach(int fd, char *name, int timeout_ms);
+void shm_detach(int fd);
+void shm_reply(int fd, const char *buf);
+int shm_arm_doorbell(shm_chan_t *c);
+int shm_doorbell(int fd);
+
+/* Client side */
+shm_chan_t *shm_connect(char *path);
+void shm_close(shm_chan_t *c);
+
+int shm_send(shm_chan_t *c, shm_ring_t *r, const void *buf, uint32_t n);
+ssize_t shm_recv(shm_chan_t *c, shm_ring_t *r, void *buf, size_t cap, int timeout_ms);
+
+/* Channel a connection attached, NULL for a plain socket */
+static inline shm_chan_t *shm_chan(int fd) {
+    return fd < SHM_MAX_FD ? shm_chans[fd] : NULL;
+}
+
+static inline int shm_pending(shm_ring_t *r) {
+    return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) != r->head;
+}
+
+#endif /* __SHM_H__ */
+/* $end shm.h */
@@ -0,0 +1,298 @@
+/*
+ * stats.c - sharded request counters and latency histograms
+ */
+/* $begin stats.c */
+#include "csapp.h"
+#include "stats.h"
+#include "pmu.h"
+#include <time.h>
+
+typedef struct {
+    uint64_t requests[CMD_NTYPES];
+    uint64_t failures[CMD_NTYPES];
+    uint64_t bytes;
+    hist_t lat[CMD_NTYPES][PH_NPHASES];
+    pmu_sum_t pmu[CMD_NTYPES][PH_NPHASES];
+} stats_data_t;
+
+typedef struct _stats_shard_ {
+    stats_data_t d;
+    struct _stats_shard_ *next;
+} stats_shard_t;
+
+static stats_shard_t *shards = NULL;    /* One per thread that ever recorded */
+static __thread stats_shard_t *my_shard = NULL;
+
+/* Scratch timings of the request the calling thread is serving */
+static __thread uint64_t req_start, req_last;
+static __thread uint64_t req_phase[PH_NPHASES];
+static __thread unsigned req_seen;      /* Bit mask of phases lapped */
+static __thread uint64_t req_frame;     /* When the line's framing began, 0 if not framed */
+
+/* Counters of the request, if it is the one in pmu_every the thread samples */
+static __thread int req_pmu;
+static __thread int req_pmu_reads;      /* Counter reads since req_pmu_start */
+static __thread unsigned req_unsampled;
+static __thread pmu_count_t req_pmu_start, req_pmu_last;
+static __thread uint64_t req_pmu_phase[PH_NPHASES][PMU_MAX_EVENTS];
+
+static const char *cmd_names[] = { "show", "buy", "sell", "order", "cancel", "basket", "top", "busy", "other" };
+static const char *phase_names[] = { "read", "parse", "lookup", "lock", "format", "write", "total" };
+
+uint64_t stats_now(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static stats_shard_t *shard_create(void) {
+
+    stats_shard_t *s = Calloc(1, sizeof(stats_shard_t));
+
+    s->next = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&shards, &s->next, s, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    my_shard = s;
+    return s;
+}
+
+/* Decide whether the request starting now is sampled, and if so read its counters */
+static void pmu_start(void) {
+
+    req_pmu = pmu_every && req_unsampled + 1 >= (unsigned)pmu_every && pmu_read(&req_pmu_start) == 0;
+    req_pmu_last = req_pmu_start;
+    req_pmu_reads = 0;
+}
+
+/* Charge the counters since the previous lap to phase, as stats_lap does the time */
+static void pmu_lap(int phase) {
+
+    pmu_count_t now;
+    uint64_t d[PMU_MAX_EVENTS];
+    int e;
+
+    if (pmu_read(&now) < 0) {
+        req_pmu = 0;
+        return;
+    }
+    pmu_delta(&req_pmu_last, &now, 1, d);
+    for (e = 0; e < PMU_MAX_EVENTS; e++)
+        req_pmu_phase[phase][e] = ((req_seen & (1u << phase)) ? req_pmu_phase[phase][e] : 0) + d[e];
+    req_pmu_last = now;
+    req_pmu_reads++;
+}
+
+/* The request's line is about to be framed */
+void stats_frame(void) {
+
+    req_frame = stats_now();
+    pmu_start();
+}
+
+void stats_unframe(void) {
+    req_frame = 0;
+}
+
+void stats_begin(void) {
+
+    req_seen = 0;
+    if (req_frame) {
+        req_start = req_last = req_frame;
+        req_frame = 0;
+        stats_lap(PH_READ);
+    }
+    else {
+        pmu_start();
+        req_start = req_last = stats_now();
+    }
+    req_unsampled = req_pmu ? 0 : req_unsampled + 1;
+}
+
+/* Charge the time since the previous lap to phase */
+void stats_lap(int phase) {
+
+    uint64_t now = stats_now();
+    uint64_t d = now - req_last;
+
+    if (req_pmu)
+        pmu_lap(phase);
+    req_phase[phase] = (req_seen & (1u << phase)) ? req_phase[phase] + d : d;
+    req_seen |= 1u << phase;
+    req_last = now;
+}
+
+/* Restart the lap clock without charging the elapsed time anywhere */
+void stats_skip(void) {
+
+    if (req_pmu) {
+        req_pmu = pmu_read(&req_pmu_last) == 0;
+        req_pmu_reads++;
+    }
+    req_last = stats_now();
+}
+
+void stats_end(int cmd, int ok, int bytes) {
+
+    stats_shard_t *s = my_shard ? my_shard : shard_create();
+    int ph, e;
+
+    req_phase[PH_TOTAL] = stats_now() - req_start;
+    req_seen |= 1u << PH_TOTAL;
+
+    for (ph = 0; ph < PH_NPHASES; ph++)
+        if (req_seen & (1u << ph))
+            hist_record(&s->d.lat[cmd][ph], req_phase[ph]);
+
+    /* A group the kernel multiplexed missed part of the request; drop it */
+    if (req_pmu) {
+        pmu_count_t now;
+
+        req_pmu = 0;
+        if (pmu_read(&now) == 0 && now.enabled - req_pmu_start.enabled
+                                   == now.running - req_pmu_start.running) {
+            pmu_delta(&req_pmu_start, &now, req_pmu_reads + 1, req_pmu_phase[PH_TOTAL]);
+            for (ph = 0; ph < PH_NPHASES; ph++) {
+                if (!(req_seen & (1u << ph)))
+                    continue;
+                s->d.pmu[cmd][ph].samples++;
+                for (e = 0; e < PMU_MAX_EVENTS; e++)
+                    s->d.pmu[cmd][ph].v[e] += req_pmu_phase[ph][e];
+            }
+        }
+    }
+
+    __atomic_store_n(&s->d.requests[cmd], s->d.requests[cmd] + 1, __ATOMIC_RELAXED);
+    if (!ok)
+        __atomic_store_n(&s->d.failures[cmd], s->d.failures[cmd] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->d.bytes, s->d.bytes + bytes, __ATOMIC_RELAXED);
+}
+
+static void stats_collect(stats_data_t *dst) {
+
+    stats_shard_t *s;
+    int c, ph, e;
+
+    memset(dst, 0, sizeof(*dst));
+    for (s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s; s = s->next) {
+        for (c = 0; c < CMD_NTYPES; c++) {
+            dst->requests[c] += __atomic_load_n(&s->d.requests[c], __ATOMIC_RELAXED);
+            dst->failures[c] += __atomic_load_n(&s->d.failures[c], __ATOMIC_RELAXED);
+            for (ph = 0; ph < PH_NPHASES; ph++) {
+                hist_merge(&dst->lat[c][ph], &s->d.lat[c][ph]);
+                dst->pmu[c][ph].samples += s->d.pmu[c][ph].samples;
+                for (e = 0; e < PMU_MAX_EVENTS; e++)
+                    dst->pmu[c][ph].v[e] += s->d.pmu[c][ph].v[e];
+            }
+        }
+        dst->bytes += __atomic_load_n(&s->d.bytes, __ATOMIC_RELAXED);
+    }
+}
+
+/* Render d as text into buf; returns the number of bytes written */
+static int stats_format(stats_data_t *d, char *buf, size_t cap) {
+
+    size_t len = 0;
+    int c, ph;
+
+#define EMIT(...) do { \
+    int _n = snprintf(buf + len, cap - len, __VA_ARGS__); \
+    if (_n < 0 || (size_t)_n >= cap - len) return len; \
+    len += _n; \
+} while (0)
+
+    EMIT("bytes %lu\n", (unsigned long)d->bytes);
+    for (c = 0; c < CMD_NTYPES; c++) {
+        if (d->requests[c] == 0)
+            continue;
+        EMIT("%s requests %lu failed %lu\n", cmd_names[c],
+             (unsigned long)d->requests[c], (unsigned long)d->failures[c]);
+        for (ph = 0; ph < PH_NPHASES; ph++) {
+            hist_t *h = &d->lat[c][ph];
+            if (h->count == 0)
+                continue;
+            EMIT("  %-6s ns p50 %lu p99 %lu p999 %lu max %lu\n", phase_names[ph],
+                 (unsigned long)hist_percentile(h, 0.50),
+                 (unsigned long)hist_percentile(h, 0.99),
+                 (unsigned long)hist_percentile(h, 0.999),
+                 (unsigned long)h->max);
+            if (d->pmu[c][ph].samples) {
+                EMIT("         ");
+                len += pmu_format(&d->pmu[c][ph], buf + len, cap - len);
+                EMIT("\n");
+            }
+        }
+    }
+#undef EMIT
+    return len;
+}
+
+/* Cumulative report since startup, served by the "stats" command */
+int stats_report(char *buf, size_t cap) {
+
+    stats_data_t *d = Malloc(sizeof(stats_data_t));
+    int n;
+
+    stats_collect(d);
+    n = stats_format(d, buf, cap);
+    Free(d);
+    return n;
+}
+
+static void *dumper(void *vargp) {
+
+    long interval = (long)vargp;
+    stats_data_t *prev = Calloc(1, sizeof(stats_data_t));
+    stats_data_t *cur = Malloc(sizeof(stats_data_t));
+    stats_data_t *delta = Malloc(sizeof(stats_data_t));
+    stats_data_t *tmp;
+    char *buf = Malloc(MAXBUF);
+    int c, ph, e;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        sleep(interval);
+        stats_collect(cur);
+
+        /* Report only what happened during the last interval */
+        memcpy(delta, cur, sizeof(stats_data_t));
+        for (c = 0; c < CMD_NTYPES; c++) {
+            delta->requests[c] -= prev->requests[c];
+            delta->failures[c] -= prev->failures[c];
+            for (ph = 0; ph < PH_NPHASES; ph++) {
+                hist_sub(&delta->lat[c][ph], &prev->lat[c][ph]);
+                delta->pmu[c][ph].samples -= prev->pmu[c][ph].samples;
+                for (e = 0; e < PMU_MAX_EVENTS; e++)
+                    delta->pmu[c][ph].v[e] -= prev->pmu[c][ph].v[e];
+            }
+        }
+        delta->bytes -= prev->bytes;
+        tmp = prev;
+        prev = cur;
+        cur = tmp;
+
+        for (c = 0; c < CMD_NTYPES && delta->requests[c] == 0; c++)
+            ;
+        if (c < CMD_NTYPES && stats_format(delta, buf, MAXBUF) > 0) {
+            flockfile(stdout);
+            printf("---- stats (last %lds, max is since start) ----\n%s", interval, buf);
+            fflush(stdout);
+            funlockfile(stdout);
+        }
+    }
+    return NULL;
+}
+
+/* Dump interval stats every STOCK_STATS_INTERVAL seconds (0 disables) */
+void stats_start_dumper(void) {
+
+    char *env = getenv("STOCK_STATS_INTERVAL");
+    long interval = env ? atol(env) : STATS_INTERVAL;
+    pthread_t tid;
+
+    if (interval > 0)
+        Pthread_create(&tid, NULL, dumper, (void *)interval);
+}
+/* $end stats.c */
@@ -0,0 +1,36 @@
+/* $begin stats.h */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "hist.h"
+
+/*
+ * Per-command request counters and per-phase latency histograms. Each
+ * thread records into its own shard; readers merge all shards on demand.
+ * A request is timed with stats_begin(), stats_lap() at the end of every
+ * phase it goes through, and stats_end() once the reply is written. A
+ * stats_frame() just before the server frames the request line makes
+ * stats_begin() charge the framing to PH_READ; stats_unframe() drops it if
+ * no line came. With STOCK_PMU_SAMPLE set the laps also read the
+ * counters of pmu.h.
+ */
+
+enum { CMD_SHOW, CMD_BUY, CMD_SELL, CMD_ORDER, CMD_CANCEL, CMD_BASKET, CMD_TOP, CMD_BUSY, CMD_OTHER, CMD_NTYPES };
+enum { PH_READ, PH_PARSE, PH_LOOKUP, PH_LOCK, PH_FORMAT, PH_WRITE, PH_TOTAL, PH_NPHASES };
+
+#define STATS_INTERVAL  60      /* Default seconds between periodic dumps */
+
+uint64_t stats_now(void);
+void stats_frame(void);
+void stats_unframe(void);
+void stats_begin(void);
+void stats_lap(int phase);
+void stats_skip(void);
+void stats_end(int cmd, int ok, int bytes);
+int stats_report(char *buf, size_t cap);
+void stats_start_dumper(void);
+
+#endif /* __STATS_H__ */
+/* $end stats.h */
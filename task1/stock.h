@@ -2,11 +2,15 @@
 #ifndef __STOCK_H__
 #define __STOCK_H__
 
+#include "rank.h"
+
 /* Definition for a stock item */
 typedef struct _stock_ {
     int id;
     int price;
     int amount;
+    struct _book_ *book;    /* Resting orders, created on the first order */
+    rank_node_t *rank[RANK_NKEYS];  /* Entries in the top indexes, once built */
 } stock;
 
 /* Definition for a binary tree node */
@@ -14,7 +18,10 @@ typedef struct _treeNode_ {
     stock stockItem;
     struct _treeNode_ *left;
     struct _treeNode_ *right;
+    int dirty;          /* Queued for the next subscription tick */
 } TreeNode;
 
+#define LOOKUP_BATCH 16     /* Lookups findNodes interleaves */
+
 #endif /* __STOCK_H__ */
 /* $end stock.h */
\ No newline at end of file
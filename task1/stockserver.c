@@ -5,86 +5,284 @@
 #include "stdbool.h"
 #include "csapp.h"
 #include "stock.h"
+#include "book.h"
+#include "log.h"
+#include "stats.h"
+#include "sub.h"
+#include "tw.h"
+#include "rl.h"
+#include "shm.h"
+#include "hp.h"
+#include "repl.h"
+#include "basket.h"
+#include "account.h"
+#include "restart.h"
+#include "pmu.h"
 
 typedef struct { /* Represents a pool of connected descriptors */
 
     int maxfd;          /* Largest descriptor in read_set */
     fd_set read_set;    /* Set of all active descriptors */
     fd_set ready_set;   /* Subset of descriptors ready for reading */
+    fd_set write_set;   /* Subscribers with output queued */
+    fd_set write_ready; /* Subset of write_set ready for writing */
     int nready;         /* Number of ready descriptors from select */
     int maxi;           /* High water index into client array */
     int clientfd[FD_SETSIZE];       /* Set of active descriptors */
     rio_t clientrio[FD_SETSIZE];    /* Set of active read buffers */
+    sub_t sub[FD_SETSIZE];          /* Subscription state per client */
+    repl_t repl[FD_SETSIZE];        /* Replication stream per follower */
+    tw_t wheel;                     /* Connection timeouts */
+    tw_timer_t timer[FD_SETSIZE];   /* Timeout per client */
+    unsigned char tmo[FD_SETSIZE];  /* TMO_* kind the timer is armed for */
+    uint64_t now;                   /* Milliseconds, read once per select */
+    rl_bucket_t bucket[FD_SETSIZE]; /* Request rate limit per client */
+    account_t *acct[FD_SETSIZE];    /* Account the client logged in to, or NULL */
+    uint64_t addr[FD_SETSIZE];      /* Source address key per client */
+    unsigned char more[FD_SETSIZE]; /* Whole lines still buffered after a turn */
+    unsigned char eof[FD_SETSIZE];  /* Client sent EOF; its buffered lines are still served */
+    int nmore;                      /* Clients with more set */
+    int nconns;                     /* Connected clients */
 } pool;
 
+/* Words of a request line past this are ignored; one more than a full basket has */
+#define MAXARGS (2 + 3 * BASKET_MAX)
+#define REQS_PER_TURN 16    /* Lines served per client before the loop moves on */
+
 TreeNode* root = NULL;
 int byte_cnt = 0;
+unsigned long tableGen = 1;    /* Bumped by every trade, see createSnapshotString */
+hp_arena_t nodeArena;           /* Stock nodes, on huge pages with STOCK_HUGEPAGES */
+int primaryfd = -1;             /* A follower's stream from its primary */
+rio_t primaryRio;
+uint64_t drainDeadline = 0;     /* Handing over to a successor once nonzero */
 
 void echo(int connfd);
 void init_pool(int listenfd, pool *p);
-void add_client(int connfd, pool *p);
+void accept_client(pool *p, int listenfd);
+void add_client(int connfd, pool *p, uint64_t addr);
 void check_clients (pool *p);
+void flush_client(pool *p, int i);
+void remove_client(pool *p, int i);
+void publish_tick(pool *p);
+void publish_repl(pool *p);
+int follow_primary(void);
+void applyRecord(repl_rec_t *rec);
+void promote(pool *p, int connfd);
+void arm_doorbells(pool *p);
+void serve_channel(pool *p, int i, shm_chan_t *c);
+void handle_request(pool *p, int i, char *buf, int n);
+void arm_client(pool *p, int i, int kind);
+void expire_client(tw_timer_t *t);
+int start_drain(pool *p, int ctlfd, int listenfd, int unixfd);
+void hand_over(pool *p, int succfd, int listenfd, int unixfd);
 TreeNode* createNode(int id, int amount, int price);
-void addNodeToTree(TreeNode* node);
+bool addNodeToTree(TreeNode* node);
+bool removeNode(int targetId);
 void deleteTree(TreeNode* node);
-void searchAndUpdate(int targetId, int amount, bool action, const int connfd, char* cmd);
-void createResultString(TreeNode* node, char* newBuf);
+bool searchAndUpdate(int targetId, int amount, bool action, account_t* acct, const int connfd, char* cmd);
+bool basketUpdate(basket_leg_t* legs, int n, account_t* acct, const int connfd);
+bool showAccount(account_t* acct, const int connfd);
+void rankTouch(TreeNode* node);
+void rankForget(TreeNode* node);
+bool showTop(int n, int key, const int connfd);
+bool showRange(int lo, int hi, const int connfd);
+TreeNode* findNode(int targetId);
+void findNodes(const int* ids, int n, TreeNode** nodes);
+bool submitOrder(int targetId, int side, int qty, int price, const int connfd);
+bool cancelOrder(int targetId, unsigned oid, const int connfd);
+bool showBook(int targetId, int depth, const int connfd);
+bool listStock(int targetId, int amount, int price, const int connfd);
+bool delistStock(int targetId, const int connfd);
+char* createSnapshotString(void);
+void writeTree(TreeNode* node, FILE* fp);
+void imageTree(TreeNode* node, restart_image_t* img);
 int parseline(char* buf, char** argv);
 
 int main(int argc, char **argv) {
 
-    int listenfd, connfd;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;  /* Enough space for any address */  //line:netp:echoserveri:sockaddrstorage
-    static pool pool;
-    char client_hostname[MAXLINE], client_port[MAXLINE];
+    int listenfd, unixfd = -1, ctlfd = -1, succfd = -1;
+    int lfds[RESTART_MAX_FDS], nlfds = 0;
+    restart_row_t *rows;
+    long r, nrows;
+    pool *p;
+    char *unixPath = getenv("STOCK_UNIX_SOCKET");
+    char *primary = getenv("STOCK_FOLLOW");
     FILE *fp;
 
     if (argc != 2) {
 	    fprintf(stderr, "usage: %s <port>\n", argv[0]);
 	    exit(0);
     }
+    log_init(stdout);
+    stats_start_dumper();
+    tw_config();
+    rl_config();
+    hp_config();
+    acct_config();
+    restart_config();
+    pmu_config();
+    hp_arena_init(&nodeArena, HP_LOCAL);
+    LOG_TEXT(LOG_LVL_INFO, "stock table and connection buffers on %s", hp_mode_name[hp_mode]);
+    if (pmu_every)
+        LOG_TEXT(LOG_LVL_INFO, "%s counters on one request in %d", pmu_kind_name[pmu_kind], pmu_every);
+    Signal(SIGPIPE, SIG_IGN);   /* A client that went away fails its write instead */
 
-    /* File (stock.txt) read start */
-    fp = fopen("stock.txt", "r");
-    if (!fp) {
-        fprintf(stderr, "The file (stock.txt) does not exist. \n");
-        return 0;
+    /* A follower copies the primary's table instead of loading its own */
+    if (primary && *primary) {
+        primaryfd = repl_follow(primary);
+        Rio_readinitb(&primaryRio, primaryfd);
+        while (!repl_synced())
+            if (follow_primary() < 0)
+                app_error("lost the primary before its snapshot arrived");
+        LOG_TEXT(LOG_LVL_INFO, "following %s from seq %lu", primary, repl_seq);
     }
+    else {
+        /*
+         * A running server hands over its table, in its tree order so the
+         * tree keeps its shape; without one the table comes from stock.txt
+         */
+        if (restart_path && restart_takeover(lfds, &nlfds, &rows, &nrows) == 0) {
+            for (r = 0; r < nrows; r++) {
+                TreeNode* node = createNode(rows[r].id, rows[r].amount, rows[r].price);
+
+                if (!addNodeToTree(node))
+                    hp_free(&nodeArena, node, sizeof(TreeNode));
+            }
+            restart_release(rows, nrows);
+            LOG_TEXT(LOG_LVL_INFO, "took over %ld stocks and %d listening sockets", nrows, nlfds);
+        }
+        else {
+            /* File (stock.txt) read start */
+            fp = fopen("stock.txt", "r");
+            if (!fp) {
+                fprintf(stderr, "The file (stock.txt) does not exist. \n");
+                return 0;
+            }
 
-    int s_id, s_amount, s_price;
-    while (fscanf(fp, "%d %d %d", &s_id, &s_amount, &s_price) != -1) {
-        //printf("%d %d %d \n", s_id, s_amount, s_price);
-        TreeNode* node = createNode(s_id, s_amount, s_price);
+            int s_id, s_amount, s_price;
+            while (fscanf(fp, "%d %d %d", &s_id, &s_amount, &s_price) != -1) {
+                //printf("%d %d %d \n", s_id, s_amount, s_price);
+                TreeNode* node = createNode(s_id, s_amount, s_price);
 
-        if (!node) {
+                if (!node) {
+                    fclose(fp);
+                    exit(-1);
+                }
+                if (!addNodeToTree(node))
+                    hp_free(&nodeArena, node, sizeof(TreeNode));
+            }
             fclose(fp);
-            exit(-1);
+            /* File read end */
         }
-        addNodeToTree(node);
+
+        int naccts = acct_load(ACCT_FILE);
+        if (naccts >= 0)
+            LOG_TEXT(LOG_LVL_INFO, "loaded %d accounts from %s", naccts, ACCT_FILE);
+    }
+
+    listenfd = nlfds ? lfds[0] : Open_listenfd(argv[1]);
+    p = hp_map(sizeof(pool), HP_LOCAL);     /* The read buffers of every client */
+    init_pool(listenfd, p);
+
+    /* Same-host clients may also connect, and attach shared memory, here */
+    if (unixPath && *unixPath) {
+        unixfd = nlfds > 1 ? lfds[1] : Open_unix_listenfd(unixPath);
+        FD_SET(unixfd, &p->read_set);
+        if (unixfd > p->maxfd)
+            p->maxfd = unixfd;
+    }
+    else if (nlfds > 1) {
+        Close(lfds[1]);
     }
-    fclose(fp);
-    /* File read end */
 
-    listenfd = Open_listenfd(argv[1]);
-    init_pool(listenfd, &pool);
+    /* Where the next server asks for the sockets; a follower has nothing to hand over */
+    if (restart_path && primaryfd >= 0) {
+        LOG_TEXT(LOG_LVL_WARN, "a follower does not hand over, STOCK_RESTART_SOCKET ignored");
+    }
+    else if (restart_path) {
+        ctlfd = restart_listen();
+        FD_SET(ctlfd, &p->read_set);
+        if (ctlfd > p->maxfd)
+            p->maxfd = ctlfd;
+    }
+    if (primaryfd >= 0) {
+        FD_SET(primaryfd, &p->read_set);
+        if (primaryfd > p->maxfd)
+            p->maxfd = primaryfd;
+    }
 
     while (1) {
+        struct timeval tv, *tvp;
+        long ms;
+
+        if (shm_count)
+            arm_doorbells(p);
+        tvp = sub_timeout(&tv);
+        ms = p->nmore ? 0 : tw_next_ms(&p->wheel, tw_now_ms());
+        if (repl_followers && (ms < 0 || repl_next_ms(tw_now_ms()) < ms))
+            ms = repl_next_ms(tw_now_ms());
+        if (drainDeadline && (ms < 0 || (long)(drainDeadline - tw_now_ms()) < ms))
+            ms = drainDeadline > tw_now_ms() ? (long)(drainDeadline - tw_now_ms()) : 0;
+
+        /* Wake for whichever comes first: the next tick, the next timeout or
+         * heartbeat, or right away if a client still has lines left from its
+         * last turn */
+        if (ms >= 0 && (!tvp || ms * 1000 < tv.tv_sec * 1000000L + tv.tv_usec)) {
+            tv.tv_sec = ms / 1000;
+            tv.tv_usec = ms % 1000 * 1000;
+            tvp = &tv;
+        }
+
 	    /* Wait for listening or connected descriptor(s) to become ready */
-        pool.ready_set = pool.read_set;
-        pool.nready = Select(pool.maxfd + 1, &pool.ready_set, NULL, NULL, NULL);
+        p->ready_set = p->read_set;
+        p->write_ready = p->write_set;
+        p->nready = Select(p->maxfd + 1, &p->ready_set, &p->write_ready, NULL, tvp);
+        p->now = tw_now_ms();
 
         /* If listening descriptor ready, add new client to pool */
-        if (FD_ISSET(listenfd, &pool.ready_set)) {
-            clientlen = sizeof(struct sockaddr_storage);
-            connfd = Accept(listenfd, (SA*)&clientaddr, &clientlen);
-            Getnameinfo((SA *) &clientaddr, clientlen, client_hostname, MAXLINE, client_port, MAXLINE, 0);
-            printf("Connected to (%s, %s)\n", client_hostname, client_port);
-            add_client(connfd, &pool);
+        if (FD_ISSET(listenfd, &p->ready_set))
+            accept_client(p, listenfd);
+        if (unixfd >= 0 && FD_ISSET(unixfd, &p->ready_set))
+            accept_client(p, unixfd);
+
+        /* A successor wants the sockets: stop accepting and let the clients finish */
+        if (ctlfd >= 0 && FD_ISSET(ctlfd, &p->ready_set)) {
+            p->nready--;
+            succfd = start_drain(p, ctlfd, listenfd, unixfd);
+            ctlfd = -1;
+        }
+
+        /* Apply what the primary streamed; once it is gone, serve reads until promoted */
+        if (primaryfd >= 0 && FD_ISSET(primaryfd, &p->ready_set)) {
+            p->nready--;
+            if (follow_primary() < 0) {
+                LOG_TEXT(LOG_LVL_WARN, "primary gone at seq %lu, read-only until promoted",
+                         repl_seq);
+                FD_CLR(primaryfd, &p->read_set);
+                Close(primaryfd);
+                primaryfd = -1;
+                repl_lost();
+            }
         }
 
         /* Echo a text line from each ready connected descriptor */
-        check_clients(&pool);
+        check_clients(p);
+
+        /* Stream this pass's records to followers */
+        if (repl_due(p->now))
+            publish_repl(p);
+
+        /* Push the trades of the last tick to subscribers */
+        if (sub_tick_due())
+            publish_tick(p);
+
+        /* Close connections whose timeout passed */
+        tw_advance(&p->wheel, p->now, expire_client);
+
+        /* Drained, or out of time: the successor takes it from here */
+        if (succfd >= 0 && (p->nconns == 0 || p->now >= drainDeadline))
+            hand_over(p, succfd, listenfd, unixfd);
     }
 
     deleteTree(root);
@@ -94,11 +292,14 @@ int main(int argc, char **argv) {
 
 TreeNode* createNode(int id, int amount, int price) {
 
-    TreeNode* node = (TreeNode*)malloc(sizeof(TreeNode));
+    TreeNode* node = hp_alloc(&nodeArena, sizeof(TreeNode));
     node->stockItem.id = id;
     node->stockItem.amount = amount;
     node->stockItem.price = price;
     node->left = node->right = NULL;
+    node->dirty = 0;
+    node->stockItem.book = NULL;
+    node->stockItem.rank[RANK_AMOUNT] = node->stockItem.rank[RANK_PRICE] = NULL;
 
     return node;
 }
@@ -109,23 +310,25 @@ void deleteTree(TreeNode* node) {
 
     deleteTree(node->left);
     deleteTree(node->right);
+    book_destroy(node->stockItem.book);
     //printf("Delete node %d \n", node->stockItem.id);
-    free(node);
+    hp_free(&nodeArena, node, sizeof(TreeNode));
 }
 
-void addNodeToTree(TreeNode* node) {
+/* Returns false if the id is already listed */
+bool addNodeToTree(TreeNode* node) {
 
     if (root == NULL) {
         root = node;
-        return;
+        return true;
     }
     TreeNode* temp = root;
     int newId = node->stockItem.id;
 
     while (true) {        
         if (newId == temp->stockItem.id) {
-            printf("stock id: %d - already exists. \n", newId);
-            return;
+            LOG_WARN("stock id: %ld - already exists.", newId);
+            return false;
         }
         if (newId < temp->stockItem.id) {
             if (temp->left == NULL) {
@@ -143,7 +346,41 @@ void addNodeToTree(TreeNode* node) {
             }
         }
     }
-    return;
+    return true;
+}
+
+/* Unlink and free a stock; returns false if it is not listed */
+bool removeNode(int targetId) {
+
+    TreeNode** link = &root;
+    TreeNode* node;
+
+    while ((node = *link) && targetId != node->stockItem.id)
+        link = targetId < node->stockItem.id ? &node->left : &node->right;
+    if (!node) return false;
+
+    if (!node->left) {
+        *link = node->right;
+    } else if (!node->right) {
+        *link = node->left;
+    } else {
+        /* Move the in-order successor node into its place */
+        TreeNode** succLink = &node->right;
+        TreeNode* succ;
+
+        while ((succ = *succLink)->left)
+            succLink = &succ->left;
+        *succLink = succ->right;
+        succ->left = node->left;
+        succ->right = node->right;
+        *link = succ;
+    }
+
+    sub_forget(node);
+    rankForget(node);
+    book_destroy(node->stockItem.book);
+    hp_free(&nodeArena, node, sizeof(TreeNode));
+    return true;
 }
 
 void init_pool(int listenfd, pool *p) {
@@ -159,10 +396,43 @@ void init_pool(int listenfd, pool *p) {
     /* Initially, listenfd is only member of select read set */
     p->maxfd = listenfd;
     FD_ZERO(&p->read_set);
+    FD_ZERO(&p->write_set);
     FD_SET(listenfd, &p->read_set);
+    p->now = tw_now_ms();
+    tw_init(&p->wheel, p->now);
 }
 
-void add_client(int connfd, pool *p) {
+void accept_client(pool *p, int listenfd) {
+
+    int connfd;
+    socklen_t clientlen = sizeof(struct sockaddr_storage);
+    struct sockaddr_storage clientaddr;  /* Enough space for any address */  //line:netp:echoserveri:sockaddrstorage
+    char client_hostname[MAXLINE], client_port[MAXLINE];
+
+    connfd = Accept(listenfd, (SA*)&clientaddr, &clientlen);
+
+    /* Turn the client away now rather than let it add to the backlog */
+    if (connfd >= FD_SETSIZE || p->nconns >= FD_SETSIZE
+        || (rl_max_conns && p->nconns >= rl_max_conns)
+        || (rl_queue_max && p->nready + p->nmore > rl_queue_max)) {
+        p->nready--;
+        rl_reject(connfd);
+        stats_begin();
+        stats_end(CMD_BUSY, false, 0);
+        return;
+    }
+
+    if (clientaddr.ss_family == AF_UNIX) {
+        LOG_INFO("Connected on the unix socket, fd: %ld", connfd);
+    }
+    else {
+        Getnameinfo((SA *) &clientaddr, clientlen, client_hostname, MAXLINE, client_port, MAXLINE, 0);
+        LOG_TEXT(LOG_LVL_INFO, "Connected to (%s, %s)", client_hostname, client_port);
+    }
+    add_client(connfd, p, rl_addr_key((SA*)&clientaddr));
+}
+
+void add_client(int connfd, pool *p, uint64_t addr) {
 
     int i;
     p->nready--;
@@ -174,6 +444,19 @@ void add_client(int connfd, pool *p) {
             /* Add connected descriptor to the pool */
             p->clientfd[i] = connfd;
             Rio_readinitb(&p->clientrio[i], connfd);
+            p->timer[i].data = p;
+            arm_client(p, i, TMO_IDLE);
+            p->bucket[i] = 0;
+            p->addr[i] = addr;
+            p->acct[i] = NULL;
+            p->eof[i] = 0;
+            p->nconns++;
+
+            /* Replies are blocking writes; a client that stops reading times them out */
+            if (tw_write_ms > 0) {
+                struct timeval tv = { tw_write_ms / 1000, tw_write_ms % 1000 * 1000 };
+                setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            }
 
             /* Add the descriptor to descriptor set */
             FD_SET(connfd, &p->read_set);
@@ -200,7 +483,7 @@ int parseline(char* buf, char** argv) {
 
     result = strtok(buf, delim);
 
-    while (result) {
+    while (result && argc < MAXARGS) {
         argv[argc++] = result;
         result = strtok(NULL, delim);
     }
@@ -208,14 +491,20 @@ int parseline(char* buf, char** argv) {
     return argc;
 }
 
-void searchAndUpdate(int targetId, int amount, bool action, const int connfd, char* cmd) {   // action: sell if true, buy if false
+bool searchAndUpdate(int targetId, int amount, bool action, account_t* acct, const int connfd, char* cmd) {   // action: sell if true, buy if false
 
     char buf[MAXLINE];
     TreeNode* node = root;
     bool updated = false;
+    const char* refused = NULL;
 
     while (node) {
         if (targetId == node->stockItem.id) {
+            stats_lap(PH_LOOKUP);
+            /* A logged-in client pays for a buy and must hold what it sells */
+            if (acct && (refused = acct_check(acct, targetId, action ? amount : -(long)amount,
+                                              node->stockItem.price)))
+                break;
             if (action || node->stockItem.amount >= amount) {   // sell or buy stock
                 if (action) {
                     node->stockItem.amount += amount;
@@ -224,7 +513,14 @@ void searchAndUpdate(int targetId, int amount, bool action, const int connfd, ch
                     node->stockItem.amount -= amount;
                     sprintf(buf, "[buy] success\n");
                 }
+                if (acct)
+                    acct_trade(acct, targetId, action ? amount : -(long)amount,
+                               node->stockItem.price);
                 updated = true;
+                tableGen++;
+                sub_mark(node);
+                rankTouch(node);
+                repl_set(node);
             }
             break;
         } else if (targetId < node->stockItem.id) {
@@ -234,98 +530,1090 @@ void searchAndUpdate(int targetId, int amount, bool action, const int connfd, ch
         }
     }
 
-    if (!updated) {
+    stats_skip();
+    if (refused) {
+        strcpy(buf, refused);
+    }
+    else if (!updated) {
         sprintf(buf, "Not enough left stock\n");
     }
-    Rio_writen(connfd, buf, MAXLINE);
-    return;
+    stats_lap(PH_FORMAT);
+    shm_reply(connfd, buf);
+    stats_lap(PH_WRITE);
+    return updated;
+}
+
+/*
+ * Check every leg of a basket before applying any. The event loop runs one
+ * request at a time, so nothing can come between the check and the update.
+ */
+bool basketUpdate(basket_leg_t* legs, int n, account_t* acct, const int connfd) {
+
+    char buf[MAXLINE];
+    TreeNode* nodes[BASKET_MAX];
+    int ids[BASKET_MAX] = {0};
+    long cash = acct ? acct->cash : 0;
+    bool ok = true;
+    int i;
+
+    for (i = 0; i < n; i++)
+        ids[i] = legs[i].id;
+    findNodes(ids, n, nodes);
+    for (i = 0; ok && i < n; i++) {
+        if (!nodes[i])
+            sprintf(buf, "No such stock (id %d)\n", legs[i].id);
+        else if (nodes[i]->stockItem.amount + legs[i].delta < 0)
+            sprintf(buf, "Not enough left stock (id %d)\n", legs[i].id);
+        else if (acct && legs[i].delta > 0 && acct_held(acct, legs[i].id) < legs[i].delta)
+            sprintf(buf, "Not enough position (id %d)\n", legs[i].id);
+        else {
+            cash += legs[i].delta * nodes[i]->stockItem.price;
+            continue;
+        }
+        ok = false;
+    }
+    /* The sells of the basket pay for its buys */
+    if (ok && acct && cash < 0) {
+        sprintf(buf, "Not enough cash\n");
+        ok = false;
+    }
+    stats_lap(PH_LOOKUP);
+
+    if (ok) {
+        for (i = 0; i < n; i++) {
+            if (acct)
+                acct_trade(acct, legs[i].id, legs[i].delta, nodes[i]->stockItem.price);
+            nodes[i]->stockItem.amount += legs[i].delta;
+            sub_mark(nodes[i]);
+            rankTouch(nodes[i]);
+            repl_set(nodes[i]);
+        }
+        tableGen++;
+        sprintf(buf, "[basket] success\n");
+    }
+    stats_skip();
+    shm_reply(connfd, buf);
+    stats_lap(PH_WRITE);
+    return ok;
+}
+
+bool showAccount(account_t* acct, const int connfd) {
+
+    char buf[MAXLINE];
+
+    memset(buf, '\0', sizeof(buf));
+    if (acct)
+        acct_report(acct, buf, MAXLINE - 1);
+    else
+        sprintf(buf, "Not logged in\n");
+    shm_reply(connfd, buf);
+    return acct != NULL;
 }
 
-void createResultString(TreeNode* node, char* newBuf) {
+TreeNode* findNode(int targetId) {
+
+    TreeNode* node = root;
+
+    while (node && targetId != node->stockItem.id)
+        node = targetId < node->stockItem.id ? node->left : node->right;
+    return node;
+}
+
+/*
+ * findNode for n ids at once. One walk has to wait for each node before it
+ * knows the next, so the walks are interleaved instead: every round takes
+ * each unfinished walk one node down and prefetches that node, which then
+ * arrives while the other walks take their step. nodes[k] is NULL for an id
+ * that is not listed.
+ */
+void findNodes(const int* ids, int n, TreeNode** nodes) {
+
+    TreeNode* node;
+    int k, base, m, active;
+
+    for (base = 0; base < n; base += LOOKUP_BATCH) {
+        m = n - base < LOOKUP_BATCH ? n - base : LOOKUP_BATCH;
+        for (k = 0; k < m; k++)
+            nodes[base + k] = root;
+        do {
+            active = 0;
+            for (k = base; k < base + m; k++) {
+                if (!(node = nodes[k]) || node->stockItem.id == ids[k])
+                    continue;
+                node = ids[k] < node->stockItem.id ? node->left : node->right;
+                __builtin_prefetch(node);
+                nodes[k] = node;
+                active = 1;
+            }
+        } while (active);
+    }
+}
+
+/*
+ * Ids of the buy and sell requests among the next LOOKUP_BATCH complete
+ * lines at p. Returns how many lines it looked at.
+ */
+static int pipelinedIds(char* p, int len, int* ids, int* nids) {
+
+    char *end = p + len, *nl;
+    int lines = 0;
+
+    *nids = 0;
+    while (lines < LOOKUP_BATCH && (nl = memchr(p, '\n', end - p))) {
+        if (!strncmp(p, "buy ", 4))
+            ids[(*nids)++] = atoi(p + 4);
+        else if (!strncmp(p, "sell ", 5))
+            ids[(*nids)++] = atoi(p + 5);
+        lines++;
+        p = nl + 1;
+    }
+    return lines;
+}
+
+/*
+ * Match a limit (price > 0) or market (price 0) order against the stock's
+ * book. A fill moves the stock's price to the last fill price. amount is the
+ * server's own inventory that buy and sell trade against, so fills between
+ * clients leave it alone.
+ */
+bool submitOrder(int targetId, int side, int qty, int price, const int connfd) {
+
+    char buf[MAXLINE];
+    TreeNode* node = findNode(targetId);
+    book_result_t res;
+    int rc = -1;
+
+    stats_lap(PH_LOOKUP);
+    if (node) {
+        if (!node->stockItem.book)
+            node->stockItem.book = book_create();
+        rc = book_submit(node->stockItem.book, side, qty, price, &res);
+        if (res.filled && res.last_price != node->stockItem.price) {
+            node->stockItem.price = res.last_price;
+            tableGen++;
+            sub_mark(node);
+            rankTouch(node);
+            repl_set(node);
+        }
+    }
+
+    stats_skip();
+    if (!node)
+        sprintf(buf, "No such stock\n");
+    else if (rc < 0 && !res.filled)
+        sprintf(buf, "Not accepted\n");
+    else
+        sprintf(buf, "[order] oid %u filled %d avg %ld resting %d\n", res.oid, res.filled,
+                res.filled ? res.notional / res.filled : 0, res.rested);
+    stats_lap(PH_FORMAT);
+    shm_reply(connfd, buf);
+    stats_lap(PH_WRITE);
+
+    return node && (rc == 0 || res.filled);
+}
+
+bool cancelOrder(int targetId, unsigned oid, const int connfd) {
+
+    char buf[MAXLINE];
+    TreeNode* node = findNode(targetId);
+    int qty = -1;
+
+    stats_lap(PH_LOOKUP);
+    if (node && node->stockItem.book)
+        qty = book_cancel(node->stockItem.book, oid);
+
+    stats_skip();
+    if (qty < 0)
+        sprintf(buf, "No such order\n");
+    else
+        sprintf(buf, "[cancel] oid %u qty %d\n", oid, qty);
+    stats_lap(PH_FORMAT);
+    shm_reply(connfd, buf);
+    stats_lap(PH_WRITE);
+
+    return qty >= 0;
+}
+
+bool showBook(int targetId, int depth, const int connfd) {
+
+    char buf[MAXLINE];
+    TreeNode* node = findNode(targetId);
+    int len = 0;
+
+    memset(buf, '\0', sizeof(buf));
+    if (!node) {
+        sprintf(buf, "No such stock\n");
+    }
+    else {
+        if (node->stockItem.book)
+            len = book_render(node->stockItem.book, buf, MAXLINE - 1, depth);
+        if (!len)
+            sprintf(buf, "empty book\n");
+    }
+    shm_reply(connfd, buf);
+
+    return node != NULL;
+}
+
+/* Show rows point at nodes, so listing or delisting rebuilds them */
+static void showCacheReset(void);
+
+bool listStock(int targetId, int amount, int price, const int connfd) {
+
+    char buf[MAXLINE];
+    TreeNode* node = NULL;
+    bool listed = false;
+
+    if (amount >= 0 && price >= 0 && (node = createNode(targetId, amount, price)) != NULL)
+        listed = addNodeToTree(node);
+    if (listed) {
+        showCacheReset();
+        tableGen++;
+        sub_mark(node);
+        rankTouch(node);
+        repl_set(node);
+    }
+    else {
+        hp_free(&nodeArena, node, sizeof(TreeNode));
+    }
+
+    sprintf(buf, listed ? "[list] success\n" : "Not listed\n");
+    shm_reply(connfd, buf);
+    return listed;
+}
+
+bool delistStock(int targetId, const int connfd) {
+
+    char buf[MAXLINE];
+    bool removed = removeNode(targetId);
+
+    if (removed) {
+        showCacheReset();
+        tableGen++;
+        repl_del(targetId);
+    }
+    sprintf(buf, removed ? "[delist] success\n" : "No such stock\n");
+    shm_reply(connfd, buf);
+    return removed;
+}
+
+/* A show reply is a single MAXLINE block, so rows that do not fit are cut */
+#define SHOW_ROW_MAX 36
+#define SHOW_ROWS_MAX (MAXLINE / 6 + 1)     /* "1 0 0\n" is the shortest row */
+
+/*
+ * show is served straight from a pre-rendered reply. tableGen counts
+ * successful trades; while it matches the cache, show is a single write.
+ * Otherwise only rows whose amount changed are re-rendered and the reply is
+ * re-copied from the first changed row onwards.
+ */
+typedef struct {
+    TreeNode* node;
+    int amount, price;          /* Values text was rendered from */
+    int len;                    /* Length of text, 0 until first rendered */
+    int off;                    /* Offset of the row in buf, -1 if cut off */
+    char text[SHOW_ROW_MAX];
+} showRow;
+
+static struct {
+    showRow* rows;              /* In-order prefix of the table */
+    int nrows;
+    int len;                    /* Bytes of buf in use */
+    unsigned long gen;          /* tableGen buf reflects, 0 before the first show */
+    char buf[MAXLINE];
+} showCache;
+
+static void collectRows(TreeNode* node) {
+
+    if (!node || showCache.nrows == SHOW_ROWS_MAX) return;
+
+    collectRows(node->left);
+    if (showCache.nrows == SHOW_ROWS_MAX) return;
+    showCache.rows[showCache.nrows].node = node;
+    showCache.rows[showCache.nrows].off = -1;
+    showCache.nrows++;
+    collectRows(node->right);
+}
+
+static void showCacheReset(void) {
+
+    Free(showCache.rows);
+    showCache.rows = NULL;
+    showCache.nrows = 0;
+    memset(showCache.buf, '\0', showCache.len);
+    showCache.len = 0;
+    showCache.gen = 0;
+}
+
+/* Return the show reply (MAXLINE bytes), refreshing it if trades happened */
+char* createSnapshotString(void) {
+
+    int i, len, first = -1;
+
+    if (showCache.gen == tableGen)
+        return showCache.buf;
+
+    if (!showCache.rows) {
+        showCache.rows = Calloc(SHOW_ROWS_MAX, sizeof(showRow));
+        collectRows(root);
+        if (showCache.nrows) showCache.rows[0].off = 0;
+    }
+
+    for (i = 0; i < showCache.nrows; i++) {
+        showRow* row = &showCache.rows[i];
+        stock* item = &row->node->stockItem;
+
+        if (row->len && item->amount == row->amount && item->price == row->price)
+            continue;
+        row->amount = item->amount;
+        row->price = item->price;
+        row->len = sprintf(row->text, "%d %d %d\n", item->id, item->amount, item->price);
+        if (first < 0)
+            first = i;
+    }
+
+    if (first >= 0 && showCache.rows[first].off >= 0) {
+        /* Rows before first are unchanged and so is everything up to its offset */
+        len = showCache.rows[first].off;
+        for (i = first; i < showCache.nrows; i++) {
+            showRow* row = &showCache.rows[i];
+            if (len >= MAXLINE - SHOW_ROW_MAX) {
+                row->off = -1;
+                continue;
+            }
+            row->off = len;
+            memcpy(showCache.buf + len, row->text, row->len);
+            len += row->len;
+        }
+        if (len < showCache.len)
+            memset(showCache.buf + len, '\0', showCache.len - len);
+        showCache.len = len;
+    }
+    showCache.gen = tableGen;
+    return showCache.buf;
+}
+
+void writeTree(TreeNode* node, FILE* fp) {
 
     if (!node) return;
 
-    char tmp[10];
+    writeTree(node->left, fp);
+    fprintf(fp, "%d %d %d\n", node->stockItem.id, node->stockItem.amount, node->stockItem.price);
+    writeTree(node->right, fp);
+}
 
-    createResultString(node->left, newBuf);
+/* Preorder, so inserting the rows in turn builds the same tree */
+void imageTree(TreeNode* node, restart_image_t* img) {
 
-    sprintf(tmp, "%d", node->stockItem.id);
-    strcat(newBuf, tmp);
-    strcat(newBuf, " ");
-    sprintf(tmp, "%d", node->stockItem.amount);
-    strcat(newBuf, tmp);
-    strcat(newBuf, " ");
-    sprintf(tmp, "%d", node->stockItem.price);
-    strcat(newBuf, tmp);
-    strcat(newBuf, "\n");
+    if (!node) return;
 
-    createResultString(node->right, newBuf);
+    restart_image_add(img, node->stockItem.id, node->stockItem.amount, node->stockItem.price);
+    imageTree(node->left, img);
+    imageTree(node->right, img);
 }
 
-void check_clients (pool *p) {
+/* Rows of the stocks with lo <= id <= hi in id order, cut like show */
+static int renderRange(TreeNode* node, int lo, int hi, char* buf, int len) {
+
+    while (node && len < MAXLINE - SHOW_ROW_MAX) {
+        stock* item = &node->stockItem;
+
+        if (item->id > lo)
+            len = renderRange(node->left, lo, hi, buf, len);
+        if (item->id >= lo && item->id <= hi && len < MAXLINE - SHOW_ROW_MAX)
+            len += sprintf(buf + len, "%d %d %d\n", item->id, item->amount, item->price);
+        if (item->id >= hi)
+            break;
+        node = node->right;
+    }
+    return len;
+}
+
+/* show <lo> <hi>: only the subtrees that overlap the range are visited */
+bool showRange(int lo, int hi, const int connfd) {
 
-    int i, connfd, n;
-    char cmd_experiment[20];
-    char buf_copy[20];
     char buf[MAXLINE];
-    rio_t rio;
 
-    for (i = 0; (i <= p->maxi) && (p->nready > 0); i++) {
+    memset(buf, '\0', sizeof(buf));
+    renderRange(root, lo, hi, buf, 0);
+    stats_lap(PH_LOOKUP);
+    shm_reply(connfd, buf);
+    stats_lap(PH_WRITE);
+    return true;
+}
 
-        connfd = p->clientfd[i];
-        rio = p->clientrio[i];
+/*
+ * top is served from one rank index per value. The indexes are built by
+ * the first top and kept up to date from then on wherever a stock's amount
+ * or price changes, so until someone asks, trades pay a branch for them.
+ */
+static rank_t ranks[RANK_NKEYS];
+static bool ranked = false;
+
+/* Bring the stock's entries up to its amount and price */
+void rankTouch(TreeNode* node) {
+
+    stock* item = &node->stockItem;
+    int value[RANK_NKEYS] = { item->amount, item->price };
+    int k;
+
+    if (!ranked) return;
+    for (k = 0; k < RANK_NKEYS; k++) {
+        if (item->rank[k])
+            rank_move(&ranks[k], item->rank[k], value[k]);
+        else
+            item->rank[k] = rank_insert(&ranks[k], item->id, value[k], node);
+    }
+}
+
+void rankForget(TreeNode* node) {
+
+    int k;
+
+    for (k = 0; k < RANK_NKEYS; k++) {
+        if (node->stockItem.rank[k]) {
+            rank_remove(&ranks[k], node->stockItem.rank[k]);
+            node->stockItem.rank[k] = NULL;
+        }
+    }
+}
+
+static void rankBuild(TreeNode* node) {
+
+    while (node) {
+        rankBuild(node->left);
+        rankTouch(node);
+        node = node->right;
+    }
+}
+
+/* top <n> amount|price: the n stocks with the most, ties by id, cut like show */
+bool showTop(int n, int key, const int connfd) {
 
-        /* If the descriptor is ready, echo a text line from it */
-        if ((connfd > 0) && (FD_ISSET(connfd, &p->ready_set))) {
+    char buf[MAXLINE];
+    rank_node_t* e;
+    int k, len = 0;
+
+    if (!ranked) {
+        for (k = 0; k < RANK_NKEYS; k++)
+            rank_init(&ranks[k]);
+        ranked = true;
+        rankBuild(root);
+    }
+    memset(buf, '\0', sizeof(buf));
+    for (e = rank_first(&ranks[key]); e && n-- > 0 && len < MAXLINE - SHOW_ROW_MAX; e = rank_next(e)) {
+        stock* item = &((TreeNode*)e->item)->stockItem;
+        len += sprintf(buf + len, "%d %d %d\n", item->id, item->amount, item->price);
+    }
+    stats_lap(PH_LOOKUP);
+    shm_reply(connfd, buf);
+    stats_lap(PH_WRITE);
+    return true;
+}
+
+/* Write queued subscription or replication output; keep the fd in write_set while some is left */
+void flush_client(pool *p, int i) {
+
+    int connfd = p->clientfd[i];
+    sub_t *s = &p->sub[i];
+    repl_t *r = &p->repl[i];
+    int queued = r->on ? r->outlen - r->outoff : s->outlen - s->outoff;
+    int left = r->on ? repl_flush(r, connfd) : sub_flush(s, connfd);
+
+    if (left < 0) {
+        remove_client(p, i);
+        return;
+    }
+    if (left) {
+        FD_SET(connfd, &p->write_set);
+        /* The write timeout restarts only when the subscriber takes some output */
+        if (left < queued || !tw_pending(&p->timer[i]) || p->tmo[i] != TMO_WRITE)
+            arm_client(p, i, TMO_WRITE);
+    }
+    else {
+        FD_CLR(connfd, &p->write_set);
+        tw_del(&p->wheel, &p->timer[i]);    /* An idle feed is not an idle client */
+    }
+}
+
+void remove_client(pool *p, int i) {
+
+    int connfd = p->clientfd[i];
+
+    shm_detach(connfd);
+    Close(connfd);
+    FD_CLR(connfd, &p->read_set);
+    FD_CLR(connfd, &p->write_set);
+    sub_close(&p->sub[i]);
+    repl_close(&p->repl[i]);
+    tw_del(&p->wheel, &p->timer[i]);
+    if (p->more[i]) {
+        p->more[i] = 0;
+        p->nmore--;
+    }
+    p->clientfd[i] = -1;
+    p->nconns--;
+
+    /* A follower's table is the primary's to save, a draining one the successor's */
+    if (repl_role == REPL_FOLLOWER || drainDeadline)
+        return;
+
+    /* File (stock.txt) write start */
+    FILE *fp = fopen("stock.txt", "w");
+    if (!fp) {
+        fprintf(stderr, "The file (stock.txt) does not exist. \n");
+        return;
+    }
+
+    writeTree(root, fp);
+    fclose(fp);
+    /* File write end */
+
+    if (acct_save(ACCT_FILE) < 0)
+        fprintf(stderr, "The file (%s) could not be written. \n", ACCT_FILE);
+}
+
+/*
+ * Stop accepting, and stop reading new requests: every client is answered
+ * what it already sent and then reads EOF. Returns the successor's socket.
+ */
+int start_drain(pool *p, int ctlfd, int listenfd, int unixfd) {
+
+    int i, succfd = Accept(ctlfd, NULL, NULL);
+
+    FD_CLR(listenfd, &p->read_set);
+    if (unixfd >= 0)
+        FD_CLR(unixfd, &p->read_set);
+    FD_CLR(ctlfd, &p->read_set);
+    Close(ctlfd);
+    for (i = 0; i <= p->maxi; i++)
+        if (p->clientfd[i] >= 0)
+            shutdown(p->clientfd[i], SHUT_RD);
+    drainDeadline = p->now + restart_drain_ms;
+    LOG_TEXT(LOG_LVL_INFO, "handing over, draining %d connections", p->nconns);
+    return succfd;
+}
+
+/*
+ * Close what the drain left, then send the successor the sockets and table
+ * and exit. If the successor is gone by then, the table goes to stock.txt
+ * instead, so the drain's trades survive.
+ */
+void hand_over(pool *p, int succfd, int listenfd, int unixfd) {
+
+    int i, fds[RESTART_MAX_FDS], nfds = 0;
+    restart_image_t img;
+    FILE *fp;
+
+    for (i = 0; i <= p->maxi; i++)
+        if (p->clientfd[i] >= 0)
+            remove_client(p, i);
+    if (acct_save(ACCT_FILE) < 0)
+        fprintf(stderr, "The file (%s) could not be written. \n", ACCT_FILE);
+
+    restart_image_open(&img);
+    imageTree(root, &img);
+    fds[nfds++] = listenfd;
+    if (unixfd >= 0)
+        fds[nfds++] = unixfd;
+    if (restart_handover(succfd, fds, nfds, &img) < 0) {
+        /* The drain skipped the disconnect saves; keep its trades for a cold start */
+        LOG_TEXT(LOG_LVL_ERROR, "successor gone, %ld stocks saved to stock.txt", img.rows);
+        if (!(fp = fopen("stock.txt", "w"))) {
+            fprintf(stderr, "The file (stock.txt) does not exist. \n");
+        }
+        else {
+            writeTree(root, fp);
+            fclose(fp);
+        }
+    }
+    else
+        LOG_TEXT(LOG_LVL_INFO, "handed over %ld stocks", img.rows);
+    exit(0);
+}
+
+/* Render the tick once and queue each subscriber its slices of it */
+void publish_tick(pool *p) {
+
+    int i;
+
+    sub_tick_begin();
+    for (i = 0; i <= p->maxi; i++) {
+        if (p->clientfd[i] < 0 || !p->sub[i].nranges)
+            continue;
+        if (sub_tick_send(&p->sub[i]) < 0) {
+            LOG_WARN("subscriber on fd %ld fell too far behind, dropped", p->clientfd[i]);
+            remove_client(p, i);
+            continue;
+        }
+        flush_client(p, i);
+    }
+    sub_tick_end();
+}
+
+/* Queue each follower the records logged in this pass of the loop */
+void publish_repl(pool *p) {
+
+    int i;
+
+    repl_publish_begin(p->now);
+    for (i = 0; i <= p->maxi; i++) {
+        if (p->clientfd[i] < 0 || !p->repl[i].on)
+            continue;
+        if (repl_send(&p->repl[i]) < 0) {
+            LOG_WARN("follower on fd %ld fell too far behind, dropped", p->clientfd[i]);
+            remove_client(p, i);
+            continue;
+        }
+        flush_client(p, i);
+    }
+    repl_publish_end();
+}
+
+/* One read() into the client's buffer, behind what is still unread */
+static ssize_t fill_client(rio_t *rp) {
+
+    ssize_t n;
+
+    if (rp->rio_cnt)
+        memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+    rp->rio_bufptr = rp->rio_buf;
+    while ((n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt, RIO_BUFSIZE - rp->rio_cnt)) < 0
+           && errno == EINTR)
+        ;
+    if (n > 0)
+        rp->rio_cnt += n;
+    return n;
+}
+
+/* A whole line, or a full buffer of one, is waiting to be read */
+static int line_ready(rio_t *rp) {
+    return rp->rio_cnt == RIO_BUFSIZE || memchr(rp->rio_bufptr, '\n', rp->rio_cnt);
+}
+
+/* Read what the primary streamed and apply its whole records; -1 once it is gone */
+int follow_primary(void) {
+
+    repl_rec_t rec;
+    char *line;
+    ssize_t n;
+
+    if (fill_client(&primaryRio) <= 0)
+        return -1;
+    while ((n = rio_getline(&primaryRio, &line, MAXLINE, 0)) > 0) {
+        if (repl_parse(line, n, &rec) < 0) {
+            LOG_TEXT(LOG_LVL_ERROR, "bad record from the primary after seq %lu", repl_seq);
+            return -1;
+        }
+        applyRecord(&rec);
+    }
+    return 0;
+}
+
+/* Give this follower's table the state a record carries, as a trade would */
+void applyRecord(repl_rec_t *rec) {
+
+    TreeNode* node;
+
+    switch (rec->op) {
+    case REPL_ROW:
+    case REPL_SET:
+        if ((node = findNode(rec->id)) != NULL) {
+            node->stockItem.amount = rec->amount;
+            node->stockItem.price = rec->price;
+        }
+        else {
+            node = createNode(rec->id, rec->amount, rec->price);
+            addNodeToTree(node);
+            showCacheReset();
+        }
+        tableGen++;
+        sub_mark(node);
+        rankTouch(node);
+        break;
+    case REPL_DEL:
+        if (removeNode(rec->id)) {
+            showCacheReset();
+            tableGen++;
+        }
+        break;
+    case REPL_BEAT:
+        repl_ack_send(primaryfd);
+        break;
+    }
+}
+
+/* Stop following, if the primary is not gone already, and take trades from now on */
+void promote(pool *p, int connfd) {
+
+    char buf[MAXLINE];
+
+    if (repl_role != REPL_FOLLOWER) {
+        sprintf(buf, "Already primary\n");
+    }
+    else {
+        if (primaryfd >= 0) {
+            FD_CLR(primaryfd, &p->read_set);
+            Close(primaryfd);
+            primaryfd = -1;
+        }
+        repl_promote();
+        /* Accounts are not replicated: take whatever the directory last saved */
+        acct_load(ACCT_FILE);
+        LOG_TEXT(LOG_LVL_WARN, "promoted to primary at seq %lu", repl_seq);
+        sprintf(buf, "[promote] primary at seq %lu\n", repl_seq);
+    }
+    shm_reply(connfd, buf);
+}
+
+void arm_client(pool *p, int i, int kind) {
+
+    int ms = tw_timeout_ms(kind);
+
+    p->tmo[i] = kind;
+    if (ms)
+        tw_add(&p->wheel, &p->timer[i], p->now + ms);
+    else
+        tw_del(&p->wheel, &p->timer[i]);
+}
+
+void expire_client(tw_timer_t *t) {
+
+    pool *p = t->data;
+    int i = t - p->timer;
+
+    LOG_TEXT(LOG_LVL_INFO, "fd %d: %s timeout, closing", p->clientfd[i], tw_kind_name[p->tmo[i]]);
+    remove_client(p, i);
+}
 
+void check_clients (pool *p) {
+
+    int i, k, connfd, n, nids;
+    int ids[LOOKUP_BATCH];
+    TreeNode *nodes[LOOKUP_BATCH];
+    char *line;
+    rio_t *rp;
+
+    for (i = 0; (i <= p->maxi) && (p->nready > 0 || p->nmore > 0); i++) {
+
+        connfd = p->clientfd[i];
+        rp = &p->clientrio[i];
+
+        /* If a subscriber can take more output, write it */
+        if ((connfd > 0) && (FD_ISSET(connfd, &p->write_ready))) {
             p->nready--;
-            if ((n = Rio_readlineb(&rio, buf, MAXLINE)) != 0) {
-                byte_cnt += n;
-
-                strcpy(buf_copy, buf);
-                buf_copy[strlen(buf_copy) - 1] = '\0';
-                strcpy(cmd_experiment, buf_copy);
-                printf("Server received %d (%d total) bytes on fd: %d\n", n, byte_cnt, connfd);
-
-                char *argv[10] = {0};
-                int argc = parseline(buf_copy, argv);
-                
-                if (!strcmp(argv[0], "show")) {
-
-                    char newBuf[MAXLINE];
-                    memset(newBuf, '\0', sizeof(newBuf));
-                    createResultString(root, newBuf);
-                    Rio_writen(connfd, newBuf, MAXLINE);
-                }
-                else if (argc == 3) {
-                    int action_id = atoi(argv[1]);
-                    int action_amount = atoi(argv[2]);
-                    bool flag = false;
+            flush_client(p, i);
+            if (p->clientfd[i] < 0)
+                continue;
+        }
+
+        /*
+         * If the descriptor is ready, read what arrived and serve the
+         * complete lines. Select only promises one read without blocking,
+         * so a partial line waits in the buffer for the next one. A client
+         * gets at most REQS_PER_TURN lines per turn; the rest wait for the
+         * next pass of the loop so one pipelining client cannot hold it.
+         * An EOF, a half-close or the drain's SHUT_RD, only stops the reads:
+         * the client is closed once the lines it sent before it are served.
+         */
+        if ((connfd > 0) && (FD_ISSET(connfd, &p->ready_set) || p->more[i])) {
 
-                    if (!strcmp(argv[0], "sell")) {
-                        flag = true;
+            shm_chan_t *c = shm_chan(connfd);
+            if (c) {
+                serve_channel(p, i, c);
+                continue;
+            }
+            if (FD_ISSET(connfd, &p->ready_set)) {
+                p->nready--;
+                if (rp->rio_cnt < RIO_BUFSIZE && (n = fill_client(rp)) <= 0) {
+                    if (n < 0 || !rp->rio_cnt) {
+                        remove_client(p, i);   /* Error, or EOF with nothing left */
+                        continue;
                     }
-                    searchAndUpdate(action_id, action_amount, flag, connfd, cmd_experiment);
+                    p->eof[i] = 1;
+                    FD_CLR(connfd, &p->read_set);
                 }
             }
-            else {  /* EOF detected, remove descriptor from pool */
-                Close(connfd);
-                FD_CLR(connfd, &p->read_set);
-                p->clientfd[i] = -1;
-
-                /* File (stock.txt) write start */
-                FILE *fp = fopen("stock.txt", "w");
-                if (!fp) {
-                    fprintf(stderr, "The file (stock.txt) does not exist. \n");
-                    return;
+            /*
+             * Look up the stocks of the buy/sell lines about to be served
+             * together. The nodes found are not kept, as a request served
+             * before them may delist one; the walks are, in the cache.
+             */
+            if (rp->rio_cnt && pipelinedIds(rp->rio_bufptr, rp->rio_cnt, ids, &nids) && nids > 1)
+                findNodes(ids, nids, nodes);
+            for (k = 0; k < REQS_PER_TURN && p->clientfd[i] >= 0; k++) {
+                stats_frame();      /* Framing the line is the request's read phase */
+                if ((n = rio_getline(rp, &line, MAXLINE, p->eof[i])) <= 0) {
+                    stats_unframe();
+                    break;
                 }
-                
-                char res[MAXLINE] = {0};
-                createResultString(root, res);
-                fprintf(fp, "%s", res);
-                fclose(fp);
-                /* File write end */
+                handle_request(p, i, line, n);
+            }
+            if (p->clientfd[i] < 0)
+                continue;
+            if (p->eof[i] && !rp->rio_cnt) {
+                remove_client(p, i);
+                continue;
+            }
+            if (p->more[i] != (line_ready(rp) || p->eof[i])) {
+                p->more[i] = !p->more[i];
+                p->nmore += p->more[i] ? 1 : -1;
             }
+            if (p->sub[i].nranges || p->repl[i].on)
+                continue;
+
+            /* A started line keeps its first deadline however slowly it trickles in */
+            if (!rp->rio_cnt)
+                arm_client(p, i, TMO_IDLE);
+            else if (p->tmo[i] != TMO_HEADER)
+                arm_client(p, i, TMO_HEADER);
+        }
+    }
+}
+
+/* Ask every attached client for a doorbell, and serve next turn those that need none */
+void arm_doorbells(pool *p) {
+
+    int i;
+    shm_chan_t *c;
+
+    for (i = 0; i <= p->maxi; i++) {
+        if (p->clientfd[i] < 0 || !(c = shm_chan(p->clientfd[i])))
+            continue;
+        if (shm_arm_doorbell(c) && !p->more[i]) {
+            p->more[i] = 1;
+            p->nmore++;
+        }
+    }
+}
+
+/*
+ * Serve a client that attached shared memory: its socket only carries
+ * doorbells now, and its requests come from the channel, at most
+ * REQS_PER_TURN per turn like any other client's.
+ */
+void serve_channel(pool *p, int i, shm_chan_t *c) {
+
+    int k, connfd = p->clientfd[i];
+    char buf[MAXLINE];
+    ssize_t n = 0;
+
+    if (FD_ISSET(connfd, &p->ready_set)) {
+        p->nready--;
+        if (!shm_doorbell(connfd)) {
+            remove_client(p, i);
+            return;
+        }
+    }
+    for (k = 0; k < REQS_PER_TURN && !c->broken; k++) {
+        if ((n = shm_recv(c, &c->seg->req, buf, MAXLINE - 1, 0)) <= 0)
+            break;
+        buf[n] = '\0';
+        handle_request(p, i, buf, n);
+    }
+    if (n < 0 || c->broken) {
+        remove_client(p, i);
+        return;
+    }
+    if (p->more[i] != shm_pending(&c->seg->req)) {
+        p->more[i] = !p->more[i];
+        p->nmore += p->more[i] ? 1 : -1;
+    }
+    arm_client(p, i, TMO_IDLE);
+}
+
+void handle_request(pool *p, int i, char *buf, int n) {
+
+    int connfd = p->clientfd[i];
+    char cmd_experiment[MAXLINE];
+    char buf_copy[MAXLINE];
+
+    stats_begin();
+    byte_cnt += n;
+
+    /* A follower's acks are part of the stream, not requests to limit */
+    if (!p->repl[i].on && !rl_admit(&p->bucket[i], p->addr[i])) {
+        rl_busy(connfd);
+        stats_end(CMD_BUSY, false, n);
+        return;
+    }
+
+    /* buf is a view into the read buffer, n bytes with no terminator */
+    memcpy(buf_copy, buf, n);
+    buf_copy[n] = '\0';
+    if (buf_copy[n - 1] == '\n')
+        buf_copy[n - 1] = '\0';
+    strcpy(cmd_experiment, buf_copy);
+    LOG_INFO("Server received %ld (%ld total) bytes on fd: %ld", n, byte_cnt, connfd);
+
+    char *argv[MAXARGS] = {0};
+    int argc = parseline(buf_copy, argv);
+    int cmd = CMD_OTHER;
+    bool ok = true;
+    stats_lap(PH_PARSE);
+
+    if (argc == 0) {
+        ok = false;
+    }
+    else if (p->repl[i].on) {
+        /* A replication stream only takes acknowledgements back */
+        if (!strcmp(argv[0], "ack") && argc == 2)
+            repl_ack(&p->repl[i], strtoul(argv[1], NULL, 10));
+        else
+            ok = false;
+    }
+    else if ((!strcmp(argv[0], "subscribe") || !strcmp(argv[0], "replicate")) && shm_chan(connfd)) {
+
+        char errBuf[MAXLINE] = "Subscriptions and replication need a socket connection\n";
+        shm_reply(connfd, errBuf);
+        ok = false;
+    }
+    else if (!strcmp(argv[0], "subscribe")) {
+
+        if (sub_subscribe(&p->sub[i], argc, argv, root) < 0)
+            remove_client(p, i);
+        else
+            flush_client(p, i);
+        stats_lap(PH_WRITE);
+    }
+    else if (p->sub[i].nranges) {
+        /* A subscription turns the connection into a one-way feed */
+        sub_error(&p->sub[i], "subscribed connections only take subscribe");
+        flush_client(p, i);
+        ok = false;
+    }
+    else if (!strcmp(argv[0], "replicate")) {
+
+        if (repl_role == REPL_FOLLOWER) {
+            char errBuf[MAXLINE] = "Not the primary\n";
+            shm_reply(connfd, errBuf);
+            ok = false;
+        }
+        else {
+            repl_start(&p->repl[i], root);
+            LOG_TEXT(LOG_LVL_INFO, "fd %d: follower joined at seq %lu", connfd, repl_seq);
+            flush_client(p, i);
+        }
+        stats_lap(PH_WRITE);
+    }
+    else if (!strcmp(argv[0], "promote")) {
+
+        promote(p, connfd);
+    }
+    else if (repl_role == REPL_FOLLOWER && ((argc == 3 && strcmp(argv[0], "show") && strcmp(argv[0], "top"))
+             || !strcmp(argv[0], "order")
+             || !strcmp(argv[0], "basket") || !strcmp(argv[0], "login")
+             || !strcmp(argv[0], "account")
+             || !strcmp(argv[0], "cancel") || !strcmp(argv[0], "list")
+             || !strcmp(argv[0], "delist"))) {
+
+        /* Trades go to the primary; a follower only serves reads */
+        char errBuf[MAXLINE] = "Read-only follower\n";
+        shm_reply(connfd, errBuf);
+        ok = false;
+    }
+    else if (!strcmp(argv[0], "attach") && argc == 2) {
+
+        ok = shm_attach(connfd, argv[1], tw_timeout_ms(TMO_WRITE)) == 0;
+    }
+    else if (!strcmp(argv[0], "login") && argc == 2) {
+
+        /* Later trades on this connection are checked against the account */
+        p->acct[i] = acct_login(atoi(argv[1]));
+        ok = showAccount(p->acct[i], connfd);
+    }
+    else if (!strcmp(argv[0], "account")) {
+
+        ok = showAccount(p->acct[i], connfd);
+    }
+    else if (!strcmp(argv[0], "show") && argc == 3) {
+
+        cmd = CMD_SHOW;
+        showRange(atoi(argv[1]), atoi(argv[2]), connfd);
+    }
+    else if (!strcmp(argv[0], "top")) {
+
+        cmd = CMD_TOP;
+        if (argc == 3 && atoi(argv[1]) > 0 && (!strcmp(argv[2], "amount") || !strcmp(argv[2], "price")))
+            ok = showTop(atoi(argv[1]), strcmp(argv[2], "amount") ? RANK_PRICE : RANK_AMOUNT, connfd);
+        else {
+            char errBuf[MAXLINE] = RANK_USAGE;
+            shm_reply(connfd, errBuf);
+            ok = false;
         }
     }
-}
\ No newline at end of file
+    else if (!strcmp(argv[0], "show")) {
+
+        cmd = CMD_SHOW;
+        char* newBuf = createSnapshotString();
+        stats_lap(PH_LOOKUP);
+        shm_reply(connfd, newBuf);
+        stats_lap(PH_WRITE);
+    }
+    else if (!strcmp(argv[0], "stats")) {
+
+        char statBuf[MAXLINE];
+        int len;
+        memset(statBuf, '\0', sizeof(statBuf));
+        len = stats_report(statBuf, MAXLINE - 1);
+        if (len < MAXLINE - 1)
+            repl_report(statBuf + len, MAXLINE - 1 - len, p->repl, p->maxi + 1);
+        shm_reply(connfd, statBuf);
+    }
+    else if (!strcmp(argv[0], "order")) {
+
+        /* order buy|sell <id> <qty> <price>, price 0 for a market order */
+        cmd = CMD_ORDER;
+        if (argc == 5 && (!strcmp(argv[1], "buy") || !strcmp(argv[1], "sell")))
+            ok = submitOrder(atoi(argv[2]), strcmp(argv[1], "buy") ? BOOK_SELL : BOOK_BUY,
+                             atoi(argv[3]), atoi(argv[4]), connfd);
+        else {
+            char errBuf[MAXLINE] = "Invalid order (order buy|sell id qty price)\n";
+            shm_reply(connfd, errBuf);
+            ok = false;
+        }
+    }
+    else if (!strcmp(argv[0], "cancel") && argc == 3) {
+
+        cmd = CMD_CANCEL;
+        ok = cancelOrder(atoi(argv[1]), strtoul(argv[2], NULL, 10), connfd);
+    }
+    else if (!strcmp(argv[0], "book") && argc >= 2) {
+
+        ok = showBook(atoi(argv[1]), argc > 2 ? atoi(argv[2]) : BOOK_DEPTH, connfd);
+    }
+    else if (!strcmp(argv[0], "list") && argc == 4) {
+
+        ok = listStock(atoi(argv[1]), atoi(argv[2]), atoi(argv[3]), connfd);
+    }
+    else if (!strcmp(argv[0], "delist") && argc == 2) {
+
+        ok = delistStock(atoi(argv[1]), connfd);
+    }
+    else if (!strcmp(argv[0], "basket")) {
+
+        basket_leg_t legs[BASKET_MAX];
+        int nlegs = basket_parse(argc, argv, legs);
+
+        cmd = CMD_BASKET;
+        if (nlegs > 0)
+            ok = basketUpdate(legs, nlegs, p->acct[i], connfd);
+        else {
+            char errBuf[MAXLINE] = BASKET_USAGE;
+            shm_reply(connfd, errBuf);
+            ok = false;
+        }
+    }
+    else if (argc == 3) {
+        int action_id = atoi(argv[1]);
+        int action_amount = atoi(argv[2]);
+        bool flag = false;
+
+        if (!strcmp(argv[0], "sell")) {
+            flag = true;
+        }
+        cmd = flag ? CMD_SELL : CMD_BUY;
+        ok = searchAndUpdate(action_id, action_amount, flag, p->acct[i], connfd, cmd_experiment);
+    }
+    stats_end(cmd, ok, n);
+}
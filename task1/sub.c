@@ -0,0 +1,333 @@
+/*
+ * sub.c - tick-coalesced market-data subscriptions
+ */
+/* $begin sub.c */
+#include "csapp.h"
+#include "sub.h"
+#include "stats.h"
+#include <limits.h>
+
+int sub_count = 0;
+
+static TreeNode **dirty = NULL;     /* Stocks traded since the last tick */
+static int ndirty = 0, dirtycap = 0;
+static uint64_t deadline;           /* When the pending tick is due */
+static unsigned long seq = 0;       /* Last tick published */
+
+/* The current tick rendered once: row i is tick.text[off[i] .. off[i + 1]) */
+static struct {
+    char *text;
+    size_t len, cap;
+    int *ids;
+    size_t *off;
+    int rowcap;
+} tick;
+
+/* Scratch space for snapshot frames */
+static char *scratch = NULL;
+static size_t scratchlen = 0, scratchcap = 0;
+
+static void grow(char **buf, size_t *cap, size_t need) {
+
+    size_t n = *cap ? *cap : 4096;
+
+    if (need <= *cap) return;
+    while (n < need) n *= 2;
+    *buf = Realloc(*buf, n);
+    *cap = n;
+}
+
+/* Queue bytes for the subscriber, -1 if that would put it too far behind */
+static int out_append(sub_t *s, const char *p, size_t n) {
+
+    if (s->outlen - s->outoff + n > SUB_OUTBUF_MAX)
+        return -1;
+    if (s->outoff && s->outlen + n > s->outcap) {
+        memmove(s->out, s->out + s->outoff, s->outlen - s->outoff);
+        s->outlen -= s->outoff;
+        s->outoff = 0;
+    }
+    grow(&s->out, &s->outcap, s->outlen + n);
+    memcpy(s->out + s->outlen, p, n);
+    s->outlen += n;
+    return 0;
+}
+
+static int frame_header(sub_t *s, int rows) {
+
+    char hdr[64];
+    int n = sprintf(hdr, "tick %lu %d\n", seq, rows);
+
+    return out_append(s, hdr, n);
+}
+
+void sub_error(sub_t *s, const char *reason) {
+
+    char line[MAXLINE];
+    int n = snprintf(line, sizeof(line), "error %s\n", reason);
+
+    out_append(s, line, n);
+}
+
+/* Parse "id" or "lo-hi" */
+static int parse_range(const char *tok, int *lo, int *hi) {
+
+    char *end;
+
+    *lo = *hi = strtol(tok, &end, 10);
+    if (end == tok) return -1;
+    if (*end == '-')
+        *hi = strtol(end + 1, &end, 10);
+    if (*end != '\0' || *lo > *hi) return -1;
+    return 0;
+}
+
+static int cmp_range(const void *a, const void *b) {
+
+    const int *x = a, *y = b;
+
+    return (x[0] > y[0]) - (x[0] < y[0]);
+}
+
+/* Sort (lo, hi) pairs and merge overlapping or adjacent ones; returns the count */
+static int merge_ranges(int (*r)[2], int n) {
+
+    int i, m = 0;
+
+    qsort(r, n, sizeof(r[0]), cmp_range);
+    for (i = 0; i < n; i++) {
+        if (m && (long)r[m - 1][1] + 1 >= r[i][0]) {
+            if (r[i][1] > r[m - 1][1]) r[m - 1][1] = r[i][1];
+        } else {
+            r[m][0] = r[i][0];
+            r[m][1] = r[i][1];
+            m++;
+        }
+    }
+    return m;
+}
+
+static void render_range(TreeNode *node, int lo, int hi, int *rows) {
+
+    if (!node) return;
+
+    if (lo < node->stockItem.id)
+        render_range(node->left, lo, hi, rows);
+    if (lo <= node->stockItem.id && node->stockItem.id <= hi) {
+        grow(&scratch, &scratchcap, scratchlen + 40);
+        scratchlen += sprintf(scratch + scratchlen, "%d %d %d\n", node->stockItem.id,
+                              node->stockItem.amount, node->stockItem.price);
+        (*rows)++;
+    }
+    if (node->stockItem.id < hi)
+        render_range(node->right, lo, hi, rows);
+}
+
+/*
+ * Add the ranges in argv[1..argc-1] to the subscription and queue a snapshot
+ * of them. Returns -1 if the subscriber has to be dropped.
+ */
+int sub_subscribe(sub_t *s, int argc, char **argv, TreeNode *root) {
+
+    int req[SUB_MAX_RANGES * 2][2];
+    int i, n = 0, rows = 0;
+
+    if (argc == 1) {
+        req[0][0] = INT_MIN;
+        req[0][1] = INT_MAX;
+        n = 1;
+    }
+    for (i = 1; i < argc; i++) {
+        if (n == SUB_MAX_RANGES) {
+            sub_error(s, "too many ranges");
+            return 0;
+        }
+        if (parse_range(argv[i], &req[n][0], &req[n][1]) < 0) {
+            sub_error(s, "bad range (use id or lo-hi)");
+            return 0;
+        }
+        n++;
+    }
+    n = merge_ranges(req, n);
+
+    /* The new ranges must still fit once merged with the existing ones */
+    int all[SUB_MAX_RANGES * 2][2];
+    int m = s->nranges;
+    for (i = 0; i < m; i++) {
+        all[i][0] = s->lo[i];
+        all[i][1] = s->hi[i];
+    }
+    memcpy(all[m], req, n * sizeof(req[0]));
+    if ((m = merge_ranges(all, m + n)) > SUB_MAX_RANGES) {
+        sub_error(s, "too many ranges");
+        return 0;
+    }
+
+    if (!s->nranges) sub_count++;
+    s->nranges = m;
+    for (i = 0; i < m; i++) {
+        s->lo[i] = all[i][0];
+        s->hi[i] = all[i][1];
+    }
+
+    scratchlen = 0;
+    for (i = 0; i < n; i++)
+        render_range(root, req[i][0], req[i][1], &rows);
+    if (frame_header(s, rows) < 0 || out_append(s, scratch, scratchlen) < 0)
+        return -1;
+    return 0;
+}
+
+void sub_close(sub_t *s) {
+
+    if (s->nranges) sub_count--;
+    Free(s->out);
+    memset(s, 0, sizeof(*s));
+}
+
+/*
+ * Write as much queued output as the socket takes without blocking. Returns
+ * the number of bytes still queued, or -1 if the connection is broken.
+ */
+int sub_flush(sub_t *s, int fd) {
+
+    ssize_t n;
+
+    while (s->outoff < s->outlen) {
+        n = send(fd, s->out + s->outoff, s->outlen - s->outoff, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        s->outoff += n;
+    }
+    if (s->outoff == s->outlen)
+        s->outoff = s->outlen = 0;
+    return s->outlen - s->outoff;
+}
+
+/* Called for every successful trade; costs a branch while nobody subscribes */
+void sub_mark(TreeNode *node) {
+
+    if (!sub_count || node->dirty) return;
+
+    if (ndirty == dirtycap) {
+        dirtycap = dirtycap ? dirtycap * 2 : 256;
+        dirty = Realloc(dirty, dirtycap * sizeof(TreeNode *));
+    }
+    node->dirty = 1;
+    dirty[ndirty++] = node;
+    if (ndirty == 1)
+        deadline = stats_now() + SUB_TICK_MS * 1000000ULL;
+}
+
+/* Drop a node that is about to be freed from the pending tick */
+void sub_forget(TreeNode *node) {
+
+    int i;
+
+    if (!node->dirty) return;
+    for (i = 0; i < ndirty; i++) {
+        if (dirty[i] == node) {
+            dirty[i] = dirty[--ndirty];
+            break;
+        }
+    }
+    node->dirty = 0;
+}
+
+/* Select timeout until the pending tick, NULL to wait indefinitely */
+struct timeval *sub_timeout(struct timeval *tv) {
+
+    uint64_t now;
+    long us = 0;
+
+    if (!ndirty) return NULL;
+    now = stats_now();
+    if (now < deadline)
+        us = (deadline - now + 999) / 1000;
+    tv->tv_sec = us / 1000000;
+    tv->tv_usec = us % 1000000;
+    return tv;
+}
+
+int sub_tick_due(void) {
+    return ndirty && stats_now() >= deadline;
+}
+
+static int cmp_node_id(const void *a, const void *b) {
+
+    int x = (*(TreeNode *const *)a)->stockItem.id;
+    int y = (*(TreeNode *const *)b)->stockItem.id;
+
+    return (x > y) - (x < y);
+}
+
+/* Render the dirty stocks once, in id order, for sub_tick_send */
+void sub_tick_begin(void) {
+
+    int i;
+
+    seq++;
+    qsort(dirty, ndirty, sizeof(TreeNode *), cmp_node_id);
+    if (ndirty + 1 > tick.rowcap) {
+        tick.rowcap = (ndirty + 1) * 2;
+        tick.ids = Realloc(tick.ids, tick.rowcap * sizeof(int));
+        tick.off = Realloc(tick.off, tick.rowcap * sizeof(size_t));
+    }
+    tick.len = 0;
+    for (i = 0; i < ndirty; i++) {
+        stock *item = &dirty[i]->stockItem;
+        grow(&tick.text, &tick.cap, tick.len + 40);
+        tick.ids[i] = item->id;
+        tick.off[i] = tick.len;
+        tick.len += sprintf(tick.text + tick.len, "%d %d %d\n", item->id, item->amount, item->price);
+    }
+    tick.off[ndirty] = tick.len;
+}
+
+/* First row with id >= key */
+static int lower_bound(int key) {
+
+    int lo = 0, hi = ndirty;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (tick.ids[mid] < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Queue the rows of the current tick the subscriber covers; -1 to drop it */
+int sub_tick_send(sub_t *s) {
+
+    int a[SUB_MAX_RANGES], b[SUB_MAX_RANGES];
+    int i, rows = 0;
+
+    for (i = 0; i < s->nranges; i++) {
+        a[i] = lower_bound(s->lo[i]);
+        b[i] = s->hi[i] == INT_MAX ? ndirty : lower_bound(s->hi[i] + 1);
+        rows += b[i] - a[i];
+    }
+    if (!rows) return 0;
+
+    if (frame_header(s, rows) < 0)
+        return -1;
+    for (i = 0; i < s->nranges; i++)
+        if (b[i] > a[i] && out_append(s, tick.text + tick.off[a[i]],
+                                      tick.off[b[i]] - tick.off[a[i]]) < 0)
+            return -1;
+    return 0;
+}
+
+void sub_tick_end(void) {
+
+    int i;
+
+    for (i = 0; i < ndirty; i++)
+        dirty[i]->dirty = 0;
+    ndirty = 0;
+}
+/* $end sub.c */
@@ -0,0 +1,53 @@
+/* $begin sub.h */
+#ifndef __SUB_H__
+#define __SUB_H__
+
+#include <stddef.h>
+#include <sys/time.h>
+#include "stock.h"
+
+/*
+ * Market-data subscriptions for the event-driven server. After
+ * "subscribe [id | lo-hi]..." (no argument means every stock) a connection
+ * stops getting MAXLINE replies and instead receives a stream of frames:
+ *
+ *     tick <seq> <rows>\n
+ *     <id> <amount> <price>\n      <- rows times, ascending id
+ *
+ * The first frame is a snapshot of the requested ranges. After that, trades
+ * only mark their stock dirty; every SUB_TICK_MS the dirty stocks are
+ * rendered once, sorted by id, and each subscriber is sent the slices of that
+ * rendering its ranges cover. A stock traded many times within a tick is sent
+ * once, and a subscriber whose ranges saw no trades is sent nothing, so seq
+ * may skip. Problems are reported as "error <reason>\n" lines.
+ */
+
+#define SUB_TICK_MS     10          /* Trades are coalesced into ticks this long */
+#define SUB_MAX_RANGES  8           /* Disjoint id ranges per subscriber */
+#define SUB_OUTBUF_MAX  (1 << 20)   /* A subscriber further behind is dropped */
+
+typedef struct {
+    int nranges;                    /* 0 if the connection is not subscribed */
+    int lo[SUB_MAX_RANGES];         /* Disjoint, ascending, inclusive */
+    int hi[SUB_MAX_RANGES];
+    char *out;                      /* Bytes queued for the socket */
+    size_t outoff, outlen, outcap;
+} sub_t;
+
+extern int sub_count;               /* Live subscribers */
+
+int sub_subscribe(sub_t *s, int argc, char **argv, TreeNode *root);
+void sub_error(sub_t *s, const char *reason);
+void sub_close(sub_t *s);
+int sub_flush(sub_t *s, int fd);
+
+void sub_mark(TreeNode *node);
+void sub_forget(TreeNode *node);
+struct timeval *sub_timeout(struct timeval *tv);
+int sub_tick_due(void);
+void sub_tick_begin(void);
+int sub_tick_send(sub_t *s);
+void sub_tick_end(void);
+
+#endif /* __SUB_H__ */
+/* $end sub.h */
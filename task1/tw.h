@@ -0,0 +1,62 @@
+/* $begin tw.h */
+#ifndef __TW_H__
+#define __TW_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Hierarchical timer wheel for connection timeouts. Time advances in ticks
+ * of TW_TICK_MS. Level 0 has one slot per tick for the next TW_SLOTS ticks;
+ * each higher level covers TW_SLOTS times the span of the one below, and
+ * its slots are cascaded down as the lower level wraps around. Adding and
+ * deleting a timer are O(1) list operations, and the cost of advancing is
+ * the timers that expire plus an occasional cascade.
+ *
+ * A wheel is not thread-safe. Timers are embedded in their owner's state;
+ * the callback passed to tw_advance gets the timer and finds the owner
+ * through its data field.
+ */
+
+#define TW_TICK_MS  100         /* Resolution of the wheel */
+#define TW_BITS     6
+#define TW_SLOTS    (1 << TW_BITS)
+#define TW_LEVELS   4           /* 64^4 ticks of 100 ms: about 19 days */
+
+/* Connection timeouts, overridden by STOCK_IDLE_TIMEOUT etc. in seconds (0 disables) */
+enum { TMO_IDLE, TMO_HEADER, TMO_WRITE };
+#define TW_IDLE_MS      60000   /* No request started */
+#define TW_HEADER_MS    5000    /* Request line started but not finished */
+#define TW_WRITE_MS     10000   /* Request taken but its reply not yet by the client */
+
+typedef struct _tw_timer_ {
+    struct _tw_timer_ *next;
+    struct _tw_timer_ **pprev;  /* NULL while not pending */
+    uint64_t expires;           /* Tick it fires at */
+    void *data;
+} tw_timer_t;
+
+typedef struct {
+    uint64_t tick;              /* Next tick to run */
+    int count;                  /* Pending timers */
+    tw_timer_t *slot[TW_LEVELS][TW_SLOTS];
+} tw_t;
+
+extern int tw_idle_ms, tw_header_ms, tw_write_ms;
+extern const char *tw_kind_name[];
+
+void tw_config(void);
+int tw_timeout_ms(int kind);
+uint64_t tw_now_ms(void);
+void tw_init(tw_t *w, uint64_t now_ms);
+void tw_add(tw_t *w, tw_timer_t *t, uint64_t when_ms);
+void tw_del(tw_t *w, tw_timer_t *t);
+void tw_advance(tw_t *w, uint64_t now_ms, void (*fire)(tw_timer_t *t));
+long tw_next_ms(tw_t *w, uint64_t now_ms);
+
+static inline int tw_pending(tw_timer_t *t) {
+    return t->pprev != NULL;
+}
+
+#endif /* __TW_H__ */
+/* $end tw.h */
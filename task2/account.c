@@ -0,0 +1,244 @@
+/*
+ * account.c - client accounts with cash balances and per-stock positions
+ */
+/* $begin account.c */
+#include "csapp.h"
+#include "account.h"
+#include "log.h"
+#include <limits.h>
+
+#define ACCT_FREE INT_MIN           /* No stock has this id */
+
+long acct_open_cash = 0;
+
+/* Account id -> account, open addressing; only login and save walk it */
+static account_t **accounts = NULL;
+static unsigned ncap = 0, nused = 0;
+static pthread_mutex_t indexLock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned hash(int key, unsigned cap) {
+    return (unsigned)(((uint64_t)(unsigned)key * 0x9e3779b97f4a7c15ULL) >> 32) & (cap - 1);
+}
+
+/* Read STOCK_ACCOUNT_CASH, the cash a new account starts with */
+void acct_config(void) {
+
+    char *env = getenv("STOCK_ACCOUNT_CASH");
+
+    if (env && *env)
+        acct_open_cash = atol(env);
+}
+
+/* Where the account is, or the empty slot it would take */
+static account_t **index_slot(int id) {
+
+    unsigned i;
+
+    for (i = hash(id, ncap); accounts[i] && accounts[i]->id != id; i = (i + 1) & (ncap - 1))
+        ;
+    return &accounts[i];
+}
+
+static account_t *index_find(int id) {
+    return ncap ? *index_slot(id) : NULL;
+}
+
+static void index_put(account_t *a) {
+
+    account_t **old = accounts;
+    unsigned oldcap = ncap, i;
+
+    if ((nused + 1) * 4 > ncap * 3) {
+        ncap = ncap ? ncap * 2 : 64;
+        accounts = Calloc(ncap, sizeof(account_t *));
+        for (i = 0; i < oldcap; i++)
+            if (old[i]) *index_slot(old[i]->id) = old[i];
+        Free(old);
+    }
+    *index_slot(a->id) = a;
+    nused++;
+}
+
+static account_t *account_new(int id, long cash) {
+
+    account_t *a = Malloc(sizeof(account_t));
+    unsigned i;
+
+    Sem_init(&a->lock, 0, 1);
+    a->id = id;
+    a->cash = cash;
+    a->cap = ACCT_MIN_SLOTS;
+    a->used = 0;
+    a->pos = Malloc(a->cap * sizeof(acct_pos_t));
+    for (i = 0; i < a->cap; i++)
+        a->pos[i].stock = ACCT_FREE;
+    index_put(a);
+    return a;
+}
+
+/* The account with this id, opened with acct_open_cash if it is new */
+account_t *acct_login(int id) {
+
+    account_t *a;
+
+    pthread_mutex_lock(&indexLock);
+    if (!(a = index_find(id)))
+        a = account_new(id, acct_open_cash);
+    pthread_mutex_unlock(&indexLock);
+    return a;
+}
+
+/* Where the stock's position is, or the empty slot it would take */
+static acct_pos_t *pos_slot(const acct_pos_t *pos, unsigned cap, int stock) {
+
+    unsigned i;
+
+    for (i = hash(stock, cap); pos[i].stock != ACCT_FREE && pos[i].stock != stock;
+         i = (i + 1) & (cap - 1))
+        ;
+    return (acct_pos_t *)&pos[i];
+}
+
+static acct_pos_t *pos_add(account_t *a, int stock) {
+
+    acct_pos_t *old = a->pos, *slot;
+    unsigned oldcap = a->cap, i;
+
+    if ((a->used + 1) * 4 > a->cap * 3) {
+        a->cap *= 2;
+        a->pos = Malloc(a->cap * sizeof(acct_pos_t));
+        for (i = 0; i < a->cap; i++)
+            a->pos[i].stock = ACCT_FREE;
+        for (i = 0; i < oldcap; i++)
+            if (old[i].stock != ACCT_FREE)
+                *pos_slot(a->pos, a->cap, old[i].stock) = old[i];
+        Free(old);
+    }
+    slot = pos_slot(a->pos, a->cap, stock);
+    slot->stock = stock;
+    slot->qty = 0;
+    a->used++;
+    return slot;
+}
+
+/* Shares of the stock the account holds */
+int acct_held(const account_t *a, int stock) {
+
+    acct_pos_t *slot = pos_slot(a->pos, a->cap, stock);
+
+    return slot->stock == stock ? slot->qty : 0;
+}
+
+/* Why the account cannot make the trade, or NULL if it can; delta as below */
+const char *acct_check(const account_t *a, int stock, long delta, int price) {
+
+    if (delta < 0 && a->cash < -delta * price)
+        return "Not enough cash\n";
+    if (delta > 0 && acct_held(a, stock) < delta)
+        return "Not enough position\n";
+    return NULL;
+}
+
+/*
+ * Apply a trade the caller has checked. delta is the change of the server's
+ * amount, as for a basket leg: positive for a sell, negative for a buy.
+ */
+void acct_trade(account_t *a, int stock, long delta, int price) {
+
+    acct_pos_t *slot = pos_slot(a->pos, a->cap, stock);
+
+    if (slot->stock != stock)
+        slot = pos_add(a, stock);
+    slot->qty -= delta;
+    a->cash += delta * price;
+}
+
+static int by_stock(const void *x, const void *y) {
+
+    const acct_pos_t *a = x, *b = y;
+
+    return (a->stock > b->stock) - (a->stock < b->stock);
+}
+
+/* The account reply: cash, then the stocks held in id order; cut like show */
+int acct_report(account_t *a, char *buf, size_t cap) {
+
+    acct_pos_t *rows = Malloc(a->cap * sizeof(acct_pos_t));
+    unsigned i, n = 0;
+    int len;
+
+    for (i = 0; i < a->cap; i++)
+        if (a->pos[i].stock != ACCT_FREE && a->pos[i].qty)
+            rows[n++] = a->pos[i];
+    qsort(rows, n, sizeof(acct_pos_t), by_stock);
+
+    len = snprintf(buf, cap, "account %d cash %ld\n", a->id, a->cash);
+    for (i = 0; i < n && len + ACCT_ROW_MAX < (int)cap; i++)
+        len += sprintf(buf + len, "%d %d\n", rows[i].stock, rows[i].qty);
+    Free(rows);
+    return len;
+}
+
+/*
+ * accounts.txt holds "<account> cash <cash>" and "<account> <stock> <qty>"
+ * lines. Returns the number of accounts loaded, or -1 with no file.
+ */
+int acct_load(const char *path) {
+
+    FILE *fp = fopen(path, "r");
+    char line[MAXLINE], word[32];
+    account_t *a;
+    long v;
+    int id, n = 0;
+
+    if (!fp) return -1;
+    pthread_mutex_lock(&indexLock);
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%d %31s %ld", &id, word, &v) != 3) {
+            LOG_WARN("%s: bad line: %s", path, line);
+            continue;
+        }
+        if (!(a = index_find(id))) {
+            a = account_new(id, 0);
+            n++;
+        }
+        if (!strcmp(word, "cash"))
+            a->cash = v;
+        else
+            acct_trade(a, atoi(word), -v, 0);
+    }
+    pthread_mutex_unlock(&indexLock);
+    fclose(fp);
+    return n;
+}
+
+/* Write every account, each under its own lock; 0 on success */
+int acct_save(const char *path) {
+
+    FILE *fp;
+    unsigned i, j;
+    account_t *a;
+
+    pthread_mutex_lock(&indexLock);
+    if (!nused) {                   /* Nobody ever logged in */
+        pthread_mutex_unlock(&indexLock);
+        return 0;
+    }
+    if (!(fp = fopen(path, "w"))) {
+        pthread_mutex_unlock(&indexLock);
+        return -1;
+    }
+    for (i = 0; i < ncap; i++) {
+        if (!(a = accounts[i])) continue;
+        P(&a->lock);
+        fprintf(fp, "%d cash %ld\n", a->id, a->cash);
+        for (j = 0; j < a->cap; j++)
+            if (a->pos[j].stock != ACCT_FREE && a->pos[j].qty)
+                fprintf(fp, "%d %d %d\n", a->id, a->pos[j].stock, a->pos[j].qty);
+        V(&a->lock);
+    }
+    pthread_mutex_unlock(&indexLock);
+    fclose(fp);
+    return 0;
+}
+/* $end account.c */
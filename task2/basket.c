@@ -0,0 +1,44 @@
+/*
+ * basket.c - parse basket orders into netted legs sorted by stock id
+ */
+/* $begin basket.c */
+#include "csapp.h"
+#include "basket.h"
+#include <limits.h>
+
+/*
+ * Parse the words of a basket request. Returns the number of distinct
+ * stocks in legs (at most BASKET_MAX), or -1 if the request is malformed
+ * or has more than BASKET_MAX legs.
+ */
+int basket_parse(int argc, char **argv, basket_leg_t *legs) {
+
+    int i, j, n = 0, id, sell;
+    long qty;
+    char *end;
+
+    if (argc < 4 || (argc - 1) % 3 || (argc - 1) / 3 > BASKET_MAX)
+        return -1;
+    for (i = 1; i < argc; i += 3) {
+        if (!(sell = !strcmp(argv[i], "sell")) && strcmp(argv[i], "buy"))
+            return -1;
+        id = atoi(argv[i + 1]);
+        qty = strtol(argv[i + 2], &end, 10);
+        if (*end || qty <= 0 || qty > INT_MAX)
+            return -1;
+
+        /* Insertion sort; a repeated id adds to its leg */
+        for (j = n; j > 0 && legs[j - 1].id > id; j--)
+            ;
+        if (j > 0 && legs[j - 1].id == id) {
+            legs[j - 1].delta += sell ? qty : -qty;
+            continue;
+        }
+        memmove(&legs[j + 1], &legs[j], (n - j) * sizeof(*legs));
+        legs[j].id = id;
+        legs[j].delta = sell ? qty : -qty;
+        n++;
+    }
+    return n;
+}
+/* $end basket.c */
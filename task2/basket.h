@@ -0,0 +1,26 @@
+/* $begin basket.h */
+#ifndef __BASKET_H__
+#define __BASKET_H__
+
+/*
+ * Basket orders trade several stocks all or nothing:
+ *
+ *     basket buy|sell <id> <qty> [buy|sell <id> <qty> ...]
+ *
+ * Legs on the same id are netted into one, so a basket that buys and sells
+ * the same stock only needs the net amount to be there. The parsed legs
+ * are sorted by id, which is the order a server locks their stocks in.
+ */
+
+#define BASKET_MAX      16          /* Legs per basket */
+#define BASKET_USAGE    "Invalid basket (basket buy|sell id qty ...)\n"
+
+typedef struct {
+    int id;
+    long delta;                     /* Net change of the amount: sells minus buys */
+} basket_leg_t;
+
+int basket_parse(int argc, char **argv, basket_leg_t *legs);
+
+#endif /* __BASKET_H__ */
+/* $end basket.h */
@@ -0,0 +1,351 @@
+/*
+ * batchbench.c - batched stock lookup microbenchmark
+ *
+ * Builds the stock index of each server, task1's binary search tree and
+ * task2's skip list, inserted in random id order, and times buy/sell style
+ * lookups (find the stock, change its amount) three ways:
+ *
+ *   single    one findNode walk per id, as an unbatched request does
+ *   batch K   findNodes over K ids, the walks interleaved with prefetches,
+ *             as a basket resolves its legs
+ *   warm K    findNodes over K ids and then one findNode per id, as the
+ *             servers serve K pipelined lines: the batch only brings the
+ *             nodes into the cache, the requests walk again
+ *
+ * The interleaving only pays once the walks miss the cache, so the table
+ * should be larger than the last level cache; each index is built in a
+ * child process of its own, on an hp.c arena like the servers'.
+ */
+#include "csapp.h"
+#include "hp.h"
+#include <time.h>
+#include <limits.h>
+
+#define MAX_LEVEL 16
+#define MAX_BATCH 64
+#define MAX_KS 8
+
+typedef struct _tree_ {
+	int id;
+	int price;
+	int amount;
+	void *book;
+	void *rank[2];
+	struct _tree_ *left;
+	struct _tree_ *right;
+	int dirty;
+} tree_t;			/* Same layout as task1's TreeNode */
+
+typedef struct _skip_ {
+	int id;
+	int price;
+	int amount;
+	unsigned seq;
+	void *ext;
+	unsigned char level;
+	unsigned char removed;
+	struct _skip_ *next[];
+} skip_t;			/* Same layout as task2's StockNode */
+
+typedef struct {
+	long stocks;
+	long lookups;
+	int ks[MAX_KS];		/* Batch sizes to run */
+	int nks;
+	uint64_t seed;
+	int index;		/* Bit 0 tree, bit 1 skip list */
+	int csv;
+} config_t;
+
+static config_t cfg = { 4000000, 4000000, { 2, 4, 8, 16, 32 }, 5, 1, 3, 0 };
+static const char *index_name[] = { "tree", "skiplist" };
+
+static tree_t *root;
+static skip_t *head;
+static int top_level = 1;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t next_rand(uint64_t *s)
+{
+	uint64_t z = (*s += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr, "usage: %s [-n stocks] [-l lookups] [-b k,k,...] [-i tree,skiplist] [-s seed] [-c]\n",
+		prog);
+	exit(1);
+}
+
+static void tree_build(hp_arena_t *arena, const int *order)
+{
+	tree_t **link, *node;
+	long i;
+
+	for (i = 0; i < cfg.stocks; i++) {
+		node = hp_alloc(arena, sizeof(tree_t));
+		memset(node, 0, sizeof(tree_t));
+		node->id = order[i];
+		node->amount = 1000;
+		for (link = &root; *link; )
+			link = node->id < (*link)->id ? &(*link)->left : &(*link)->right;
+		*link = node;
+	}
+}
+
+static tree_t *tree_find(int id)
+{
+	tree_t *node = root;
+
+	while (node && id != node->id)
+		node = id < node->id ? node->left : node->right;
+	return node;
+}
+
+/* task1's findNodes, for n <= MAX_BATCH */
+static void tree_find_batch(const int *ids, int n, tree_t **nodes)
+{
+	tree_t *node;
+	int k, active;
+
+	for (k = 0; k < n; k++)
+		nodes[k] = root;
+	do {
+		active = 0;
+		for (k = 0; k < n; k++) {
+			if (!(node = nodes[k]) || node->id == ids[k])
+				continue;
+			node = ids[k] < node->id ? node->left : node->right;
+			__builtin_prefetch(node);
+			nodes[k] = node;
+			active = 1;
+		}
+	} while (active);
+}
+
+/* Geometric level with p = 1/4, as in task2 */
+static int random_level(uint64_t *rng)
+{
+	uint64_t r = next_rand(rng);
+	int level = 1;
+
+	for (; level < MAX_LEVEL && (r & 3) == 0; r >>= 2)
+		level++;
+	return level;
+}
+
+static void skip_build(hp_arena_t *arena, const int *order)
+{
+	skip_t *preds[MAX_LEVEL], *node, *p;
+	uint64_t rng = cfg.seed;
+	long i;
+	int j, level;
+
+	head = Calloc(1, sizeof(skip_t) + MAX_LEVEL * sizeof(skip_t *));
+	head->id = INT_MIN;
+	for (i = 0; i < cfg.stocks; i++) {
+		level = random_level(&rng);
+		node = hp_alloc(arena, sizeof(skip_t) + level * sizeof(skip_t *));
+		memset(node, 0, sizeof(skip_t));
+		node->id = order[i];
+		node->amount = 1000;
+		node->level = level;
+		if (level > top_level)
+			top_level = level;
+		for (p = head, j = MAX_LEVEL - 1; j >= 0; j--) {
+			while (p->next[j] && p->next[j]->id < node->id)
+				p = p->next[j];
+			preds[j] = p;
+		}
+		for (j = 0; j < level; j++) {
+			node->next[j] = preds[j]->next[j];
+			preds[j]->next[j] = node;
+		}
+	}
+}
+
+static skip_t *skip_find(int id)
+{
+	skip_t *node = head;
+	int i;
+
+	for (i = top_level - 1; i >= 0; i--)
+		while (node->next[i] && node->next[i]->id < id)
+			node = node->next[i];
+	node = node->next[0];
+	return node && node->id == id ? node : NULL;
+}
+
+/* task2's findNodes, for n <= MAX_BATCH */
+static void skip_find_batch(const int *ids, int n, skip_t **nodes)
+{
+	skip_t *cur[MAX_BATCH], *next[MAX_BATCH];
+	int level[MAX_BATCH];
+	int k, active;
+
+	for (k = 0; k < n; k++) {
+		cur[k] = head;
+		level[k] = top_level - 1;
+		next[k] = head->next[level[k]];
+		__builtin_prefetch(next[k]);
+	}
+	for (active = n; active; ) {
+		for (k = 0; k < n; k++) {
+			if (level[k] < 0)
+				continue;
+			if (next[k] && next[k]->id < ids[k]) {
+				cur[k] = next[k];
+			} else if (--level[k] < 0) {
+				nodes[k] = next[k] && next[k]->id == ids[k] ? next[k] : NULL;
+				active--;
+				continue;
+			}
+			next[k] = cur[k]->next[level[k]];
+			__builtin_prefetch(next[k]);
+		}
+	}
+}
+
+/* Nanoseconds per lookup; k 0 for single, negative for warm -k */
+static double run_lookups(int index, const int *keys, int k)
+{
+	void *nodes[MAX_BATCH], *node;
+	uint64_t t0 = now_ns();
+	long i;
+	int j, n = k < 0 ? -k : k;
+
+	for (i = 0; i < cfg.lookups; i += n ? n : 1) {
+		if (n && i + n > cfg.lookups)
+			n = cfg.lookups - i;
+		if (n) {
+			if (index == 0)
+				tree_find_batch(keys + i, n, (tree_t **)nodes);
+			else
+				skip_find_batch(keys + i, n, (skip_t **)nodes);
+		}
+		for (j = 0; j < (n ? n : 1); j++) {
+			if (k > 0)
+				node = nodes[j];
+			else
+				node = index == 0 ? (void *)tree_find(keys[i + j]) : (void *)skip_find(keys[i + j]);
+			if (node && index == 0)
+				((tree_t *)node)->amount += (j & 1) ? 1 : -1;
+			else if (node)
+				((skip_t *)node)->amount += (j & 1) ? 1 : -1;
+		}
+	}
+	return (double)(now_ns() - t0) / cfg.lookups;
+}
+
+static void run(int index, const int *order, const int *keys)
+{
+	hp_arena_t arena;
+	double single, batch, warm;
+	int t;
+
+	hp_arena_init(&arena, HP_LOCAL);
+	if (index == 0)
+		tree_build(&arena, order);
+	else
+		skip_build(&arena, order);
+
+	single = run_lookups(index, keys, 0);
+	if (cfg.csv)
+		printf("%s,%ld,single,1,%.1f,1.00\n", index_name[index], cfg.stocks, single);
+	else
+		printf("%-8s single    %7.1f ns\n", index_name[index], single);
+	for (t = 0; t < cfg.nks; t++) {
+		batch = run_lookups(index, keys, cfg.ks[t]);
+		warm = run_lookups(index, keys, -cfg.ks[t]);
+		if (cfg.csv) {
+			printf("%s,%ld,batch,%d,%.1f,%.2f\n", index_name[index], cfg.stocks, cfg.ks[t],
+			       batch, single / batch);
+			printf("%s,%ld,warm,%d,%.1f,%.2f\n", index_name[index], cfg.stocks, cfg.ks[t],
+			       warm, single / warm);
+		} else {
+			printf("%-8s batch %-3d %7.1f ns %5.2fx   warm %-3d %7.1f ns %5.2fx\n",
+			       index_name[index], cfg.ks[t], batch, single / batch, cfg.ks[t], warm,
+			       single / warm);
+		}
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	int *order, *keys;
+	uint64_t rng;
+	long i, j;
+	int c, t;
+	char *tok;
+
+	while ((c = getopt(argc, argv, "n:l:b:i:s:c")) != -1) {
+		switch (c) {
+		case 'n': cfg.stocks = atol(optarg); break;
+		case 'l': cfg.lookups = atol(optarg); break;
+		case 'b':
+			cfg.nks = 0;
+			for (tok = strtok(optarg, ","); tok && cfg.nks < MAX_KS; tok = strtok(NULL, ","))
+				if ((t = atoi(tok)) < 1 || t > MAX_BATCH)
+					usage(argv[0]);
+				else
+					cfg.ks[cfg.nks++] = t;
+			break;
+		case 'i':
+			cfg.index = 0;
+			for (tok = strtok(optarg, ","); tok; tok = strtok(NULL, ","))
+				cfg.index |= !strcmp(tok, "tree") ? 1 : !strcmp(tok, "skiplist") ? 2 : 0;
+			break;
+		case 's': cfg.seed = strtoull(optarg, NULL, 10); break;
+		case 'c': cfg.csv = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (cfg.stocks <= 0 || cfg.stocks > INT_MAX || cfg.lookups <= 0 || !cfg.index)
+		usage(argv[0]);
+	hp_config();
+
+	/* Ids 1..stocks in random insertion order, and the ids to look up */
+	order = Malloc(cfg.stocks * sizeof(int));
+	keys = Malloc(cfg.lookups * sizeof(int));
+	rng = cfg.seed;
+	for (i = 0; i < cfg.stocks; i++)
+		order[i] = i + 1;
+	for (i = cfg.stocks - 1; i > 0; i--) {
+		j = next_rand(&rng) % (i + 1);
+		t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+	for (i = 0; i < cfg.lookups; i++)
+		keys[i] = next_rand(&rng) % cfg.stocks + 1;
+
+	if (!cfg.csv)
+		printf("%ld stocks, %ld lookups, nodes on %s\n", cfg.stocks, cfg.lookups,
+		       hp_mode_name[hp_mode]);
+	/* index,stocks,mode,k,ns_per_lookup,speedup */
+	for (t = 0; t < 2; t++) {
+		if (!(cfg.index & (1 << t)))
+			continue;
+		fflush(stdout);
+		if (Fork() == 0) {	/* Only one index in memory at a time */
+			run(t, order, keys);
+			exit(0);
+		}
+		Wait(NULL);
+	}
+	Free(order);
+	Free(keys);
+	return 0;
+}
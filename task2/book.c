@@ -0,0 +1,325 @@
+/*
+ * book.c - per-stock limit order book with price-time priority matching
+ */
+/* $begin book.c */
+#include "csapp.h"
+#include "book.h"
+
+#define NIL 0xffffffffu
+
+typedef struct {
+    uint32_t next, prev;    /* FIFO links within the level, or free list */
+    unsigned oid;
+    int qty;                /* Quantity still open */
+    int price;
+    int side;
+} order_t;
+
+typedef struct {
+    int price;
+    int qty;                /* Open quantity of every order at this price */
+    uint32_t head, tail;    /* Oldest and newest order */
+} level_t;
+
+typedef struct {
+    level_t *lv;            /* Sorted so the best price is last */
+    int n, cap;
+} side_t;
+
+typedef struct {
+    unsigned oid;           /* 0 while the slot is free */
+    uint32_t idx;
+} slot_t;
+
+struct _book_ {
+    side_t side[2];
+    order_t *ord;
+    uint32_t nord, ordcap;  /* Nodes handed out so far, nodes allocated */
+    uint32_t free;          /* Head of the free node list */
+    size_t live;            /* Resting orders */
+    slot_t *map;            /* oid -> node, at most half full */
+    uint32_t mapcap;
+    unsigned next_oid;
+};
+
+book_t *book_create(void) {
+
+    book_t *b = Calloc(1, sizeof(book_t));
+
+    b->free = NIL;
+    b->next_oid = 1;
+    return b;
+}
+
+void book_destroy(book_t *b) {
+
+    if (!b) return;
+    Free(b->side[BOOK_BUY].lv);
+    Free(b->side[BOOK_SELL].lv);
+    Free(b->ord);
+    Free(b->map);
+    Free(b);
+}
+
+/*
+ * Bids are kept ascending and asks descending, so in both arrays the sort
+ * key below ascends towards the best price.
+ */
+static inline long level_key(int side, int price) {
+    return side == BOOK_BUY ? price : -(long)price;
+}
+
+/* Index of the first level whose key is >= that of price */
+static int level_find(side_t *s, int side, int price) {
+
+    long key = level_key(side, price);
+    int lo = 0, hi = s->n;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (level_key(side, s->lv[mid].price) < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Index of the level at price, inserted empty if it does not exist */
+static int level_get(side_t *s, int side, int price) {
+
+    int pos = level_find(s, side, price);
+
+    if (pos < s->n && s->lv[pos].price == price)
+        return pos;
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 16;
+        s->lv = Realloc(s->lv, s->cap * sizeof(level_t));
+    }
+    memmove(&s->lv[pos + 1], &s->lv[pos], (s->n - pos) * sizeof(level_t));
+    s->lv[pos].price = price;
+    s->lv[pos].qty = 0;
+    s->lv[pos].head = s->lv[pos].tail = NIL;
+    s->n++;
+    return pos;
+}
+
+static void level_remove(side_t *s, int pos) {
+
+    memmove(&s->lv[pos], &s->lv[pos + 1], (s->n - pos - 1) * sizeof(level_t));
+    s->n--;
+}
+
+static uint32_t order_alloc(book_t *b) {
+
+    uint32_t idx;
+
+    if (b->free != NIL) {
+        idx = b->free;
+        b->free = b->ord[idx].next;
+        return idx;
+    }
+    if (b->nord == b->ordcap) {
+        if (b->ordcap == BOOK_MAX_ORDERS)
+            return NIL;
+        b->ordcap = b->ordcap ? b->ordcap * 2 : 64;
+        b->ord = Realloc(b->ord, b->ordcap * sizeof(order_t));
+    }
+    return b->nord++;
+}
+
+static void order_free(book_t *b, uint32_t idx) {
+
+    b->ord[idx].next = b->free;
+    b->free = idx;
+}
+
+static inline uint32_t map_hash(book_t *b, unsigned oid) {
+    return (oid * 2654435761u) & (b->mapcap - 1);
+}
+
+static void map_put(book_t *b, unsigned oid, uint32_t idx) {
+
+    uint32_t h;
+
+    if ((b->live + 1) * 2 > b->mapcap) {
+        slot_t *old = b->map;
+        uint32_t i, oldcap = b->mapcap;
+
+        b->mapcap = oldcap ? oldcap * 2 : 64;
+        b->map = Calloc(b->mapcap, sizeof(slot_t));
+        for (i = 0; i < oldcap; i++)
+            if (old[i].oid)
+                map_put(b, old[i].oid, old[i].idx);
+        Free(old);
+    }
+    for (h = map_hash(b, oid); b->map[h].oid; h = (h + 1) & (b->mapcap - 1))
+        ;
+    b->map[h].oid = oid;
+    b->map[h].idx = idx;
+}
+
+static slot_t *map_get(book_t *b, unsigned oid) {
+
+    uint32_t h;
+
+    if (!b->mapcap) return NULL;
+    for (h = map_hash(b, oid); b->map[h].oid; h = (h + 1) & (b->mapcap - 1))
+        if (b->map[h].oid == oid)
+            return &b->map[h];
+    return NULL;
+}
+
+/* Free the slot and shift later members of its probe run back over it */
+static void map_del(book_t *b, slot_t *slot) {
+
+    uint32_t mask = b->mapcap - 1;
+    uint32_t hole = slot - b->map, h = hole, home;
+
+    for (;;) {
+        h = (h + 1) & mask;
+        if (!b->map[h].oid)
+            break;
+        home = map_hash(b, b->map[h].oid);
+        /* Move the entry unless its home lies cyclically in (hole, h] */
+        if (((h - home) & mask) >= ((h - hole) & mask)) {
+            b->map[hole] = b->map[h];
+            hole = h;
+        }
+    }
+    b->map[hole].oid = 0;
+}
+
+/*
+ * Match an order of qty at price (0 for a market order) against the
+ * opposite side and rest what is left of a limit order. The outcome is
+ * stored in res. Returns -1 on bad arguments, or if the remainder could not
+ * rest because the book is full; fills reported in res stand either way.
+ */
+int book_submit(book_t *b, int side, int qty, int price, book_result_t *res) {
+
+    side_t *opp = &b->side[!side];
+    uint32_t idx;
+    int pos;
+
+    memset(res, 0, sizeof(*res));
+    if (qty <= 0 || price < 0 || (side != BOOK_BUY && side != BOOK_SELL))
+        return -1;
+
+    while (qty && opp->n) {
+        level_t *lv = &opp->lv[opp->n - 1];
+
+        if (price && (side == BOOK_BUY ? lv->price > price : lv->price < price))
+            break;
+        while (qty && lv->head != NIL) {
+            order_t *o = &b->ord[lv->head];
+            int f = o->qty < qty ? o->qty : qty;
+
+            o->qty -= f;
+            lv->qty -= f;
+            qty -= f;
+            res->filled += f;
+            res->notional += (long)f * lv->price;
+            if (!o->qty) {
+                idx = lv->head;
+                lv->head = o->next;
+                if (lv->head != NIL) b->ord[lv->head].prev = NIL;
+                else lv->tail = NIL;
+                map_del(b, map_get(b, o->oid));
+                order_free(b, idx);
+                b->live--;
+            }
+        }
+        res->last_price = lv->price;
+        if (lv->head == NIL)
+            opp->n--;
+    }
+
+    if (!qty || !price)
+        return 0;
+    if ((idx = order_alloc(b)) == NIL)
+        return -1;
+
+    order_t *o = &b->ord[idx];
+    side_t *own = &b->side[side];
+    level_t *lv;
+
+    o->oid = b->next_oid++;
+    if (!b->next_oid) b->next_oid = 1;
+    o->qty = qty;
+    o->price = price;
+    o->side = side;
+    o->next = NIL;
+
+    pos = level_get(own, side, price);
+    lv = &own->lv[pos];
+    o->prev = lv->tail;
+    if (lv->tail != NIL) b->ord[lv->tail].next = idx;
+    else lv->head = idx;
+    lv->tail = idx;
+    lv->qty += qty;
+
+    map_put(b, o->oid, idx);
+    b->live++;
+    res->oid = o->oid;
+    res->rested = qty;
+    return 0;
+}
+
+/* Cancel a resting order; returns the quantity it still had, or -1 */
+int book_cancel(book_t *b, unsigned oid) {
+
+    slot_t *slot = map_get(b, oid);
+    order_t *o;
+    side_t *s;
+    level_t *lv;
+    uint32_t idx;
+    int pos, qty;
+
+    if (!slot) return -1;
+    idx = slot->idx;
+    o = &b->ord[idx];
+    s = &b->side[o->side];
+    pos = level_find(s, o->side, o->price);
+    lv = &s->lv[pos];
+
+    if (o->prev != NIL) b->ord[o->prev].next = o->next;
+    else lv->head = o->next;
+    if (o->next != NIL) b->ord[o->next].prev = o->prev;
+    else lv->tail = o->prev;
+    lv->qty -= o->qty;
+    if (lv->head == NIL)
+        level_remove(s, pos);
+
+    qty = o->qty;
+    map_del(b, slot);
+    order_free(b, idx);
+    b->live--;
+    return qty;
+}
+
+/* Print up to depth levels per side, asks above bids, best prices innermost */
+int book_render(book_t *b, char *buf, size_t cap, int depth) {
+
+    side_t *ask = &b->side[BOOK_SELL], *bid = &b->side[BOOK_BUY];
+    size_t len = 0;
+    int i, n;
+
+#define EMIT(...) do { \
+    int _n = snprintf(buf + len, cap - len, __VA_ARGS__); \
+    if (_n < 0 || (size_t)_n >= cap - len) return len; \
+    len += _n; \
+} while (0)
+
+    n = ask->n < depth ? ask->n : depth;
+    for (i = ask->n - n; i < ask->n; i++)
+        EMIT("ask %d %d\n", ask->lv[i].price, ask->lv[i].qty);
+    n = bid->n < depth ? bid->n : depth;
+    for (i = bid->n - 1; i >= bid->n - n; i--)
+        EMIT("bid %d %d\n", bid->lv[i].price, bid->lv[i].qty);
+#undef EMIT
+    return len;
+}
+
+size_t book_resting(book_t *b) {
+    return b->live;
+}
+/* $end book.c */
@@ -0,0 +1,48 @@
+/* $begin book.h */
+#ifndef __BOOK_H__
+#define __BOOK_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Limit order book and matching engine for one stock. Orders match with
+ * price-time priority: an incoming order fills against the best opposite
+ * price level first and, within a level, against the oldest order first.
+ * Fills happen at the resting order's price. Whatever a limit order cannot
+ * fill rests in the book; a market order (price 0) never rests.
+ *
+ * Each side is an array of price levels sorted so the best price is last:
+ * matching and adding at or near the top touch the tail of one small array.
+ * Orders are 24-byte nodes in a per-book pool addressed by 32-bit index and
+ * recycled through a free list. Each level keeps its orders in a FIFO of
+ * such indices, and an open-addressing table maps order ids to nodes for
+ * cancel.
+ *
+ * A book is not thread-safe; callers serialize access per stock.
+ */
+
+#define BOOK_BUY        0
+#define BOOK_SELL       1
+#define BOOK_MAX_ORDERS (1 << 22)   /* Resting orders per book */
+#define BOOK_DEPTH      10          /* Levels per side printed by book_render */
+
+typedef struct _book_ book_t;
+
+typedef struct {
+    unsigned oid;       /* Id of the order if it rests, 0 otherwise */
+    int filled;         /* Quantity filled on entry */
+    long notional;      /* Sum of fill quantity * fill price */
+    int last_price;     /* Price of the last fill, 0 if nothing filled */
+    int rested;         /* Quantity left resting in the book */
+} book_result_t;
+
+book_t *book_create(void);
+void book_destroy(book_t *b);
+int book_submit(book_t *b, int side, int qty, int price, book_result_t *res);
+int book_cancel(book_t *b, unsigned oid);
+int book_render(book_t *b, char *buf, size_t cap, int depth);
+size_t book_resting(book_t *b);
+
+#endif /* __BOOK_H__ */
+/* $end book.h */
@@ -0,0 +1,141 @@
+/*
+ * ebr.c - epoch-based reclamation for the lock-free stock index
+ */
+/* $begin ebr.c */
+#include "csapp.h"
+#include "ebr.h"
+
+typedef struct _ebr_rec_ {
+    unsigned long epoch;        /* Epoch the owner entered at, 0 when outside */
+    int in_use;                 /* Owned by a live thread */
+    struct _ebr_rec_ *next;
+} __attribute__((aligned(64))) ebr_rec_t;
+
+typedef struct _ebr_node_ {
+    void *p;
+    void (*free_fn)(void *);
+    unsigned long epoch;        /* Global epoch when it was retired */
+    struct _ebr_node_ *next;
+} ebr_node_t;
+
+static unsigned long global_epoch __attribute__((aligned(64))) = 1;
+static ebr_rec_t *recs = NULL;
+static pthread_key_t rec_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static __thread ebr_rec_t *my_rec = NULL;
+
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+static ebr_node_t *retired = NULL;      /* Newest first */
+static int nretired = 0;
+
+static void rec_release(void *vp) {
+    ebr_rec_t *r = vp;
+    __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void make_key(void) {
+    pthread_key_create(&rec_key, rec_release);
+}
+
+/* Claim a record left by an exited thread or add a new one */
+static ebr_rec_t *rec_acquire(void) {
+
+    ebr_rec_t *r;
+
+    pthread_once(&key_once, make_key);
+    for (r = __atomic_load_n(&recs, __ATOMIC_ACQUIRE); r; r = r->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&r->in_use, &expected, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            goto done;
+    }
+
+    /* Own cache line, so announcing an epoch does not bounce a neighbour's */
+    if (posix_memalign((void **)&r, 64, sizeof(ebr_rec_t)) != 0)
+        unix_error("posix_memalign error");
+    memset(r, 0, sizeof(ebr_rec_t));
+    r->in_use = 1;
+    r->next = __atomic_load_n(&recs, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&recs, &r->next, r, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+done:
+    pthread_setspecific(rec_key, r);
+    return my_rec = r;
+}
+
+void ebr_enter(void) {
+
+    ebr_rec_t *r = my_rec ? my_rec : rec_acquire();
+
+    /* The announcement must be visible before any shared pointer is loaded */
+    __atomic_store_n(&r->epoch, __atomic_load_n(&global_epoch, __ATOMIC_RELAXED),
+                     __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void ebr_exit(void) {
+    __atomic_store_n(&my_rec->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Queue p, already unreachable for new readers, to be freed with free_fn */
+void ebr_retire(void *p, void (*free_fn)(void *)) {
+
+    ebr_node_t *n = Malloc(sizeof(ebr_node_t));
+
+    n->p = p;
+    n->free_fn = free_fn;
+    n->epoch = __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&retired_lock);
+    n->next = retired;
+    retired = n;
+    nretired++;
+    pthread_mutex_unlock(&retired_lock);
+
+    ebr_reclaim();
+}
+
+/*
+ * Free every retired node that no thread inside a section can still hold:
+ * those retired before the oldest epoch announced. Returns the number freed.
+ */
+int ebr_reclaim(void) {
+
+    ebr_rec_t *r;
+    ebr_node_t **pp, *n, *done = NULL;
+    unsigned long oldest = ~0UL, e;
+    int freed = 0;
+
+    if (!__atomic_load_n(&nretired, __ATOMIC_RELAXED))
+        return 0;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (r = __atomic_load_n(&recs, __ATOMIC_ACQUIRE); r; r = r->next)
+        if ((e = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE)) && e < oldest)
+            oldest = e;
+
+    pthread_mutex_lock(&retired_lock);
+    for (pp = &retired; (n = *pp); ) {
+        if (n->epoch < oldest) {
+            *pp = n->next;
+            n->next = done;
+            done = n;
+            nretired--;
+        }
+        else {
+            pp = &n->next;
+        }
+    }
+    pthread_mutex_unlock(&retired_lock);
+
+    while ((n = done)) {
+        done = n->next;
+        n->free_fn(n->p);
+        Free(n);
+        freed++;
+    }
+    return freed;
+}
+/* $end ebr.c */
@@ -0,0 +1,19 @@
+/* $begin ebr.h */
+#ifndef __EBR_H__
+#define __EBR_H__
+
+/*
+ * Epoch-based reclamation. Threads that walk shared nodes without a lock
+ * bracket the walk with ebr_enter() / ebr_exit(). A writer that unlinks a
+ * node hands it to ebr_retire() instead of freeing it; it is freed once no
+ * thread is still inside a section it entered before the node was retired.
+ * Sections do not nest.
+ */
+
+void ebr_enter(void);
+void ebr_exit(void);
+void ebr_retire(void *p, void (*free_fn)(void *));
+int ebr_reclaim(void);
+
+#endif /* __EBR_H__ */
+/* $end ebr.h */
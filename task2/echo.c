@@ -4,42 +4,422 @@
 /* $begin echo */
 #include "csapp.h"
 #include "stock.h"
+#include "log.h"
+#include "stats.h"
+#include "lockprof.h"
+#include "book.h"
+#include "ebr.h"
+#include "tw.h"
+#include "rl.h"
+#include "shm.h"
+#include "basket.h"
+#include "account.h"
+#include "rank.h"
 
-extern void searchAndUpdate(int targetId, int amount, bool action, const int connfd, char* cmd);
-extern void createResultString(TreeNode* node, char* newBuf);
+/* Words of a request line past this are ignored; one more than a full basket has */
+#define MAXARGS (2 + 3 * BASKET_MAX)
+
+extern void findNodes(const int* ids, int n, StockNode** nodes);
+extern bool searchAndUpdate(int targetId, int amount, bool action, account_t* acct, const int connfd, char* cmd);
+extern bool basketUpdate(basket_leg_t* legs, int n, account_t* acct, const int connfd);
+extern bool showAccount(account_t* acct, const int connfd);
+extern bool createSnapshotString(char* newBuf);
+extern bool showRange(int lo, int hi, char* newBuf);
+extern bool showTop(int n, int key, const int connfd);
+extern bool submitOrder(int targetId, int side, int qty, int price, const int connfd);
+extern bool cancelOrder(int targetId, unsigned oid, const int connfd);
+extern bool showBook(int targetId, int depth, const int connfd);
+extern bool listStock(int targetId, int amount, int price, const int connfd);
+extern bool delistStock(int targetId, const int connfd);
 int parseline(char* buf, char** argv);
 
-extern sem_t mutex;
-extern TreeNode* root;
+/*
+ * Connection timeouts. A worker blocked reading from an idle or slow client,
+ * or writing to one that stopped reading, cannot watch the clock itself, so
+ * a reaper thread keeps a timer wheel with one entry per connection and
+ * shuts down the socket of any that overstays; the blocked call returns and
+ * the worker moves on. Workers only store a new deadline as the connection
+ * changes phase, without a lock. Instead the reaper looks at every entry at
+ * least once per reaperPeriod, the shortest timeout, and re-arms it for its
+ * deadline or the next look, whichever is first: a deadline is always set
+ * at least reaperPeriod ahead, so none is missed. Adding and removing
+ * entries take reaperLock.
+ */
+typedef struct _conn_ {
+    tw_timer_t timer;       /* Under reaperLock */
+    int fd;
+    int phase;              /* TMO_* the deadline is for */
+    uint64_t deadline;      /* Milliseconds, 0 if the phase has no timeout */
+    struct _conn_ *prev;    /* Live connections, under liveLock */
+    struct _conn_ *next;
+} conn_t;
+
+static tw_t reaperWheel;
+static pthread_mutex_t reaperLock = PTHREAD_MUTEX_INITIALIZER;
+static int reaperPeriod = 0;    /* Milliseconds; 0 if every timeout is disabled */
+
+/* Next time the reaper should look at a connection */
+static uint64_t connNextLook(conn_t* c, uint64_t now) {
+
+    uint64_t deadline = __atomic_load_n(&c->deadline, __ATOMIC_RELAXED);
+
+    return deadline && deadline < now + reaperPeriod ? deadline : now + reaperPeriod;
+}
+
+static void connPhase(conn_t* c, int kind) {
+
+    int ms = tw_timeout_ms(kind);
+
+    __atomic_store_n(&c->phase, kind, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->deadline, ms ? tw_now_ms() + ms : 0, __ATOMIC_RELAXED);
+}
+
+static void connExpired(tw_timer_t* t) {
+
+    conn_t* c = t->data;
+    uint64_t now = tw_now_ms();
+    uint64_t deadline = __atomic_load_n(&c->deadline, __ATOMIC_RELAXED);
+
+    if (!deadline || deadline > now) {
+        tw_add(&reaperWheel, t, connNextLook(c, now));
+        return;
+    }
+    LOG_TEXT(LOG_LVL_INFO, "fd %d: %s timeout, closing", c->fd,
+             tw_kind_name[__atomic_load_n(&c->phase, __ATOMIC_RELAXED)]);
+    shutdown(c->fd, SHUT_RDWR);
+}
+
+static void *reaper(void *vargp) {
+
+    struct timespec tick = { 0, TW_TICK_MS * 1000000L };
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        nanosleep(&tick, NULL);
+        pthread_mutex_lock(&reaperLock);
+        tw_advance(&reaperWheel, tw_now_ms(), connExpired);
+        pthread_mutex_unlock(&reaperLock);
+    }
+    return NULL;
+}
+
+void timeouts_start(void) {
+
+    pthread_t tid;
+    int kind, ms;
+
+    tw_config();
+    for (kind = TMO_IDLE; kind <= TMO_WRITE; kind++)
+        if ((ms = tw_timeout_ms(kind)) && (!reaperPeriod || ms < reaperPeriod))
+            reaperPeriod = ms;
+    if (!reaperPeriod)
+        return;
+    tw_init(&reaperWheel, tw_now_ms());
+    Pthread_create(&tid, NULL, reaper, NULL);
+}
+
+/*
+ * Live connections, for a hand-over to shut down (see restart.h). Each is
+ * listed while echo serves it, and one a worker only starts after the
+ * shutdown is shut down as it starts.
+ */
+static conn_t* liveConns = NULL;
+static pthread_mutex_t liveLock = PTHREAD_MUTEX_INITIALIZER;
+static int liveShut = -1;       /* shutdown how, -1 until a hand-over */
+
+static void connLive(conn_t* c) {
+
+    pthread_mutex_lock(&liveLock);
+    c->prev = NULL;
+    if ((c->next = liveConns))
+        liveConns->prev = c;
+    liveConns = c;
+    if (liveShut >= 0)
+        shutdown(c->fd, liveShut);
+    pthread_mutex_unlock(&liveLock);
+}
+
+static void connGone(conn_t* c) {
+
+    pthread_mutex_lock(&liveLock);
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        liveConns = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    pthread_mutex_unlock(&liveLock);
+}
+
+/*
+ * Shut down every connection, served now or later. SHUT_RD lets each
+ * finish the requests it already sent and then read EOF; SHUT_RDWR also
+ * fails a write to a client that stopped reading.
+ */
+void drainConnections(int how) {
+
+    conn_t* c;
+
+    pthread_mutex_lock(&liveLock);
+    liveShut = how;
+    for (c = liveConns; c; c = c->next)
+        shutdown(c->fd, how);
+    pthread_mutex_unlock(&liveLock);
+}
+
+/*
+ * Read the next request line into buf. The connection is idle until its
+ * first bytes arrive; from then on the header deadline runs, however slowly
+ * the rest trickles in. The line is framed in place with rio_getline and
+ * copied out once, which stats charges to the read phase. Returns 0 once
+ * the client closed or failed.
+ */
+static ssize_t readRequest(rio_t* rp, conn_t* c, char* buf) {
+
+    ssize_t n;
+    char* line;
+
+    connPhase(c, rp->rio_cnt ? TMO_HEADER : TMO_IDLE);
+    stats_frame();
+    while (!(n = rio_getline(rp, &line, MAXLINE, 0))) {
+        if (rp->rio_cnt && c->phase != TMO_HEADER)
+            connPhase(c, TMO_HEADER);
+        if (rp->rio_cnt)
+            memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+        rp->rio_bufptr = rp->rio_buf;
+        n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt, RIO_BUFSIZE - rp->rio_cnt);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || (n == 0 && !rp->rio_cnt)) {
+            stats_unframe();
+            return 0;
+        }
+        if (n == 0) {
+            n = rio_getline(rp, &line, MAXLINE, 1);   /* Last line without a newline */
+            break;
+        }
+        rp->rio_cnt += n;
+        stats_frame();      /* Framing starts over with the bytes that came */
+    }
+    connPhase(c, TMO_WRITE);
+    memcpy(buf, line, n);
+    buf[n] = '\0';
+    return n;
+}
+
+/*
+ * Next request of a client that attached shared memory. The worker sleeps
+ * on the channel instead of the socket; the reaper and a client that went
+ * away still end the wait, as the channel checks the socket while it sleeps.
+ */
+static ssize_t chanRequest(shm_chan_t* c, conn_t* conn, char* buf) {
+
+    ssize_t n;
+
+    connPhase(conn, TMO_IDLE);
+    if (c->broken || (n = shm_recv(c, &c->seg->req, buf, MAXLINE - 1, -1)) <= 0)
+        return 0;
+    buf[n] = '\0';
+    connPhase(conn, TMO_WRITE);
+    return n;
+}
+
+/*
+ * Ids of the buy and sell requests among the next LOOKUP_BATCH complete
+ * lines at p. Returns how many lines it looked at.
+ */
+static int pipelinedIds(char* p, int len, int* ids, int* nids) {
+
+    char *end = p + len, *nl;
+    int lines = 0;
 
-void echo(int connfd) {
+    *nids = 0;
+    while (lines < LOOKUP_BATCH && (nl = memchr(p, '\n', end - p))) {
+        if (!strncmp(p, "buy ", 4))
+            ids[(*nids)++] = atoi(p + 4);
+        else if (!strncmp(p, "sell ", 5))
+            ids[(*nids)++] = atoi(p + 5);
+        lines++;
+        p = nl + 1;
+    }
+    return lines;
+}
+
+void echo(int connfd, rio_t* rp) {
 
     int n; 
-    char buf_copy[20];
-    char request[20];
+    char buf_copy[MAXLINE];
+    char request[MAXLINE];
     char buf[MAXLINE]; 
-    rio_t rio;
+    conn_t conn = { .fd = connfd };
+    rl_bucket_t bucket = 0;
+    struct sockaddr_storage peer;
+    socklen_t peerlen = sizeof(peer);
+    uint64_t addr = 1;
+    shm_chan_t* chan = NULL;
+    account_t* acct = NULL;     /* Logged-in account; never freed, so kept for the connection */
+    int ahead = 0;              /* Lines behind this one whose lookups were batched */
+    int ids[LOOKUP_BATCH], nids;
+    StockNode* nodes[LOOKUP_BATCH];
 
-    Rio_readinitb(&rio, connfd);
+    if (getpeername(connfd, (SA*)&peer, &peerlen) == 0)
+        addr = rl_addr_key((SA*)&peer);
 
-    while((n = Rio_readlineb(&rio, buf, MAXLINE)) > 0) {
-        P(&mutex);
+    Rio_readinitb(rp, connfd);
+    conn.timer.data = &conn;
+    connPhase(&conn, TMO_IDLE);
+    if (reaperPeriod) {
+        pthread_mutex_lock(&reaperLock);
+        tw_add(&reaperWheel, &conn.timer, connNextLook(&conn, tw_now_ms()));
+        pthread_mutex_unlock(&reaperLock);
+    }
+    connLive(&conn);
+
+    while((n = chan ? chanRequest(chan, &conn, buf) : readRequest(rp, &conn, buf)) > 0) {
+        stats_begin();
+        LOG_INFO("server received %ld bytes on fd: %ld", n, connfd);
+
+        if (!rl_admit(&bucket, addr)) {
+            rl_busy(connfd);
+            stats_end(CMD_BUSY, false, n);
+            continue;
+        }
+
+        if (buf[n - 1] == '\n')
+            buf[n - 1] = '\0';
         strcpy(buf_copy, buf);
-        buf_copy[strlen(buf_copy) - 1] = '\0';
         strcpy(request, buf_copy);
 
-	    printf("server received %d bytes\n", n);
-
-        buf[strlen(buf) - 1] = '\0';
-        char *argv[10] = {0};
+        char *argv[MAXARGS] = {0};
         int argc = parseline(buf, argv);
+        int cmd = CMD_OTHER;
+        bool ok = true;
+        stats_lap(PH_PARSE);
 
-        if (!strcmp(argv[0], "show")) {
+        /* Stock nodes found below stay allocated until ebr_exit */
+        ebr_enter();
+
+        /*
+         * Look up the stocks of this line and the buy/sell lines queued
+         * behind it together. The nodes found are not kept, as they are only
+         * safe until ebr_exit; the walks are, in the cache. The line just
+         * read still sits in the read buffer, right before rio_bufptr.
+         */
+        if (ahead > 0)
+            ahead--;
+        else if (!chan && rp->rio_cnt) {
+            ahead = pipelinedIds(rp->rio_bufptr - n, rp->rio_cnt + n, ids, &nids) - 1;
+            if (nids > 1)
+                findNodes(ids, nids, nodes);
+        }
+
+        if (argc == 0) {
+            ok = false;
+        }
+        else if (!strcmp(argv[0], "attach") && argc == 2) {
+
+            if (shm_attach(connfd, argv[1], tw_timeout_ms(TMO_WRITE)) == 0)
+                chan = shm_chan(connfd);
+            else
+                ok = false;
+        }
+        else if (!strcmp(argv[0], "login") && argc == 2) {
+
+            /* Later trades on this connection are checked against the account */
+            acct = acct_login(atoi(argv[1]));
+            ok = showAccount(acct, connfd);
+        }
+        else if (!strcmp(argv[0], "account")) {
+
+            ok = showAccount(acct, connfd);
+        }
+        else if (!strcmp(argv[0], "show") && argc == 3) {
 
             char newBuf[MAXLINE];
-            createResultString(root, newBuf);
-            newBuf[strlen(newBuf)] = '\0';
-            Rio_writen(connfd, newBuf, MAXLINE);
+            cmd = CMD_SHOW;
+            showRange(atoi(argv[1]), atoi(argv[2]), newBuf);
+            stats_lap(PH_LOOKUP);
+            shm_reply(connfd, newBuf);
+            stats_lap(PH_WRITE);
+        }
+        else if (!strcmp(argv[0], "top")) {
+
+            cmd = CMD_TOP;
+            if (argc == 3 && atoi(argv[1]) > 0 && (!strcmp(argv[2], "amount") || !strcmp(argv[2], "price")))
+                ok = showTop(atoi(argv[1]), strcmp(argv[2], "amount") ? RANK_PRICE : RANK_AMOUNT, connfd);
+            else {
+                char errBuf[MAXLINE] = RANK_USAGE;
+                shm_reply(connfd, errBuf);
+                ok = false;
+            }
+        }
+        else if (!strcmp(argv[0], "show")) {
+
+            char newBuf[MAXLINE];
+            newBuf[0] = '\0';
+            cmd = CMD_SHOW;
+            createSnapshotString(newBuf);
+            stats_lap(PH_LOOKUP);
+            shm_reply(connfd, newBuf);
+            stats_lap(PH_WRITE);
+        }
+        else if (!strcmp(argv[0], "stats")) {
+
+            char statBuf[MAXLINE];
+            memset(statBuf, '\0', sizeof(statBuf));
+            stats_report(statBuf, MAXLINE - 1);
+            shm_reply(connfd, statBuf);
+        }
+        else if (!strcmp(argv[0], "lockstat")) {
+
+            char statBuf[MAXLINE];
+            memset(statBuf, '\0', sizeof(statBuf));
+            lockprof_report(statBuf, MAXLINE - 1, argc > 1 ? atoi(argv[1]) : LP_TOPN);
+            shm_reply(connfd, statBuf);
+        }
+        else if (!strcmp(argv[0], "order")) {
+
+            /* order buy|sell <id> <qty> <price>, price 0 for a market order */
+            cmd = CMD_ORDER;
+            if (argc == 5 && (!strcmp(argv[1], "buy") || !strcmp(argv[1], "sell")))
+                ok = submitOrder(atoi(argv[2]), strcmp(argv[1], "buy") ? BOOK_SELL : BOOK_BUY,
+                                 atoi(argv[3]), atoi(argv[4]), connfd);
+            else {
+                char errBuf[MAXLINE] = "Invalid order (order buy|sell id qty price)\n";
+                shm_reply(connfd, errBuf);
+                ok = false;
+            }
+        }
+        else if (!strcmp(argv[0], "cancel") && argc == 3) {
+
+            cmd = CMD_CANCEL;
+            ok = cancelOrder(atoi(argv[1]), strtoul(argv[2], NULL, 10), connfd);
+        }
+        else if (!strcmp(argv[0], "book") && argc >= 2) {
+
+            ok = showBook(atoi(argv[1]), argc > 2 ? atoi(argv[2]) : BOOK_DEPTH, connfd);
+        }
+        else if (!strcmp(argv[0], "list") && argc == 4) {
+
+            ok = listStock(atoi(argv[1]), atoi(argv[2]), atoi(argv[3]), connfd);
+        }
+        else if (!strcmp(argv[0], "delist") && argc == 2) {
+
+            ok = delistStock(atoi(argv[1]), connfd);
+        }
+        else if (!strcmp(argv[0], "basket")) {
+
+            basket_leg_t legs[BASKET_MAX];
+            int nlegs = basket_parse(argc, argv, legs);
+
+            cmd = CMD_BASKET;
+            if (nlegs > 0)
+                ok = basketUpdate(legs, nlegs, acct, connfd);
+            else {
+                char errBuf[MAXLINE] = BASKET_USAGE;
+                shm_reply(connfd, errBuf);
+                ok = false;
+            }
         }
         else if (argc == 3) {
             
@@ -50,9 +430,20 @@ void echo(int connfd) {
             if (!strcmp(argv[0], "sell")) {
                 flag = true;
             }
-            searchAndUpdate(action_id, action_amount, flag, connfd, request);
+            cmd = flag ? CMD_SELL : CMD_BUY;
+            ok = searchAndUpdate(action_id, action_amount, flag, acct, connfd, request);
         }
-        V(&mutex);
+        ebr_exit();
+        stats_end(cmd, ok, n);
+    }
+
+    /* The caller closes connfd, which must not be shut down once reused */
+    connGone(&conn);
+    shm_detach(connfd);
+    if (reaperPeriod) {
+        pthread_mutex_lock(&reaperLock);
+        tw_del(&reaperWheel, &conn.timer);
+        pthread_mutex_unlock(&reaperLock);
     }
 }
 
@@ -61,12 +452,13 @@ int parseline(char* buf, char** argv) {
     int argc = 0;
     char delim[] = " ";
     char* result;
+    char* save;
 
-    result = strtok(buf, delim);
+    result = strtok_r(buf, delim, &save);
 
-    while (result) {
+    while (result && argc < MAXARGS) {
         argv[argc++] = result;
-        result = strtok(NULL, delim);
+        result = strtok_r(NULL, delim, &save);
     }
 
     return argc;
@@ -0,0 +1,97 @@
+/*
+ * hist.c - log-linear latency histogram
+ */
+/* $begin hist.c */
+#include "hist.h"
+
+static int bucket_of(uint64_t v) {
+
+    int e;
+
+    if (v < HIST_SUB_COUNT)
+        return (int)v;
+
+    e = 63 - __builtin_clzll(v);
+    if (e > HIST_MAX_EXP)
+        return HIST_BUCKETS - 1;
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB_COUNT
+           + (int)((v >> (e - HIST_SUB_BITS)) - HIST_SUB_COUNT);
+}
+
+/* Midpoint of the values that land in bucket b */
+static uint64_t bucket_value(int b) {
+
+    int e, sub;
+    uint64_t lo;
+
+    if (b < HIST_SUB_COUNT)
+        return b;
+
+    e = b / HIST_SUB_COUNT + HIST_SUB_BITS - 1;
+    sub = b % HIST_SUB_COUNT;
+    lo = (uint64_t)(HIST_SUB_COUNT + sub) << (e - HIST_SUB_BITS);
+    return lo + ((1ULL << (e - HIST_SUB_BITS)) >> 1);
+}
+
+/*
+ * Only the owning thread writes a histogram, so plain read-modify-write is
+ * enough; the relaxed stores just keep concurrent readers tear-free.
+ */
+void hist_record(hist_t *h, uint64_t v) {
+
+    int b = bucket_of(v);
+
+    __atomic_store_n(&h->buckets[b], h->buckets[b] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + v, __ATOMIC_RELAXED);
+    if (v > h->max)
+        __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+}
+
+void hist_merge(hist_t *dst, const hist_t *src) {
+
+    int i;
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+
+    dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    if (max > dst->max)
+        dst->max = max;
+    for (i = 0; i < HIST_BUCKETS; i++)
+        dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+}
+
+/* dst -= src, for turning two cumulative snapshots into an interval */
+void hist_sub(hist_t *dst, const hist_t *src) {
+
+    int i;
+
+    dst->count -= src->count;
+    dst->sum -= src->sum;
+    for (i = 0; i < HIST_BUCKETS; i++)
+        dst->buckets[i] -= src->buckets[i];
+}
+
+/* Value at quantile p (0 < p <= 1), or 0 for an empty histogram */
+uint64_t hist_percentile(const hist_t *h, double p) {
+
+    uint64_t total = 0, rank, seen = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        total += h->buckets[i];
+    if (total == 0)
+        return 0;
+
+    rank = (uint64_t)(p * total + 0.5);
+    if (rank < 1) rank = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t v = bucket_value(i);
+            return (h->max && v > h->max) ? h->max : v;
+        }
+    }
+    return h->max;
+}
+/* $end hist.c */
@@ -0,0 +1,185 @@
+/*
+ * hp.c - huge-page arenas with NUMA placement
+ */
+/* $begin hp.c */
+#include "csapp.h"
+#include "hp.h"
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#define HP_MAX_NODES 1024
+
+int hp_mode = HP_OFF;
+const char *hp_mode_name[] = { "malloc", "transparent huge pages", "huge pages" };
+
+static int nodes = 1;
+
+void hp_config(void) {
+
+    char *v = getenv("STOCK_HUGEPAGES");
+    char line[256], *s, *end;
+    FILE *fp;
+    long n;
+
+    if (v && !strcmp(v, "thp"))
+        hp_mode = HP_THP;
+    else if (v && *v && strcmp(v, "0"))
+        hp_mode = HP_HUGETLB;
+
+    /* Online nodes read like "0" or "0-1,4"; the highest one sizes the masks */
+    if ((fp = fopen("/sys/devices/system/node/online", "r"))) {
+        if (fgets(line, sizeof(line), fp)) {
+            for (s = line; *s; s = end) {
+                n = strtol(s, &end, 10);
+                if (end == s) {
+                    end = s + 1;
+                    continue;
+                }
+                if (n + 1 > nodes && n < HP_MAX_NODES)
+                    nodes = n + 1;
+            }
+        }
+        fclose(fp);
+    }
+}
+
+int hp_nodes(void) {
+    return nodes;
+}
+
+/* NUMA node the calling thread runs on */
+int hp_node(void) {
+
+    unsigned cpu, node;
+
+    if (nodes < 2 || syscall(SYS_getcpu, &cpu, &node, NULL) < 0 || node >= (unsigned)nodes)
+        return 0;
+    return node;
+}
+
+/* Set where the pages of a fresh region will be placed; only a hint */
+static void bind_region(void *p, size_t size, int place) {
+
+    unsigned long mask[HP_MAX_NODES / (8 * sizeof(long))] = { 0 };
+    int i, mode, bits = 8 * sizeof(long);
+
+    if (nodes < 2)
+        return;
+    if (place == HP_INTERLEAVE) {
+        mode = MPOL_INTERLEAVE;
+        for (i = 0; i < nodes; i++)
+            mask[i / bits] |= 1UL << (i % bits);
+    }
+    else {
+        mode = MPOL_PREFERRED;
+        i = hp_node();
+        mask[i / bits] |= 1UL << (i % bits);
+    }
+    syscall(SYS_mbind, p, size, mode, mask, (unsigned long)HP_MAX_NODES, 0);
+}
+
+/* Zeroed memory for size bytes, rounded up to whole 2 MB pages */
+void *hp_map(size_t size, int place) {
+
+    char *p = MAP_FAILED, *a;
+
+    size = (size + HP_PAGE - 1) & ~(HP_PAGE - 1);
+    if (hp_mode == HP_HUGETLB)
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                 -1, 0);
+    if (p == MAP_FAILED) {
+        /* Trim to a 2 MB boundary so the region can be backed by whole huge pages */
+        p = Mmap(NULL, size + HP_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        a = (char *)(((uintptr_t)p + HP_PAGE - 1) & ~(HP_PAGE - 1));
+        if (a > p)
+            Munmap(p, a - p);
+        if (a < p + HP_PAGE)
+            Munmap(a + size, p + HP_PAGE - a);
+        p = a;
+        if (hp_mode != HP_OFF)
+            madvise(p, size, MADV_HUGEPAGE);
+    }
+    bind_region(p, size, place);
+    return p;
+}
+
+void hp_arena_init(hp_arena_t *a, int place) {
+
+    memset(a, 0, sizeof(*a));
+    pthread_mutex_init(&a->lock, NULL);
+    a->place = place;
+}
+
+/* Take size bytes off the current region, mapping a new one when it runs out */
+static void *carve(hp_arena_t *a, size_t size) {
+
+    void *p;
+
+    if (a->cur + size > a->end) {
+        size_t len = size > HP_PAGE ? size : HP_PAGE;
+        a->cur = hp_map(len, a->place);
+        a->end = a->cur + ((len + HP_PAGE - 1) & ~(HP_PAGE - 1));
+        a->regions++;
+    }
+    p = a->cur;
+    a->cur += size;
+    return p;
+}
+
+/* A zeroed block of size bytes */
+void *hp_alloc(hp_arena_t *a, size_t size) {
+
+    size_t c = (size + HP_CLASS - 1) / HP_CLASS;
+    void *p;
+
+    if (hp_mode == HP_OFF || c == 0 || c > HP_CLASSES)
+        return Calloc(1, size);
+
+    pthread_mutex_lock(&a->lock);
+    if ((p = a->free[c - 1]))
+        a->free[c - 1] = *(void **)p;
+    pthread_mutex_unlock(&a->lock);
+    if (p) {
+        memset(p, 0, c * HP_CLASS);
+        return p;
+    }
+
+    pthread_mutex_lock(&a->lock);
+    p = carve(a, c * HP_CLASS);     /* Fresh regions are already zero */
+    pthread_mutex_unlock(&a->lock);
+    return p;
+}
+
+/* Give back a hp_alloc block of the same size */
+void hp_free(hp_arena_t *a, void *p, size_t size) {
+
+    size_t c = (size + HP_CLASS - 1) / HP_CLASS;
+
+    if (!p)
+        return;
+    if (hp_mode == HP_OFF || c == 0 || c > HP_CLASSES) {
+        free(p);
+        return;
+    }
+    pthread_mutex_lock(&a->lock);
+    *(void **)p = a->free[c - 1];
+    a->free[c - 1] = p;
+    pthread_mutex_unlock(&a->lock);
+}
+
+/* A zeroed, cache-line aligned block that is never freed */
+void *hp_carve(hp_arena_t *a, size_t size) {
+
+    void *p;
+
+    size = (size + 63) & ~(size_t)63;
+    if (hp_mode == HP_OFF)
+        return Calloc(1, size);
+    pthread_mutex_lock(&a->lock);
+    a->cur = (char *)(((uintptr_t)a->cur + 63) & ~(uintptr_t)63);
+    p = carve(a, size);
+    pthread_mutex_unlock(&a->lock);
+    return p;
+}
+/* $end hp.c */
@@ -0,0 +1,258 @@
+/*
+ * lockprof.c - lock wait/hold profiler for the P/V lock sites
+ */
+/* $begin lockprof.c */
+#include "csapp.h"
+#include "lockprof.h"
+#include "stats.h"
+#include <limits.h>
+
+#define LP_FREE INT_MIN         /* No stock has this id */
+
+typedef struct {
+    uint64_t acquires;
+    uint64_t contended;     /* Acquisitions that had to block */
+    uint64_t wait_ns;
+    uint64_t max_wait_ns;
+    uint64_t hold_ns;
+} lockstat_t;
+
+typedef struct _lp_shard_ {
+    lockstat_t site[LK_NSITES];
+    struct _lp_shard_ *next;
+} lp_shard_t;
+
+/* One entry per stock id seen */
+typedef struct {
+    int id;                 /* LP_FREE while the slot is free */
+    int pad;
+    lockstat_t w;
+    uint64_t held_since;    /* When the current holder of w acquired it */
+} __attribute__((aligned(64))) lp_stock_t;
+
+/* Hold start of the exclusive non-stock sites, written by the holder only */
+typedef struct {
+    uint64_t held_since;
+} __attribute__((aligned(64))) lp_held_t;
+
+int lockprof_enabled = 0;
+
+static lp_shard_t *shards = NULL;
+static __thread lp_shard_t *my_shard = NULL;
+static lp_stock_t *stocks = NULL;
+static unsigned long stocks_dropped = 0;   /* Acquisitions of ids with no slot */
+static lp_held_t site_held[LK_NSITES];
+
+static const char *site_names[] = {
+    "global", "stock.w", "sbuf.mutex", "sbuf.slots", "sbuf.items", "account", "rank"
+};
+
+/* Turn the profiler on if STOCK_LOCKPROF is set to a non-zero value */
+void lockprof_init(void) {
+
+    char *env = getenv("STOCK_LOCKPROF");
+    int i;
+
+    if (!env || !atoi(env))
+        return;
+    stocks = Calloc(LP_STOCK_SLOTS, sizeof(lp_stock_t));
+    for (i = 0; i < LP_STOCK_SLOTS; i++)
+        stocks[i].id = LP_FREE;
+    lockprof_enabled = 1;
+}
+
+static lp_shard_t *shard_get(void) {
+
+    lp_shard_t *s;
+
+    if (my_shard)
+        return my_shard;
+    s = Calloc(1, sizeof(lp_shard_t));
+    s->next = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&shards, &s->next, s, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    return my_shard = s;
+}
+
+/*
+ * Find or claim the table entry of stock id within LP_STOCK_PROBE slots of
+ * its hash, NULL if they are all taken by other ids. A full table thus costs
+ * a trade a few loads, not a scan.
+ */
+static lp_stock_t *stock_slot(int id) {
+
+    unsigned h = ((unsigned)id * 2654435761u) & (LP_STOCK_SLOTS - 1);
+    int i;
+
+    for (i = 0; i < LP_STOCK_PROBE; i++, h = (h + 1) & (LP_STOCK_SLOTS - 1)) {
+        int cur = __atomic_load_n(&stocks[h].id, __ATOMIC_ACQUIRE);
+        if (cur == id)
+            return &stocks[h];
+        if (cur == LP_FREE) {
+            int expected = LP_FREE;
+            if (__atomic_compare_exchange_n(&stocks[h].id, &expected, id, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+                || expected == id)
+                return &stocks[h];
+        }
+    }
+    return NULL;
+}
+
+/* Owner-only counters: relaxed stores keep concurrent readers tear-free */
+static void local_add(lockstat_t *st, int contended, uint64_t wait) {
+
+    __atomic_store_n(&st->acquires, st->acquires + 1, __ATOMIC_RELAXED);
+    if (!contended)
+        return;
+    __atomic_store_n(&st->contended, st->contended + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->wait_ns, st->wait_ns + wait, __ATOMIC_RELAXED);
+    if (wait > st->max_wait_ns)
+        __atomic_store_n(&st->max_wait_ns, wait, __ATOMIC_RELAXED);
+}
+
+static void shared_add(lockstat_t *st, int contended, uint64_t wait) {
+
+    __atomic_fetch_add(&st->acquires, 1, __ATOMIC_RELAXED);
+    if (!contended)
+        return;
+    __atomic_fetch_add(&st->contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->wait_ns, wait, __ATOMIC_RELAXED);
+    if (wait > __atomic_load_n(&st->max_wait_ns, __ATOMIC_RELAXED))
+        __atomic_store_n(&st->max_wait_ns, wait, __ATOMIC_RELAXED);
+}
+
+void lp_P(sem_t *s, int site, int id) {
+
+    uint64_t t0, now, wait = 0;
+    int contended = 0;
+    lp_stock_t *slot;
+
+    if (sem_trywait(s) < 0) {
+        contended = 1;
+        t0 = stats_now();
+        P(s);
+        now = stats_now();
+        wait = now - t0;
+    }
+    else {
+        now = stats_now();
+    }
+    /* Counting semaphores have no hold time; the account locks would share one */
+    if (site == LK_SBUF_SLOTS || site == LK_SBUF_ITEMS || site == LK_ACCOUNT)
+        now = 0;
+
+    local_add(&shard_get()->site[site], contended, wait);
+
+    if (site == LK_STOCK_W) {
+        if ((slot = stock_slot(id)) != NULL) {
+            shared_add(&slot->w, contended, wait);
+            slot->held_since = now;
+        }
+        else {
+            __atomic_fetch_add(&stocks_dropped, 1, __ATOMIC_RELAXED);
+        }
+    }
+    else {
+        site_held[site].held_since = now;
+    }
+}
+
+void lp_V(sem_t *s, int site, int id) {
+
+    uint64_t since, hold;
+    lp_stock_t *slot = NULL;
+
+    if (site == LK_STOCK_W) {
+        if ((slot = stock_slot(id)) != NULL)
+            since = slot->held_since;
+        else
+            since = 0;
+    }
+    else {
+        since = site_held[site].held_since;
+    }
+
+    if (since) {
+        hold = stats_now() - since;
+        __atomic_store_n(&shard_get()->site[site].hold_ns,
+                         my_shard->site[site].hold_ns + hold, __ATOMIC_RELAXED);
+        if (slot)
+            __atomic_fetch_add(&slot->w.hold_ns, hold, __ATOMIC_RELAXED);
+    }
+    V(s);
+}
+
+static int cmp_wait_desc(const void *a, const void *b) {
+
+    const lp_stock_t *x = *(lp_stock_t *const *)a, *y = *(lp_stock_t *const *)b;
+    uint64_t wx = x->w.wait_ns, wy = y->w.wait_ns;
+
+    return (wx < wy) - (wx > wy);
+}
+
+/* Per-site totals followed by the topn stocks with the most lock wait */
+int lockprof_report(char *buf, size_t cap, int topn) {
+
+    lockstat_t sum[LK_NSITES];
+    lp_shard_t *s;
+    lp_stock_t **order;
+    size_t len = 0;
+    int i, k, n = 0;
+
+#define EMIT(...) do { \
+    int _n = snprintf(buf + len, cap - len, __VA_ARGS__); \
+    if (_n < 0 || (size_t)_n >= cap - len) return len; \
+    len += _n; \
+} while (0)
+
+    if (!lockprof_enabled) {
+        EMIT("lock profiling disabled (start with STOCK_LOCKPROF=1)\n");
+        return len;
+    }
+
+    memset(sum, 0, sizeof(sum));
+    for (s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s; s = s->next) {
+        for (i = 0; i < LK_NSITES; i++) {
+            lockstat_t *st = &s->site[i];
+            uint64_t mw = __atomic_load_n(&st->max_wait_ns, __ATOMIC_RELAXED);
+            sum[i].acquires += __atomic_load_n(&st->acquires, __ATOMIC_RELAXED);
+            sum[i].contended += __atomic_load_n(&st->contended, __ATOMIC_RELAXED);
+            sum[i].wait_ns += __atomic_load_n(&st->wait_ns, __ATOMIC_RELAXED);
+            sum[i].hold_ns += __atomic_load_n(&st->hold_ns, __ATOMIC_RELAXED);
+            if (mw > sum[i].max_wait_ns)
+                sum[i].max_wait_ns = mw;
+        }
+    }
+
+    EMIT("site         acquires  contended  wait_ns      max_wait_ns  hold_ns\n");
+    for (i = 0; i < LK_NSITES; i++)
+        EMIT("%-11s  %-8lu  %-9lu  %-11lu  %-11lu  %lu\n", site_names[i],
+             (unsigned long)sum[i].acquires, (unsigned long)sum[i].contended,
+             (unsigned long)sum[i].wait_ns, (unsigned long)sum[i].max_wait_ns,
+             (unsigned long)sum[i].hold_ns);
+
+    EMIT("top %d stocks by lock wait (untracked acquisitions: %lu)\n", topn,
+         __atomic_load_n(&stocks_dropped, __ATOMIC_RELAXED));
+
+    order = Malloc(LP_STOCK_SLOTS * sizeof(lp_stock_t *));
+    for (i = 0; i < LP_STOCK_SLOTS; i++)
+        if (__atomic_load_n(&stocks[i].id, __ATOMIC_ACQUIRE) != LP_FREE)
+            order[n++] = &stocks[i];
+    qsort(order, n, sizeof(lp_stock_t *), cmp_wait_desc);
+    for (k = 0; k < n && k < topn; k++) {
+        lp_stock_t *p = order[k];
+        if (len + 128 >= cap) break;
+        snprintf(buf + len, cap - len,
+                 "id %-6d acq %lu cont %lu wait %lu max_wait %lu hold %lu\n",
+                 p->id, (unsigned long)p->w.acquires, (unsigned long)p->w.contended,
+                 (unsigned long)p->w.wait_ns, (unsigned long)p->w.max_wait_ns,
+                 (unsigned long)p->w.hold_ns);
+        len += strlen(buf + len);
+    }
+    Free(order);
+#undef EMIT
+    return len;
+}
+/* $end lockprof.c */
@@ -0,0 +1,47 @@
+/* $begin lockprof.h */
+#ifndef __LOCKPROF_H__
+#define __LOCKPROF_H__
+
+#include <semaphore.h>
+#include <stddef.h>
+
+/*
+ * Optional lock contention profiler. LP_P/LP_V stand in for P/V at every
+ * lock site; with STOCK_LOCKPROF unset they cost one predictable branch.
+ * When enabled they record acquisitions, contended acquisitions, wait time
+ * and (for exclusive locks) hold time, per lock site in per-thread shards
+ * and per stock id in a shared open-addressing table.
+ */
+
+enum {
+    LK_GLOBAL,          /* Global mutex around the stock.txt writer */
+    LK_STOCK_W,         /* Stock writer lock stripes */
+    LK_SBUF_MUTEX,      /* sbuf buffer lock */
+    LK_SBUF_SLOTS,      /* sbuf free slots (counting) */
+    LK_SBUF_ITEMS,      /* sbuf queued connections (counting) */
+    LK_ACCOUNT,         /* Per-account trade lock */
+    LK_RANK,            /* The top indexes */
+    LK_NSITES
+};
+
+#define LP_STOCK_SLOTS  4096    /* Per-stock table capacity (power of two) */
+#define LP_STOCK_PROBE  16      /* Slots searched before an id goes untracked */
+#define LP_TOPN         5       /* Default number of stocks in a report */
+
+extern int lockprof_enabled;
+
+void lockprof_init(void);
+void lp_P(sem_t *s, int site, int id);
+void lp_V(sem_t *s, int site, int id);
+int lockprof_report(char *buf, size_t cap, int topn);
+
+#define LP_P(s, site, id) do { \
+    if (lockprof_enabled) lp_P((s), (site), (id)); else P(s); \
+} while (0)
+
+#define LP_V(s, site, id) do { \
+    if (lockprof_enabled) lp_V((s), (site), (id)); else V(s); \
+} while (0)
+
+#endif /* __LOCKPROF_H__ */
+/* $end lockprof.h */
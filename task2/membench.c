@@ -0,0 +1,304 @@
+/*
+ * membench.c - stock record layout microbenchmark
+ *
+ * Builds task2's skip list of stocks twice, inserted in random id order:
+ * once with the record the server used to carry (a semaphore, the order
+ * book, combiner and rank pointers and the hot-key counters inline in
+ * every stock) and once with the compact one of stock.h (the 16 bytes a
+ * lookup, trade or show reads, one pointer to an extension allocated on
+ * demand, and a table of STOCK_LOCKS striped writer locks). Each layout is
+ * built in a child process, so its memory is the child's resident set
+ * growth, and the child then times random lookups that read the row under
+ * its seqlock, and show style scans of the whole bottom level.
+ *
+ * Nodes come from an hp.c arena like the server's, so STOCK_HUGEPAGES
+ * picks their backing here too.
+ */
+#include "csapp.h"
+#include "hp.h"
+#include "hist.h"
+#include <time.h>
+#include <stddef.h>
+#include <limits.h>
+
+#define SAMPLE_MASK 15		/* Time one lookup in 16 */
+#define SCANS 5
+#define MAX_LEVEL 16
+#define STRIPES 4096
+
+typedef struct {
+	int id;
+	int price;
+	int amount;
+	unsigned seq;
+} rec_t;			/* What both layouts start with */
+
+typedef struct _old_ {
+	rec_t rec;
+	sem_t w;
+	void *book;
+	void *fc;
+	unsigned hotOps;
+	unsigned hotContended;
+	void *rank[2];
+	int level;
+	int removed;
+	struct _old_ *next[];
+} old_node_t;			/* task2's StockNode before the compact layout */
+
+typedef struct _compact_ {
+	rec_t rec;
+	void *ext;
+	unsigned char level;
+	unsigned char removed;
+	struct _compact_ *next[];
+} compact_node_t;		/* Same layout as stock.h's StockNode */
+
+typedef struct {
+	sem_t w;
+	unsigned hotOps;
+	unsigned hotContended;
+} __attribute__((aligned(64))) stripe_t;
+
+typedef struct {
+	const char *name;
+	size_t size;		/* Node without its next pointers */
+	size_t next_off;
+	int sems;		/* Whether every node has its own semaphore */
+} layout_t;
+
+static const layout_t layouts[] = {
+	{ "old", sizeof(old_node_t), offsetof(old_node_t, next), 1 },
+	{ "compact", sizeof(compact_node_t), offsetof(compact_node_t, next), 0 },
+};
+
+typedef struct {
+	long stocks;
+	long lookups;
+	uint64_t seed;
+	int layouts;		/* Bit per layouts[] entry to run */
+	int csv;
+} config_t;
+
+static config_t cfg = { 1000000, 5000000, 1, 3, 0 };
+static volatile long sink;	/* Keeps the scans from being optimized out */
+
+#define NEXT(l, n)	((void **)((char *)(n) + (l)->next_off))
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t next_rand(uint64_t *s)
+{
+	uint64_t z = (*s += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr, "usage: %s [-n stocks] [-l lookups] [-L old,compact] [-s seed] [-c]\n", prog);
+	exit(1);
+}
+
+/* Resident set of the process in bytes */
+static long rss_bytes(void)
+{
+	long pages = 0, resident = 0;
+	FILE *fp = fopen("/proc/self/statm", "r");
+
+	if (fp) {
+		if (fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+			resident = 0;
+		fclose(fp);
+	}
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* Geometric level with p = 1/4, as in the server */
+static int random_level(uint64_t *rng)
+{
+	uint64_t r = next_rand(rng);
+	int level = 1;
+
+	for (; level < MAX_LEVEL && (r & 3) == 0; r >>= 2)
+		level++;
+	return level;
+}
+
+/* The row's (amount, price) read the way stockRead does */
+static long row_read(rec_t *rec)
+{
+	unsigned s1, s2;
+	int amount, price;
+
+	do {
+		s1 = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		amount = __atomic_load_n(&rec->amount, __ATOMIC_RELAXED);
+		price = __atomic_load_n(&rec->price, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s2 = __atomic_load_n(&rec->seq, __ATOMIC_RELAXED);
+	} while ((s1 & 1) || s1 != s2);
+	return amount + price;
+}
+
+static void *build(const layout_t *l, hp_arena_t *arena, const int *order, long *bytes)
+{
+	void *head = Calloc(1, l->size + MAX_LEVEL * sizeof(void *));
+	void *preds[MAX_LEVEL], *node, *p, *next;
+	uint64_t rng = cfg.seed;
+	long i, before = rss_bytes();
+	int j, level;
+
+	((rec_t *)head)->id = INT_MIN;
+	for (i = 0; i < cfg.stocks; i++) {
+		level = random_level(&rng);
+		node = hp_alloc(arena, l->size + level * sizeof(void *));
+		memset(node, 0, l->size);
+		((rec_t *)node)->id = order[i];
+		((rec_t *)node)->price = 100;
+		((rec_t *)node)->amount = 1000;
+		if (l->sems) {
+			Sem_init(&((old_node_t *)node)->w, 0, 1);
+			((old_node_t *)node)->level = level;
+		} else {
+			((compact_node_t *)node)->level = level;
+		}
+		for (p = head, j = MAX_LEVEL - 1; j >= 0; j--) {
+			while ((next = NEXT(l, p)[j]) && ((rec_t *)next)->id < order[i])
+				p = next;
+			preds[j] = p;
+		}
+		for (j = 0; j < level; j++) {
+			NEXT(l, node)[j] = NEXT(l, preds[j])[j];
+			NEXT(l, preds[j])[j] = node;
+		}
+	}
+	/* The compact layout's writer locks are part of its cost */
+	if (!l->sems) {
+		stripe_t *stripes = hp_alloc(arena, STRIPES * sizeof(stripe_t));
+
+		for (j = 0; j < STRIPES; j++)
+			Sem_init(&stripes[j].w, 0, 1);
+	}
+	*bytes = rss_bytes() - before;
+	return head;
+}
+
+static void run(const layout_t *l, const int *order, const int *keys)
+{
+	hp_arena_t arena;
+	hist_t *lat = Calloc(1, sizeof(hist_t));
+	void *head, *p, *next;
+	uint64_t t0, t1, s;
+	long i, bytes, sum = 0;
+	double lookup_ns, scan_ms;
+	int j;
+
+	hp_arena_init(&arena, HP_LOCAL);
+	head = build(l, &arena, order, &bytes);
+
+	t0 = now_ns();
+	for (i = 0; i < cfg.lookups; i++) {
+		s = (i & SAMPLE_MASK) ? 0 : now_ns();
+		for (p = head, j = MAX_LEVEL - 1; j >= 0; j--)
+			while ((next = NEXT(l, p)[j]) && ((rec_t *)next)->id < keys[i])
+				p = next;
+		if ((p = NEXT(l, p)[0]) && ((rec_t *)p)->id == keys[i])
+			sum += row_read(p);
+		if (s)
+			hist_record(lat, now_ns() - s);
+	}
+	t1 = now_ns();
+	lookup_ns = (double)(t1 - t0) / cfg.lookups;
+
+	t0 = now_ns();
+	for (i = 0; i < SCANS; i++)
+		for (p = NEXT(l, head)[0]; p; p = NEXT(l, p)[0])
+			sum += row_read(p);
+	t1 = now_ns();
+	scan_ms = (t1 - t0) / 1e6 / SCANS;
+	sink = sum;
+
+	if (cfg.csv) {
+		printf("%s,%s,%ld,%zu,%.1f,%.1f,%lu,%lu,%.3f\n", l->name, hp_mode_name[hp_mode],
+		       cfg.stocks, l->size, (double)bytes / cfg.stocks, lookup_ns,
+		       (unsigned long)hist_percentile(lat, 0.50),
+		       (unsigned long)hist_percentile(lat, 0.99), scan_ms);
+	} else {
+		printf("%-8s node %3zu B + next  resident %6.1f B/stock (%ld MB)\n", l->name, l->size,
+		       (double)bytes / cfg.stocks, bytes >> 20);
+		printf("         lookup %6.1f ns (p50 %lu p99 %lu)  scan %8.2f ms (%.1f ns/stock)\n",
+		       lookup_ns, (unsigned long)hist_percentile(lat, 0.50),
+		       (unsigned long)hist_percentile(lat, 0.99), scan_ms, scan_ms * 1e6 / cfg.stocks);
+	}
+	fflush(stdout);
+	Free(lat);
+}
+
+int main(int argc, char **argv)
+{
+	int *order, *keys;
+	uint64_t rng;
+	long i, j;
+	int c, t;
+	char *tok;
+
+	while ((c = getopt(argc, argv, "n:l:L:s:c")) != -1) {
+		switch (c) {
+		case 'n': cfg.stocks = atol(optarg); break;
+		case 'l': cfg.lookups = atol(optarg); break;
+		case 'L':
+			cfg.layouts = 0;
+			for (tok = strtok(optarg, ","); tok; tok = strtok(NULL, ","))
+				cfg.layouts |= !strcmp(tok, "old") ? 1 : !strcmp(tok, "compact") ? 2 : 0;
+			break;
+		case 's': cfg.seed = strtoull(optarg, NULL, 10); break;
+		case 'c': cfg.csv = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (cfg.stocks <= 0 || cfg.stocks > INT_MAX || cfg.lookups <= 0 || !cfg.layouts)
+		usage(argv[0]);
+	hp_config();
+
+	/* Ids 1..stocks in random insertion order, and the ids to look up */
+	order = Malloc(cfg.stocks * sizeof(int));
+	keys = Malloc(cfg.lookups * sizeof(int));
+	rng = cfg.seed;
+	for (i = 0; i < cfg.stocks; i++)
+		order[i] = i + 1;
+	for (i = cfg.stocks - 1; i > 0; i--) {
+		j = next_rand(&rng) % (i + 1);
+		t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+	for (i = 0; i < cfg.lookups; i++)
+		keys[i] = next_rand(&rng) % cfg.stocks + 1;
+
+	if (!cfg.csv)
+		printf("%ld stocks, %ld lookups, nodes on %s\n", cfg.stocks, cfg.lookups,
+		       hp_mode_name[hp_mode]);
+	/* layout,mode,stocks,node_bytes,resident_per_stock,lookup_ns,p50_ns,p99_ns,scan_ms */
+	for (t = 0; t < 2; t++) {
+		if (!(cfg.layouts & (1 << t)))
+			continue;
+		fflush(stdout);
+		if (Fork() == 0) {	/* A fresh heap, so the resident growth is this layout's */
+			run(&layouts[t], order, keys);
+			exit(0);
+		}
+		Wait(NULL);
+	}
+	Free(order);
+	Free(keys);
+	return 0;
+}
@@ -0,0 +1,49 @@
+/* $begin pmu.h */
+#ifndef __PMU_H__
+#define __PMU_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Hardware counters per request phase. With STOCK_PMU_SAMPLE=N, one
+ * request in N per thread has a perf_event group read at every stats lap
+ * (see stats.h), and stats reports the cycles, IPC and miss rates each
+ * phase took. Every read is a system call of a microsecond or so, which
+ * the sampled requests' latencies include. What one read adds to the
+ * counters is measured at startup and taken off every phase.
+ *
+ * pmu_config() picks the first group the kernel opens: cycles,
+ * instructions, cache misses, branches and branch misses, or, without a
+ * hardware PMU (most VMs), CPU time, page faults and context switches.
+ * Kernel time is counted unless perf_event_paranoid forbids it, so the
+ * read and write phases include their system calls.
+ */
+
+enum { PMU_OFF, PMU_HW, PMU_SW };
+
+#define PMU_MAX_EVENTS 5
+#define PMU_CALIBRATE  64       /* Reads timed to find what one read costs */
+
+typedef struct {
+    uint64_t v[PMU_MAX_EVENTS];
+    uint64_t enabled;           /* ns the group was enabled, and running; */
+    uint64_t running;           /* they differ once it was multiplexed */
+} pmu_count_t;
+
+typedef struct {
+    uint64_t samples;
+    uint64_t v[PMU_MAX_EVENTS];
+} pmu_sum_t;
+
+extern int pmu_every;           /* Requests per sample, 0 if off */
+extern int pmu_kind;            /* PMU_* group in use */
+extern const char *pmu_kind_name[];
+
+void pmu_config(void);
+int pmu_read(pmu_count_t *c);
+void pmu_delta(const pmu_count_t *from, const pmu_count_t *to, int reads, uint64_t *d);
+int pmu_format(const pmu_sum_t *s, char *buf, size_t cap);
+
+#endif /* __PMU_H__ */
+/* $end pmu.h */
@@ -0,0 +1,45 @@
+/* $begin rank.h */
+#ifndef __RANK_H__
+#define __RANK_H__
+
+/*
+ * Secondary indexes for "top <n> amount|price". A rank index is a skip list
+ * of one entry per stock ordered by (value descending, id ascending), so
+ * the top n are its first n entries, walked in O(n), and a stock whose
+ * value changed is moved in O(log n) by unlinking its entry and linking it
+ * again at its new place. The stock and its entries point at each other,
+ * so neither a move nor a top reply searches the stock table.
+ *
+ * An index is not thread-safe.
+ */
+
+#define RANK_MAX_LEVEL  16          /* Enough for 4^16 stocks */
+#define RANK_USAGE      "Invalid top (top n amount|price)\n"
+
+enum { RANK_AMOUNT, RANK_PRICE, RANK_NKEYS };
+
+typedef struct _rank_ {
+    int value;
+    int id;
+    int level;
+    void *item;                     /* The stock ranked, for the rest of its row */
+    struct _rank_ *next[];
+} rank_node_t;
+
+typedef struct {
+    rank_node_t *head;              /* Sentinel with every level */
+    int level;                      /* Levels in use */
+    unsigned long long rng;
+} rank_t;
+
+void rank_init(rank_t *r);
+rank_node_t *rank_insert(rank_t *r, int id, int value, void *item);
+void rank_remove(rank_t *r, rank_node_t *e);
+void rank_move(rank_t *r, rank_node_t *e, int value);
+
+/* Entries from the highest value down */
+#define rank_first(r)   ((r)->head->next[0])
+#define rank_next(e)    ((e)->next[0])
+
+#endif /* __RANK_H__ */
+/* $end rank.h */
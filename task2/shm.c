@@ -0,0 +1,306 @@
+/*
+ * shm.c - shared-memory request/reply channels over a Unix socket
+ */
+/* $begin shm.c */
+#include "csapp.h"
+#include "shm.h"
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define SHM_MASK (SHM_RING_SIZE - 1)
+
+shm_chan_t *shm_chans[SHM_MAX_FD];
+int shm_count = 0;
+
+static uint64_t now_ms(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Shared (not private) futexes: the other side is another process */
+static int futex_wait(uint32_t *addr, uint32_t val, int ms) {
+
+    struct timespec ts = { ms / 1000, ms % 1000 * 1000000L };
+
+    return syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void futex_wake(uint32_t *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* The other end closed its socket, or ours was shut down */
+static int peer_gone(shm_chan_t *c) {
+
+    char b;
+    ssize_t n = recv(c->fd, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+static void ring_put(shm_ring_t *r, uint32_t pos, const void *src, uint32_t n) {
+
+    uint32_t off = pos & SHM_MASK, first = SHM_RING_SIZE - off;
+
+    if (first > n) first = n;
+    memcpy(r->data + off, src, first);
+    memcpy(r->data, (const char *)src + first, n - first);
+}
+
+static void ring_get(shm_ring_t *r, uint32_t pos, void *dst, uint32_t n) {
+
+    uint32_t off = pos & SHM_MASK, first = SHM_RING_SIZE - off;
+
+    if (first > n) first = n;
+    memcpy(dst, r->data + off, first);
+    memcpy((char *)dst + first, r->data, n - first);
+}
+
+/*
+ * Queue one message, waiting up to c->timeout_ms for space. Returns -1 if
+ * it timed out, the peer went away, or the ring is corrupt.
+ */
+int shm_send(shm_chan_t *c, shm_ring_t *r, const void *buf, uint32_t n) {
+
+    uint32_t tail = r->tail, head, need = sizeof(uint32_t) + n;
+    uint64_t deadline = c->timeout_ms > 0 ? now_ms() + c->timeout_ms : 0;
+
+    if (need > SHM_RING_SIZE)
+        return -1;
+    while (1) {
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (tail - head > SHM_RING_SIZE)
+            return -1;
+        if (SHM_RING_SIZE - (tail - head) >= need)
+            break;
+        if (deadline && now_ms() >= deadline)
+            return -1;
+        __atomic_store_n(&r->full, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == head
+            && futex_wait(&r->head, head, SHM_POLL_MS) < 0 && errno == ETIMEDOUT
+            && peer_gone(c))
+            return -1;
+    }
+    ring_put(r, tail, &n, sizeof(n));
+    ring_put(r, tail + sizeof(n), buf, n);
+    __atomic_store_n(&r->tail, tail + need, __ATOMIC_SEQ_CST);
+
+    /* Wake the consumer only if it said it is going to sleep */
+    if (__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST) != SHM_AWAKE) {
+        switch (__atomic_exchange_n(&r->waiting, SHM_AWAKE, __ATOMIC_SEQ_CST)) {
+        case SHM_WAIT_FUTEX:
+            futex_wake(&r->tail);
+            break;
+        case SHM_WAIT_DOORBELL:
+            send(c->fd, "", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Take the next message into buf. Waits up to timeout_ms for one (-1 for
+ * ever, 0 not at all) and returns 0 if none came, or -1 if the peer went
+ * away or sent something that does not fit the ring or buf.
+ */
+ssize_t shm_recv(shm_chan_t *c, shm_ring_t *r, void *buf, size_t cap, int timeout_ms) {
+
+    uint32_t head = r->head, tail, n;
+    uint64_t deadline = 0;
+    int spins = 0, ms;
+
+    while ((tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) == head) {
+        if (!timeout_ms)
+            return 0;
+        if (++spins < SHM_SPIN) {
+            if (!(spins & 63))
+                sched_yield();
+            continue;
+        }
+        ms = SHM_POLL_MS;
+        if (timeout_ms > 0) {
+            uint64_t now = now_ms();
+            if (!deadline)
+                deadline = now + timeout_ms;
+            if (now >= deadline)
+                return 0;
+            if (deadline - now < ms)
+                ms = deadline - now;
+        }
+        __atomic_store_n(&r->waiting, SHM_WAIT_FUTEX, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) == head
+            && futex_wait(&r->tail, head, ms) < 0 && errno == ETIMEDOUT && peer_gone(c))
+            return -1;
+        __atomic_store_n(&r->waiting, SHM_AWAKE, __ATOMIC_RELAXED);
+    }
+
+    /* The peer may scribble over the ring, so check what it claims */
+    if (tail - head > SHM_RING_SIZE || tail - head < sizeof(n))
+        return -1;
+    ring_get(r, head, &n, sizeof(n));
+    if (n > cap || n > tail - head - sizeof(n))
+        return -1;
+    ring_get(r, head + sizeof(n), buf, n);
+    __atomic_store_n(&r->head, head + sizeof(n) + n, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&r->full, __ATOMIC_SEQ_CST)
+        && __atomic_exchange_n(&r->full, 0, __ATOMIC_SEQ_CST))
+        futex_wake(&r->head);
+    return n;
+}
+
+/*
+ * Map the segment a client created and route the connection's replies
+ * through it. Answers on the socket either way; returns -1 if it failed.
+ */
+int shm_attach(int fd, char *name, int timeout_ms) {
+
+    char buf[MAXLINE] = "attached\n";
+    struct sockaddr_storage sa;
+    socklen_t salen = sizeof(sa);
+    struct stat st;
+    shm_seg_t *seg = MAP_FAILED;
+    shm_chan_t *c;
+    const char *err = NULL;
+    int sfd = -1;
+
+    if (getsockname(fd, (SA *)&sa, &salen) < 0 || sa.ss_family != AF_UNIX)
+        err = "only over the unix socket";
+    else if (fd >= SHM_MAX_FD)
+        err = "too many connections";
+    else if (shm_chans[fd])
+        err = "already attached";
+    else if ((sfd = shm_open(name, O_RDWR, 0)) < 0)
+        err = "no such segment";
+    else if (fstat(sfd, &st) < 0 || st.st_size != sizeof(shm_seg_t))
+        err = "segment has the wrong size";
+    else if ((seg = mmap(NULL, sizeof(shm_seg_t), PROT_READ | PROT_WRITE, MAP_SHARED,
+                         sfd, 0)) == MAP_FAILED)
+        err = "cannot map segment";
+    else if (seg->magic != SHM_MAGIC || seg->size != sizeof(shm_seg_t))
+        err = "not a channel segment";
+    if (sfd >= 0)
+        close(sfd);
+
+    if (err) {
+        if (seg != MAP_FAILED)
+            munmap(seg, sizeof(shm_seg_t));
+        snprintf(buf, MAXLINE, "Attach failed: %s\n", err);
+        Rio_writen(fd, buf, MAXLINE);
+        return -1;
+    }
+    Rio_writen(fd, buf, MAXLINE);
+
+    c = Malloc(sizeof(shm_chan_t));
+    c->seg = seg;
+    c->fd = fd;
+    c->timeout_ms = timeout_ms > 0 ? timeout_ms : -1;
+    c->broken = 0;
+    shm_chans[fd] = c;
+    __atomic_fetch_add(&shm_count, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Drop the connection's channel, if it has one, before fd is closed */
+void shm_detach(int fd) {
+
+    shm_chan_t *c = shm_chan(fd);
+
+    if (!c) return;
+    shm_chans[fd] = NULL;
+    __atomic_fetch_sub(&shm_count, 1, __ATOMIC_RELAXED);
+    munmap(c->seg, sizeof(shm_seg_t));
+    Free(c);
+}
+
+/*
+ * Send a MAXLINE reply block to the client on fd: as a string through its
+ * channel if it attached one, else over the socket. A channel that cannot
+ * take it is broken and its socket shut down, as Rio_writen does.
+ */
+void shm_reply(int fd, const char *buf) {
+
+    shm_chan_t *c = shm_chan(fd);
+    size_t n;
+
+    if (!c) {
+        Rio_writen(fd, (void *)buf, MAXLINE);
+        return;
+    }
+    if (c->broken)
+        return;
+    n = strnlen(buf, MAXLINE);
+    if (n < MAXLINE)
+        n++;                /* The terminator goes along */
+    if (shm_send(c, &c->seg->resp, buf, n) < 0) {
+        c->broken = 1;
+        shutdown(fd, SHUT_RDWR);
+    }
+}
+
+/*
+ * Ask for a doorbell byte on the socket when the next request is queued.
+ * Returns 1 if one already is, since then none will be sent for it.
+ */
+int shm_arm_doorbell(shm_chan_t *c) {
+
+    __atomic_store_n(&c->seg->req.waiting, SHM_WAIT_DOORBELL, __ATOMIC_SEQ_CST);
+    return shm_pending(&c->seg->req);
+}
+
+/* Swallow the doorbell bytes on fd; returns 0 if the client closed it */
+int shm_doorbell(int fd) {
+
+    char buf[64];
+    ssize_t n;
+
+    while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+        ;
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+}
+
+/* Connect to the server's Unix socket at path and attach a new channel */
+shm_chan_t *shm_connect(char *path) {
+
+    static int seq = 0;
+    char name[64], buf[MAXLINE];
+    shm_chan_t *c = Malloc(sizeof(shm_chan_t));
+    int sfd, n;
+
+    snprintf(name, sizeof(name), "/stock-%d-%d", (int)getpid(),
+             __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED));
+    if ((sfd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0)
+        unix_error("shm_open error");
+    if (ftruncate(sfd, sizeof(shm_seg_t)) < 0)
+        unix_error("ftruncate error");
+    c->seg = Mmap(NULL, sizeof(shm_seg_t), PROT_READ | PROT_WRITE, MAP_SHARED, sfd, 0);
+    Close(sfd);
+    c->seg->magic = SHM_MAGIC;
+    c->seg->size = sizeof(shm_seg_t);
+    c->timeout_ms = -1;
+    c->broken = 0;
+
+    c->fd = Open_unix_clientfd(path);
+    n = snprintf(buf, MAXLINE, "attach %s\n", name);
+    Rio_writen(c->fd, buf, n);
+    n = Rio_readn(c->fd, buf, MAXLINE);
+    shm_unlink(name);
+    if (n != MAXLINE || strcmp(buf, "attached\n"))
+        app_error(n > 0 ? buf : "server closed the connection");
+    return c;
+}
+
+void shm_close(shm_chan_t *c) {
+
+    Close(c->fd);
+    Munmap(c->seg, sizeof(shm_seg_t));
+    Free(c);
+}
+/* $end shm.c */
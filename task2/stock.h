@@ -3,23 +3,54 @@
 #define __STOCK_H__
 
 #include "semaphore.h"
+#include "rank.h"
 
-/* Definition for a stock item */
+/* Definition for a stock item: the 16 bytes a lookup, trade or show reads */
 typedef struct _stock_ {
     int id;
     int price;
     int amount;
-    int readcnt;
-    sem_t mutex;
-    sem_t w;
+    unsigned seq;       /* Seqlock: odd while amount or price is being written */
 } stock;
 
-/* Definition for a binary tree node */
-typedef struct _treeNode_ {
+/* What only some stocks need, allocated the first time one of them does */
+typedef struct _stockExt_ {
+    struct _book_ *book;    /* Resting orders, created on the first order; under w */
+    struct _combiner_ *fc;  /* Combining array once the stock ran hot, else NULL */
+    rank_node_t *rank[RANK_NKEYS];  /* Entries in the top indexes, once built; under rankLock */
+} stockExt;
+
+/*
+ * Writers of a stock serialize on one of STOCK_LOCKS stripes picked by
+ * hashing its id instead of a semaphore of its own; readers never take it.
+ * Each stripe has a cache line to itself.
+ */
+#define STOCK_LOCKS 4096    /* Power of two */
+
+typedef struct {
+    sem_t w;
+    unsigned hotOps;        /* buy/sell in the current detection window; under w */
+    unsigned hotContended;  /* ... of which found w already held */
+} __attribute__((aligned(64))) stockLock;
+
+#define SKIP_MAX_LEVEL 16  /* Skip list levels, enough for 4^16 stocks */
+
+/* Definition for a skip list node, with one forward link per level */
+typedef struct _stockNode_ {
     stock stockItem;
-    struct _treeNode_ *left;
-    struct _treeNode_ *right;
-} TreeNode;
+    stockExt *ext;      /* NULL until the stock has a book, a combiner or top entries */
+    unsigned char level;
+    unsigned char removed;  /* Delisted and waiting to be reclaimed; set under w */
+    struct _stockNode_ *next[];
+} StockNode;
+
+#define LOOKUP_BATCH 16     /* Lookups findNodes interleaves */
+
+#define FC_WINDOW    256    /* Operations per hot-key detection window */
+#define FC_HOT_SHARE 4      /* Combine once 1 in FC_HOT_SHARE of them contend */
+#define FC_MIN_BATCH 2      /* Stop combining below this many requests per pass */
+
+#define SNAPSHOT_RETRIES 8  /* Scans show tries before settling for per-row consistency */
 
 #endif /* __STOCK_H__ */
 /* $end stock.h */
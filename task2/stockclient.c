@@ -3,31 +3,52 @@
  */
 /* $begin echoclientmain */
 #include "csapp.h"
+#include "shm.h"
 
 int main(int argc, char **argv) {
 
     int clientfd;
     char *host, *port, buf[MAXLINE];
     rio_t rio;
+    shm_chan_t *chan = NULL;
+    ssize_t n;
 
-    if (argc != 3) {
-	    fprintf(stderr, "usage: %s <host> <port>\n", argv[0]);
+    /* unix:<path> connects to the server's Unix socket, shm:<path> attaches a channel over it */
+    if (argc != 3 && !(argc == 2 && (!strncmp(argv[1], "unix:", 5) || !strncmp(argv[1], "shm:", 4)))) {
+	    fprintf(stderr, "usage: %s <host> <port> | unix:<path> | shm:<path>\n", argv[0]);
 	    exit(0);
     }
     host = argv[1];
     port = argv[2];
 
-    clientfd = Open_clientfd(host, port);
+    if (!strncmp(host, "shm:", 4)) {
+        chan = shm_connect(host + 4);
+        clientfd = chan->fd;
+    }
+    else if (!strncmp(host, "unix:", 5))
+        clientfd = Open_unix_clientfd(host + 5);
+    else
+        clientfd = Open_clientfd(host, port);
     Rio_readinitb(&rio, clientfd);
 
     while (Fgets(buf, MAXLINE, stdin) != NULL) {
 
+        if (chan) {
+            if (shm_send(chan, &chan->seg->req, buf, strlen(buf)) < 0
+                || (n = shm_recv(chan, &chan->seg->resp, buf, MAXLINE, -1)) <= 0)
+                break;
+            Fwrite(buf, 1, strnlen(buf, n), stdout);
+            continue;
+        }
 	    Rio_writen(clientfd, buf, strlen(buf));
 	    Rio_readnb(&rio, buf, MAXLINE);
 	    Fputs(buf, stdout);
     }
 
-    Close(clientfd); //line:netp:echoclient:close
+    if (chan)
+        shm_close(chan);
+    else
+        Close(clientfd); //line:netp:echoclient:close
     exit(0);
 }
 /* $end echoclientmain */
@@ -5,223 +5,1348 @@
 #include "csapp.h"
 #include "sbuf.h"
 #include "stock.h"
+#include "book.h"
+#include "log.h"
+#include "stats.h"
+#include "lockprof.h"
+#include "ebr.h"
+#include "rl.h"
+#include "shm.h"
+#include "hp.h"
+#include "basket.h"
+#include "account.h"
+#include "restart.h"
+#include "pmu.h"
+#include <limits.h>
+#include <poll.h>
 
 sem_t mutex;
+sem_t rankLock;         /* Guards the top indexes, see rankTouch */
+stockLock stockLocks[STOCK_LOCKS];  /* Writer locks, see stockLockOf */
 sbuf_t sbuf;            /* Shared buffer of connected descriptors */
-TreeNode* root = NULL;
+StockNode* head = NULL;     /* Sentinel of the stock index */
 int writeCnt = 0;
+int connCount = 0;      /* Connections accepted and not yet closed */
+hp_arena_t nodeArena;   /* Stock nodes, on huge pages with STOCK_HUGEPAGES */
+hp_arena_t* connArena;  /* Worker read buffers, one arena per NUMA node */
+int successorFd = -1;   /* The server taking over, once one asked */
+int restartPipe[2];     /* Readable once one asked, to stop the acceptors */
 
-void echo(int connfd);
+void echo(int connfd, rio_t* rp);
+void timeouts_start(void);
+void drainConnections(int how);
 void sbuf_init(sbuf_t *sp, int n);
 void sbuf_deinit(sbuf_t *sp);
 void sbuf_insert(sbuf_t *sp, int item);
 int sbuf_remove(sbuf_t *sp);
 void *thread(void *vargp);
-void deleteTree(TreeNode* node);
-TreeNode* createNode(int id, int amount, int price);
-void addNodeToTree(TreeNode* node);
+void acceptLoop(int listenfd);
+void *unixAcceptor(void *vargp);
+void *restartWaiter(void *vargp);
+void handOver(int listenfd, int unixfd);
+void deleteIndex(void);
+StockNode* createNode(int id, int amount, int price);
+void freeNode(void* vp);
+bool insertNode(StockNode* node);
+bool removeNode(int targetId);
 
-void searchAndUpdate(int targetId, int amount, bool action, const int connfd, char* cmd);
-void createResultString(TreeNode* node, char* newBuf);
+bool searchAndUpdate(int targetId, int amount, bool action, account_t* acct, const int connfd, char* cmd);
+bool basketUpdate(basket_leg_t* legs, int n, account_t* acct, const int connfd);
+bool showAccount(account_t* acct, const int connfd);
+void rankTouch(StockNode* node);
+void rankForget(StockNode* node);
+bool showTop(int n, int key, const int connfd);
+bool showRange(int lo, int hi, char* newBuf);
+StockNode* findNode(int targetId);
+void findNodes(const int* ids, int n, StockNode** nodes);
+bool submitOrder(int targetId, int side, int qty, int price, const int connfd);
+bool cancelOrder(int targetId, unsigned oid, const int connfd);
+bool showBook(int targetId, int depth, const int connfd);
+bool listStock(int targetId, int amount, int price, const int connfd);
+bool delistStock(int targetId, const int connfd);
+bool createSnapshotString(char* newBuf);
+void writeTable(FILE* fp);
 
 int main(int argc, char **argv) {
 
-    int i, listenfd, connfd;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;  /* Enough space for any address */  //line:netp:echoserveri:sockaddrstorage
-    pthread_t tid;
-    char client_hostname[MAXLINE], client_port[MAXLINE];
+    int i, listenfd;
+    int lfds[RESTART_MAX_FDS], nlfds = 0;
+    restart_row_t *rows;
+    long r, nrows;
+    static int unixfd, ctlfd;
+    pthread_t tid, unixTid;
+    char *unixPath = getenv("STOCK_UNIX_SOCKET");
     FILE *fp;
 
     if (argc != 2) {
 	    fprintf(stderr, "usage: %s <port>\n", argv[0]);
 	    exit(0);
     }
+    log_init(stdout);
+    stats_start_dumper();
+    lockprof_init();
+    timeouts_start();
+    rl_config();
+    hp_config();
+    acct_config();
+    restart_config();
+    pmu_config();
+    hp_arena_init(&nodeArena, HP_INTERLEAVE);   /* Every worker reads every stock */
+    connArena = Calloc(hp_nodes(), sizeof(hp_arena_t));
+    for (i = 0; i < hp_nodes(); i++)
+        hp_arena_init(&connArena[i], HP_LOCAL);
+    LOG_TEXT(LOG_LVL_INFO, "stock table and connection buffers on %s", hp_mode_name[hp_mode]);
+    if (pmu_every)
+        LOG_TEXT(LOG_LVL_INFO, "%s counters on one request in %d", pmu_kind_name[pmu_kind], pmu_every);
+    Signal(SIGPIPE, SIG_IGN);   /* A client that went away fails its write instead */
+    for (i = 0; i < STOCK_LOCKS; i++)
+        Sem_init(&stockLocks[i].w, 0, 1);
 
-    /* File (stock.txt) read start */
-    fp = fopen("stock.txt", "r");
-    if (!fp) {
-        fprintf(stderr, "The file (stock.txt) does not exist. \n");
-        return 0;
+    /* A running server hands over its table; without one it comes from stock.txt */
+    head = createNode(INT_MIN, 0, 0);
+    if (restart_path && restart_takeover(lfds, &nlfds, &rows, &nrows) == 0) {
+        for (r = 0; r < nrows; r++) {
+            StockNode* node = createNode(rows[r].id, rows[r].amount, rows[r].price);
+            if (!insertNode(node))
+                freeNode(node);
+        }
+        restart_release(rows, nrows);
+        LOG_TEXT(LOG_LVL_INFO, "took over %ld stocks and %d listening sockets", nrows, nlfds);
     }
-    int s_id, s_amount, s_price;
-    while (fscanf(fp, "%d %d %d", &s_id, &s_amount, &s_price) != -1) {
-        //printf("%d %d %d \n", s_id, s_amount, s_price);
-        TreeNode* node = createNode(s_id, s_amount, s_price);
-        if (!node) {
-            fclose(fp);
-            exit(-1);
+    else {
+        /* File (stock.txt) read start */
+        fp = fopen("stock.txt", "r");
+        if (!fp) {
+            fprintf(stderr, "The file (stock.txt) does not exist. \n");
+            return 0;
+        }
+        int s_id, s_amount, s_price;
+        while (fscanf(fp, "%d %d %d", &s_id, &s_amount, &s_price) != -1) {
+            //printf("%d %d %d \n", s_id, s_amount, s_price);
+            StockNode* node = createNode(s_id, s_amount, s_price);
+            if (!node) {
+                fclose(fp);
+                exit(-1);
+            }
+            if (!insertNode(node)) {
+                LOG_WARN("stock id: %ld - already exists.", s_id);
+                freeNode(node);
+            }
         }
-        addNodeToTree(node);
+
+        fclose(fp);
+        /* File read end */
     }
-    
-    fclose(fp);
-    /* File read end */
 
-    listenfd = Open_listenfd(argv[1]);
+    int naccts = acct_load(ACCT_FILE);
+    if (naccts >= 0)
+        LOG_TEXT(LOG_LVL_INFO, "loaded %d accounts from %s", naccts, ACCT_FILE);
+
+    listenfd = nlfds ? lfds[0] : Open_listenfd(argv[1]);
     sbuf_init(&sbuf, SBUFSIZE);
     Sem_init(&mutex, 0, 1);
+    Sem_init(&rankLock, 0, 1);
 
     for (i = 0; i < NTHREADS; i++) {    /* Create worker threads */
         Pthread_create(&tid, NULL, thread, NULL);
     }
 
+    /* Same-host clients may also connect, and attach shared memory, here */
+    if (unixPath && *unixPath) {
+        unixfd = nlfds > 1 ? lfds[1] : Open_unix_listenfd(unixPath);
+        Pthread_create(&unixTid, NULL, unixAcceptor, &unixfd);
+    }
+    else if (nlfds > 1) {
+        Close(lfds[1]);
+    }
+
+    /* Where the next server asks for the sockets */
+    if (restart_path) {
+        if (pipe(restartPipe) < 0)
+            unix_error("pipe error");
+        ctlfd = restart_listen();
+        Pthread_create(&tid, NULL, restartWaiter, &ctlfd);
+    }
+    acceptLoop(listenfd);
+
+    /* Only a successor stops the acceptors */
+    if (unixPath && *unixPath)
+        Pthread_join(unixTid, NULL);
+    handOver(listenfd, unixPath && *unixPath ? unixfd : -1);
+
+    sbuf_deinit(&sbuf);
+    deleteIndex();
+    exit(0);
+}
+/* $end echoserverimain */
+
+void *unixAcceptor(void *vargp) {
+
+    acceptLoop(*(int *)vargp);
+    return NULL;
+}
+
+/* Wait for a successor, then stop the acceptors */
+void *restartWaiter(void *vargp) {
+
+    int ctlfd = *(int *)vargp;
+
+    Pthread_detach(pthread_self());
+    __atomic_store_n(&successorFd, Accept(ctlfd, NULL, NULL), __ATOMIC_RELEASE);
+    Close(ctlfd);
+    Rio_writen(restartPipe[1], "x", 1);     /* Never read, so every acceptor sees it */
+    return NULL;
+}
+
+void acceptLoop(int listenfd) {
+
+    int connfd;
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;  /* Enough space for any address */  //line:netp:echoserveri:sockaddrstorage
+    char client_hostname[MAXLINE], client_port[MAXLINE];
+    struct pollfd pfd[2] = { { listenfd, POLLIN, 0 }, { restartPipe[0], POLLIN, 0 } };
+
     while (1) {
+        /* Return once a successor asked for the sockets */
+        if (restart_path) {
+            if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+                unix_error("poll error");
+            if (pfd[1].revents)
+                return;
+            if (!pfd[0].revents)
+                continue;
+        }
 	    clientlen = sizeof(struct sockaddr_storage); 
 	    connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
 
+        /* Turn the client away now rather than queue it behind the backlog */
+        int queued;
+        sem_getvalue(&sbuf.items, &queued);
+        if ((rl_max_conns && __atomic_load_n(&connCount, __ATOMIC_RELAXED) >= rl_max_conns)
+            || (rl_queue_max && queued >= rl_queue_max)) {
+            rl_reject(connfd);
+            stats_begin();
+            stats_end(CMD_BUSY, false, 0);
+            continue;
+        }
+        __atomic_fetch_add(&connCount, 1, __ATOMIC_RELAXED);
+
+        if (clientaddr.ss_family == AF_UNIX) {
+            sbuf_insert(&sbuf, connfd);
+            LOG_INFO("Connected on the unix socket, fd: %ld", connfd);
+            continue;
+        }
         Getnameinfo((SA *) &clientaddr, clientlen, client_hostname, MAXLINE, client_port, MAXLINE, 0);
         sbuf_insert(&sbuf, connfd);     /* Insert connfd in buffer */
-        printf("Connected to (%s, %s)\n", client_hostname, client_port);
+        LOG_TEXT(LOG_LVL_INFO, "Connected to (%s, %s)", client_hostname, client_port);
     }
+}
 
-    sbuf_deinit(&sbuf);
-    deleteTree(root);
-    exit(0);
+/*
+ * Writers still exclude each other with the w semaphore of the stock's lock
+ * stripe, but
+ * readers never take it. Each stock carries a seqlock (odd while its amount
+ * is being changed) for per-row consistency, and the table-wide pair of
+ * counters below lets show detect whether any write overlapped its scan.
+ */
+static struct {
+    unsigned long started;      /* Writes begun */
+    unsigned long finished;     /* Writes completed */
+} __attribute__((aligned(64))) tableEpoch;
+
+/*
+ * The stocks are indexed by a skip list ordered by id. Lookups walk it
+ * without taking any lock. list and delist serialize on indexLock, publish
+ * links bottom-up with release stores, and hand unlinked nodes to ebr, so a
+ * lookup still holding a delisted node never sees it freed. Every change
+ * bumps indexShape so cached node pointers (the show rows) can be revalidated.
+ */
+static pthread_mutex_t indexLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long indexShape = 0;
+static int indexLevel = 1;      /* Levels in use; only grows */
+
+/*
+ * The writer lock of a stock. Two stocks may share a stripe; requests
+ * that hold more than one (baskets) take them in stripe order, once each.
+ */
+static stockLock* stockLockOf(int id) {
+    return &stockLocks[(((uint64_t)(unsigned)id * 0x9e3779b97f4a7c15ULL) >> 32) & (STOCK_LOCKS - 1)];
 }
-/* $end echoserverimain */
 
-void searchAndUpdate(int targetId, int amount, bool action, const int connfd, char* cmd) {   // action: sell if true, buy if false
+/* The stock's extension, allocated by whichever writer first needs it */
+static stockExt* stockExtOf(StockNode* node) {
+
+    stockExt *ext = __atomic_load_n(&node->ext, __ATOMIC_ACQUIRE), *mine;
+
+    if (ext) return ext;
+    mine = Calloc(1, sizeof(stockExt));
+    if (__atomic_compare_exchange_n(&node->ext, &ext, mine, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return mine;
+    Free(mine);     /* Another writer's won; ext now holds it */
+    return ext;
+}
+
+static void stockWriteBegin(stock* item) {
+
+    __atomic_fetch_add(&tableEpoch.started, 1, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&item->seq, item->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void stockWriteEnd(stock* item) {
+
+    __atomic_store_n(&item->seq, item->seq + 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&tableEpoch.finished, 1, __ATOMIC_RELEASE);
+}
+
+/* Read a consistent (amount, price) pair without blocking the writer */
+static void stockRead(stock* item, int* amount, int* price) {
+
+    unsigned s1, s2;
+
+    do {
+        s1 = __atomic_load_n(&item->seq, __ATOMIC_ACQUIRE);
+        *amount = __atomic_load_n(&item->amount, __ATOMIC_RELAXED);
+        *price = __atomic_load_n(&item->price, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        s2 = __atomic_load_n(&item->seq, __ATOMIC_RELAXED);
+    } while ((s1 & 1) || s1 != s2);
+}
+
+/*
+ * Flat combining for hot stocks. When many workers trade the same id they
+ * would all queue on its w semaphore and pass its cache lines around one at
+ * a time. Once a stock is seen to be hot, buy and sell instead publish the
+ * request in the worker's slot of a per-stock combining array, and whichever
+ * worker gets w applies every pending request in one pass: the buys and
+ * sells are checked in slot order against a running amount and the net
+ * result is published with a single seqlock write.
+ *
+ * Detection is sampled under w: a window of FC_WINDOW buy/sell operations in
+ * which at least 1 in FC_HOT_SHARE found w already held turns combining on.
+ * If FC_WINDOW passes then serve fewer than FC_MIN_BATCH requests each on
+ * average, it is turned off again. The array stays allocated until the node is freed, so
+ * a request published just before combining stopped is still served, by
+ * its own worker if nobody else.
+ */
+#define FC_SLOTS NTHREADS
+
+enum { FC_IDLE, FC_PENDING, FC_DONE };
+
+typedef struct {
+    int state;
+    int amount;
+    bool action;            /* sell if true, buy if false */
+    bool ok;                /* Result, valid once state is FC_DONE */
+} __attribute__((aligned(64))) fcSlot;
+
+typedef struct _combiner_ {
+    int active;             /* New requests publish here instead of taking w */
+    unsigned served;        /* Requests served over the last passes; under w */
+    unsigned passes;        /* Passes in the cooling window, up to FC_WINDOW */
+    fcSlot slot[FC_SLOTS];
+} combiner;
+
+static int fcNextSlot = 0;
+static __thread int fcMySlot = -1;
+
+static int fcSlotIndex(void) {
+
+    if (fcMySlot < 0)
+        fcMySlot = __atomic_fetch_add(&fcNextSlot, 1, __ATOMIC_RELAXED);
+    return fcMySlot < FC_SLOTS ? fcMySlot : -1;
+}
+
+/*
+ * Count one buy/sell into the detection window of the stripe; caller holds
+ * its w. The stock whose trade closes a hot window gets the combiner: on a
+ * stripe of 1/STOCK_LOCKS of the table that is nearly always the hot one.
+ */
+static void hotSample(stockLock* lk, StockNode* node, bool contended) {
+
+    stock* item = &node->stockItem;
+    stockExt* ext;
+    combiner* fc;
+
+    if (contended) lk->hotContended++;
+    if (++lk->hotOps < FC_WINDOW) return;
+
+    if (lk->hotContended * FC_HOT_SHARE >= FC_WINDOW) {
+        ext = stockExtOf(node);
+        if ((fc = ext->fc) == NULL) {
+            if (posix_memalign((void**)&fc, 64, sizeof(combiner)) == 0) {
+                memset(fc, 0, sizeof(combiner));
+                fc->active = 1;
+                __atomic_store_n(&ext->fc, fc, __ATOMIC_RELEASE);
+                LOG_TEXT(LOG_LVL_INFO, "stock id: %d - combining on", item->id);
+            }
+        }
+        else if (!fc->active) {
+            __atomic_store_n(&fc->active, 1, __ATOMIC_RELAXED);
+            LOG_TEXT(LOG_LVL_INFO, "stock id: %d - combining on", item->id);
+        }
+    }
+    lk->hotOps = lk->hotContended = 0;
+}
+
+/* Apply every pending request in one pass; caller holds w */
+static void combinePass(StockNode* node, combiner* fc) {
+
+    stock* item = &node->stockItem;
+    int amount = item->amount;
+    int done[FC_SLOTS];
+    int i, n = 0;
+
+    for (i = 0; i < FC_SLOTS; i++) {
+        fcSlot* s = &fc->slot[i];
+
+        if (__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) != FC_PENDING)
+            continue;
+        s->ok = !node->removed && (s->action || amount >= s->amount);
+        if (s->ok)
+            amount += s->action ? s->amount : -s->amount;
+        done[n++] = i;
+    }
+    if (!n) return;
+
+    if (amount != item->amount) {
+        stockWriteBegin(item);
+        __atomic_store_n(&item->amount, amount, __ATOMIC_RELAXED);
+        stockWriteEnd(item);
+    }
+    /* Only now, so a served worker's next show sees its own trade */
+    for (i = 0; i < n; i++)
+        __atomic_store_n(&fc->slot[done[i]].state, FC_DONE, __ATOMIC_RELEASE);
+
+    fc->served += n;
+    if (++fc->passes < FC_WINDOW) return;
+    if (fc->served < FC_WINDOW * FC_MIN_BATCH) {
+        __atomic_store_n(&fc->active, 0, __ATOMIC_RELAXED);
+        LOG_TEXT(LOG_LVL_INFO, "stock id: %d - combining off", item->id);
+    }
+    fc->served = fc->passes = 0;
+}
+
+/* Publish a buy/sell and wait until some combiner, possibly us, applied it */
+static bool combineUpdate(StockNode* node, combiner* fc, int slot, int amount, bool action) {
+
+    stockLock* lk = stockLockOf(node->stockItem.id);
+    fcSlot* s = &fc->slot[slot];
+    unsigned spins;
+
+    s->amount = amount;
+    s->action = action;
+    __atomic_store_n(&s->state, FC_PENDING, __ATOMIC_RELEASE);
+
+    for (spins = 1; __atomic_load_n(&s->state, __ATOMIC_ACQUIRE) != FC_DONE; spins++) {
+        if (sem_trywait(&lk->w) == 0) {
+            combinePass(node, fc);
+            V(&lk->w);
+        }
+        else if (!(spins & 63)) {
+            sched_yield();
+        }
+    }
+    __atomic_store_n(&s->state, FC_IDLE, __ATOMIC_RELAXED);
+    return s->ok;
+}
+
+bool searchAndUpdate(int targetId, int amount, bool action, account_t* acct, const int connfd, char* cmd) {   // action: sell if true, buy if false
 
     char buf[MAXLINE];
-    TreeNode* node = root;
+    StockNode* node = findNode(targetId);
     bool updated = false;
+    const char* refused = NULL;
 
-    while (node) {
-        
-        if (targetId == node->stockItem.id) {
-            if (action || node->stockItem.amount >= amount) {   // sell or buy stock
+    if (node) {
+        stockLock* lk = stockLockOf(targetId);
+        stockExt* ext = __atomic_load_n(&node->ext, __ATOMIC_ACQUIRE);
+        combiner* fc = ext ? __atomic_load_n(&ext->fc, __ATOMIC_ACQUIRE) : NULL;
+        int slot, busy;
 
-                P(&node->stockItem.w);
+        stats_lap(PH_LOOKUP);
+        /* A combiner knows nothing of accounts, so account trades always take w */
+        if (!acct && fc && __atomic_load_n(&fc->active, __ATOMIC_RELAXED) && (slot = fcSlotIndex()) >= 0) {
+            updated = combineUpdate(node, fc, slot, amount, action);
+            stats_lap(PH_LOCK);
+        }
+        else {
+            /* The account lock comes first wherever both are held */
+            if (acct)
+                LP_P(&acct->lock, LK_ACCOUNT, acct->id);
+            sem_getvalue(&lk->w, &busy);
+            LP_P(&lk->w, LK_STOCK_W, targetId);
+            stats_lap(PH_LOCK);
+            if (acct && !node->removed)
+                refused = acct_check(acct, targetId, action ? amount : -(long)amount,
+                                     node->stockItem.price);
+            if (!refused && !node->removed && (action || node->stockItem.amount >= amount)) {   // sell or buy stock
+
+                stockWriteBegin(&node->stockItem);
                 if (action) {
-                    node->stockItem.amount += amount;
-                    sprintf(buf, "[sell] success\n");
+                    __atomic_store_n(&node->stockItem.amount, node->stockItem.amount + amount, __ATOMIC_RELAXED);
                 }
                 else {
-                    node->stockItem.amount -= amount;
-                    sprintf(buf, "[buy] success\n");
+                    __atomic_store_n(&node->stockItem.amount, node->stockItem.amount - amount, __ATOMIC_RELAXED);
                 }
-                V(&node->stockItem.w);
+                stockWriteEnd(&node->stockItem);
+                if (acct)
+                    acct_trade(acct, targetId, action ? amount : -(long)amount,
+                               node->stockItem.price);
                 updated = true;
                 //fprintf(stdout, "%s success \n", cmd);
                 //fflush(stdout);
             }
-            break;
-        }
-        else if (targetId < node->stockItem.id) {
-            node = node->left;
-        }
-        else {
-            node = node->right;
+            hotSample(lk, node, busy <= 0);
+            LP_V(&lk->w, LK_STOCK_W, targetId);
+            if (acct)
+                LP_V(&acct->lock, LK_ACCOUNT, acct->id);
         }
+        if (updated)
+            rankTouch(node);
     }
 
     //if (!node) {
         //sprintf(buf, "Invalid stock ID\n");
     //}
-    if (!updated) {
+    stats_skip();
+    if (refused) {
+        strcpy(buf, refused);
+    }
+    else if (updated) {
+        sprintf(buf, action ? "[sell] success\n" : "[buy] success\n");
+    }
+    else {
         sprintf(buf, "Not enough left stock\n");
     }
-    Rio_writen(connfd, buf, MAXLINE);
+    stats_lap(PH_FORMAT);
+    shm_reply(connfd, buf);
+    stats_lap(PH_WRITE);
 
-    return;
+    return updated;
 }
 
-void createResultString(TreeNode* node, char* newBuf) {
+/*
+ * Trade every leg of a basket or none. The lock stripes of the legs are
+ * taken in address order, each once even if legs share it; baskets are the
+ * only requests that hold more than one w, so two of them can never wait on
+ * each other in a cycle, and no global lock is needed. Every leg is checked
+ * before any is applied, and all the writes are opened before the first
+ * store, so a show that overlaps the basket retries rather than seeing part
+ * of it.
+ */
+bool basketUpdate(basket_leg_t* legs, int n, account_t* acct, const int connfd) {
 
-    if (!node) return;
+    char buf[MAXLINE];
+    StockNode* nodes[BASKET_MAX];
+    int ids[BASKET_MAX] = {0};
+    stockLock* locks[BASKET_MAX];
+    int lockIds[BASKET_MAX];        /* A leg on each stripe, for the lock profile */
+    bool ok = true, locked = false;
+    long cash = 0;
+    int i, j, nlocks = 0;
 
-    createResultString(node->left, newBuf);
+    for (i = 0; i < n; i++)
+        ids[i] = legs[i].id;
+    findNodes(ids, n, nodes);
+    for (i = 0; ok && i < n; i++) {
+        if (!nodes[i]) {
+            sprintf(buf, "No such stock (id %d)\n", legs[i].id);
+            ok = false;
+        }
+    }
+    stats_lap(PH_LOOKUP);
 
-    P(&(node->stockItem.mutex));
-    (node->stockItem.readcnt)++;
-    if (node->stockItem.readcnt == 1) /* First in */
-        P(&(node->stockItem.w));
-    V(&(node->stockItem.mutex));
+    if (ok) {
+        /* The account lock comes first wherever both are held */
+        if (acct)
+            LP_P(&acct->lock, LK_ACCOUNT, acct->id);
+        for (i = 0; i < n; i++) {     /* Insertion sort; a basket is short */
+            stockLock* lk = stockLockOf(legs[i].id);
 
-    char tmp[10];
-    sprintf(tmp, "%d", node->stockItem.id);
-    strcat(newBuf, tmp);
-    strcat(newBuf, " ");
-    sprintf(tmp, "%d", node->stockItem.amount);
-    strcat(newBuf, tmp);
-    strcat(newBuf, " ");
-    sprintf(tmp, "%d", node->stockItem.price);
-    strcat(newBuf, tmp);
-    strcat(newBuf, "\n");
+            for (j = 0; j < nlocks && locks[j] != lk; j++)
+                ;
+            if (j < nlocks) continue;
+            for (j = nlocks++; j > 0 && locks[j - 1] > lk; j--) {
+                locks[j] = locks[j - 1];
+                lockIds[j] = lockIds[j - 1];
+            }
+            locks[j] = lk;
+            lockIds[j] = legs[i].id;
+        }
+        for (i = 0; i < nlocks; i++)
+            LP_P(&locks[i]->w, LK_STOCK_W, lockIds[i]);
+        locked = true;
+        stats_lap(PH_LOCK);
 
-    P(&(node->stockItem.mutex));
-    (node->stockItem.readcnt)--;
-    if (node->stockItem.readcnt == 0) /* Last out */
-        V(&(node->stockItem.w));
-    V(&(node->stockItem.mutex));
+        cash = acct ? acct->cash : 0;
+        for (i = 0; ok && i < n; i++) {
+            stock* item = &nodes[i]->stockItem;
 
-    createResultString(node->right, newBuf);
+            if (nodes[i]->removed)
+                sprintf(buf, "No such stock (id %d)\n", legs[i].id);
+            else if (item->amount + legs[i].delta < 0)
+                sprintf(buf, "Not enough left stock (id %d)\n", legs[i].id);
+            else if (acct && legs[i].delta > 0 && acct_held(acct, legs[i].id) < legs[i].delta)
+                sprintf(buf, "Not enough position (id %d)\n", legs[i].id);
+            else {
+                cash += legs[i].delta * item->price;
+                continue;
+            }
+            ok = false;
+        }
+        /* The sells of the basket pay for its buys */
+        if (ok && acct && cash < 0) {
+            sprintf(buf, "Not enough cash\n");
+            ok = false;
+        }
+    }
+
+    if (ok) {
+        for (i = 0; i < n; i++)
+            stockWriteBegin(&nodes[i]->stockItem);
+        for (i = 0; i < n; i++)
+            __atomic_store_n(&nodes[i]->stockItem.amount,
+                             (int)(nodes[i]->stockItem.amount + legs[i].delta), __ATOMIC_RELAXED);
+        for (i = 0; i < n; i++)
+            stockWriteEnd(&nodes[i]->stockItem);
+        if (acct)
+            for (i = 0; i < n; i++)
+                acct_trade(acct, legs[i].id, legs[i].delta, nodes[i]->stockItem.price);
+        sprintf(buf, "[basket] success\n");
+    }
+    if (locked) {
+        for (i = nlocks - 1; i >= 0; i--)
+            LP_V(&locks[i]->w, LK_STOCK_W, lockIds[i]);
+        if (acct)
+            LP_V(&acct->lock, LK_ACCOUNT, acct->id);
+    }
+    if (ok)
+        for (i = 0; i < n; i++)
+            rankTouch(nodes[i]);
+    stats_skip();
+    shm_reply(connfd, buf);
+    stats_lap(PH_WRITE);
+
+    return ok;
 }
 
-TreeNode* createNode(int id, int amount, int price) {
+bool showAccount(account_t* acct, const int connfd) {
+
+    char buf[MAXLINE];
+
+    memset(buf, '\0', sizeof(buf));
+    if (acct) {
+        LP_P(&acct->lock, LK_ACCOUNT, acct->id);
+        acct_report(acct, buf, MAXLINE - 1);
+        LP_V(&acct->lock, LK_ACCOUNT, acct->id);
+    }
+    else {
+        sprintf(buf, "Not logged in\n");
+    }
+    shm_reply(connfd, buf);
+    return acct != NULL;
+}
 
-    TreeNode* node = (TreeNode*)malloc(sizeof(TreeNode));
+/*
+ * Match a limit (price > 0) or market (price 0) order against the stock's
+ * book under its w semaphore. A fill moves the stock's price to the last
+ * fill price. amount is the server's own inventory that buy and sell trade
+ * against, so fills between clients leave it alone.
+ */
+bool submitOrder(int targetId, int side, int qty, int price, const int connfd) {
+
+    char buf[MAXLINE];
+    StockNode* node = findNode(targetId);
+    book_result_t res;
+    int rc = -1;
+    bool moved = false;
+
+    stats_lap(PH_LOOKUP);
+    if (node) {
+        stock* item = &node->stockItem;
+        stockLock* lk = stockLockOf(targetId);
+        stockExt* ext;
+
+        LP_P(&lk->w, LK_STOCK_W, targetId);
+        stats_lap(PH_LOCK);
+        if (node->removed) {
+            node = NULL;
+        }
+        else {
+            ext = stockExtOf(node);
+            if (!ext->book)
+                ext->book = book_create();
+            rc = book_submit(ext->book, side, qty, price, &res);
+            if (res.filled && res.last_price != item->price) {
+                stockWriteBegin(item);
+                __atomic_store_n(&item->price, res.last_price, __ATOMIC_RELAXED);
+                stockWriteEnd(item);
+                moved = true;
+            }
+        }
+        LP_V(&lk->w, LK_STOCK_W, targetId);
+        if (moved)
+            rankTouch(node);
+    }
+
+    stats_skip();
+    if (!node)
+        sprintf(buf, "No such stock\n");
+    else if (rc < 0 && !res.filled)
+        sprintf(buf, "Not accepted\n");
+    else
+        sprintf(buf, "[order] oid %u filled %d avg %ld resting %d\n", res.oid, res.filled,
+                res.filled ? res.notional / res.filled : 0, res.rested);
+    stats_lap(PH_FORMAT);
+    shm_reply(connfd, buf);
+    stats_lap(PH_WRITE);
+
+    return node && (rc == 0 || res.filled);
+}
+
+bool cancelOrder(int targetId, unsigned oid, const int connfd) {
+
+    char buf[MAXLINE];
+    StockNode* node = findNode(targetId);
+    stockLock* lk = stockLockOf(targetId);
+    int qty = -1;
+
+    stats_lap(PH_LOOKUP);
+    if (node) {
+        LP_P(&lk->w, LK_STOCK_W, targetId);
+        stats_lap(PH_LOCK);
+        if (!node->removed && node->ext && node->ext->book)
+            qty = book_cancel(node->ext->book, oid);
+        LP_V(&lk->w, LK_STOCK_W, targetId);
+    }
+
+    stats_skip();
+    if (qty < 0)
+        sprintf(buf, "No such order\n");
+    else
+        sprintf(buf, "[cancel] oid %u qty %d\n", oid, qty);
+    stats_lap(PH_FORMAT);
+    shm_reply(connfd, buf);
+    stats_lap(PH_WRITE);
+
+    return qty >= 0;
+}
+
+bool showBook(int targetId, int depth, const int connfd) {
+
+    char buf[MAXLINE];
+    StockNode* node = findNode(targetId);
+    stockLock* lk = stockLockOf(targetId);
+    int len = 0;
+
+    memset(buf, '\0', sizeof(buf));
+    if (node) {
+        LP_P(&lk->w, LK_STOCK_W, targetId);
+        if (node->removed)
+            node = NULL;
+        else if (node->ext && node->ext->book)
+            len = book_render(node->ext->book, buf, MAXLINE - 1, depth);
+        LP_V(&lk->w, LK_STOCK_W, targetId);
+    }
+    if (!node)
+        sprintf(buf, "No such stock\n");
+    else if (!len)
+        sprintf(buf, "empty book\n");
+    shm_reply(connfd, buf);
+
+    return node != NULL;
+}
+
+/* A show reply is a single MAXLINE block, so rows that do not fit are cut */
+#define SHOW_ROW_MAX 36
+#define SHOW_ROWS_MAX (MAXLINE / 6 + 1)     /* "1 0 0\n" is the shortest row */
+
+/*
+ * show is served from one pre-rendered reply shared by every worker. It
+ * stays valid while no write finishes (gen == tableEpoch.finished + 1), so on a
+ * quiet table show costs a single memcpy. Once stale, the next show
+ * refreshes it: only rows whose amount or price changed are re-rendered,
+ * and the reply is re-copied from the first changed row onwards.
+ */
+typedef struct {
+    StockNode* node;
+    int amount, price;          /* Values text was rendered from */
+    int len;                    /* Length of text, 0 until first rendered */
+    int off;                    /* Offset of the row in buf, -1 if cut off */
+    char text[SHOW_ROW_MAX];
+} showRow;
+
+static struct {
+    pthread_mutex_t build;      /* Held by the thread refreshing rows */
+    pthread_rwlock_t lock;      /* Readers copy buf; the refresher patches it */
+    showRow* rows;              /* In-order prefix of the table */
+    int nrows;
+    unsigned long shape;        /* indexShape the rows were collected at */
+    int len;                    /* Bytes of buf in use */
+    unsigned long gen;          /* 1 + tableEpoch.finished buf reflects, 0 if stale */
+    char buf[MAXLINE];
+} showCache = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_RWLOCK_INITIALIZER };
+
+/* Take the first rows of the index again after stocks were listed or delisted */
+static void collectRows(void) {
+
+    StockNode* node;
+
+    showCache.shape = __atomic_load_n(&indexShape, __ATOMIC_SEQ_CST);
+    showCache.nrows = 0;
+    for (node = __atomic_load_n(&head->next[0], __ATOMIC_ACQUIRE);
+         node && showCache.nrows < SHOW_ROWS_MAX;
+         node = __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE)) {
+        if (__atomic_load_n(&node->removed, __ATOMIC_RELAXED))
+            continue;
+        showCache.rows[showCache.nrows].node = node;
+        showCache.rows[showCache.nrows].len = 0;
+        showCache.nrows++;
+    }
+}
+
+/*
+ * Re-render changed rows and patch the shared reply; called with
+ * showCache.build held from inside an ebr section. Rows hold node pointers
+ * across requests, so they are only dereferenced once indexShape shows no
+ * stock was listed or delisted since they were collected. The scan is
+ * retried while writes overlap it, up to
+ * SNAPSHOT_RETRIES times, after which the reply is still consistent per row
+ * but is published as stale. Returns true if it is consistent table-wide.
+ */
+static bool showCacheRefresh(void) {
+
+    unsigned long started, finished;
+    int attempt, i, len, first = -1;
+    bool consistent = false, rebuild = false;
+
+    if (!showCache.rows)
+        showCache.rows = Calloc(SHOW_ROWS_MAX, sizeof(showRow));
+
+    for (attempt = 0; attempt < SNAPSHOT_RETRIES && !consistent; attempt++) {
+        finished = __atomic_load_n(&tableEpoch.finished, __ATOMIC_ACQUIRE);
+        started = __atomic_load_n(&tableEpoch.started, __ATOMIC_ACQUIRE);
+        if (showCache.shape != __atomic_load_n(&indexShape, __ATOMIC_SEQ_CST)) {
+            collectRows();
+            rebuild = true;
+        }
+
+        for (i = 0; i < showCache.nrows; i++) {
+            showRow* row = &showCache.rows[i];
+            int amount, price;
+
+            stockRead(&row->node->stockItem, &amount, &price);
+            if (row->len && amount == row->amount && price == row->price)
+                continue;
+            row->amount = amount;
+            row->price = price;
+            row->len = sprintf(row->text, "%d %d %d\n", row->node->stockItem.id, amount, price);
+            if (first < 0 || i < first)
+                first = i;
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        consistent = started == finished
+                     && __atomic_load_n(&tableEpoch.started, __ATOMIC_RELAXED) == started;
+    }
+
+    pthread_rwlock_wrlock(&showCache.lock);
+    if (rebuild || (first >= 0 && showCache.rows[first].off >= 0)) {
+        if (rebuild) {
+            first = 0;
+            len = 0;
+        }
+        else {
+            /* Rows before first are unchanged and so is everything up to its offset */
+            len = showCache.rows[first].off;
+        }
+        for (i = first; i < showCache.nrows; i++) {
+            showRow* row = &showCache.rows[i];
+            if (len >= MAXLINE - SHOW_ROW_MAX) {
+                row->off = -1;
+                continue;
+            }
+            row->off = len;
+            memcpy(showCache.buf + len, row->text, row->len);
+            len += row->len;
+        }
+        if (len < showCache.len)
+            memset(showCache.buf + len, '\0', showCache.len - len);
+        showCache.len = len;
+    }
+    __atomic_store_n(&showCache.gen, consistent ? finished + 1 : 0, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&showCache.lock);
+
+    return consistent;
+}
+
+/*
+ * Copy the table as of a single instant into newBuf (MAXLINE bytes).
+ * Returns false if writes kept overlapping the refresh, in which case the
+ * reply is only consistent per row.
+ */
+bool createSnapshotString(char* newBuf) {
+
+    unsigned long finished = __atomic_load_n(&tableEpoch.finished, __ATOMIC_ACQUIRE);
+    bool consistent = true;
+
+    if (__atomic_load_n(&showCache.gen, __ATOMIC_ACQUIRE) != finished + 1
+        || __atomic_load_n(&tableEpoch.started, __ATOMIC_ACQUIRE) != finished) {
+        pthread_mutex_lock(&showCache.build);
+        finished = __atomic_load_n(&tableEpoch.finished, __ATOMIC_ACQUIRE);
+        if (showCache.gen != finished + 1
+            || __atomic_load_n(&tableEpoch.started, __ATOMIC_ACQUIRE) != finished)
+            consistent = showCacheRefresh();
+        pthread_mutex_unlock(&showCache.build);
+    }
+
+    pthread_rwlock_rdlock(&showCache.lock);
+    memcpy(newBuf, showCache.buf, MAXLINE);
+    pthread_rwlock_unlock(&showCache.lock);
+
+    return consistent;
+}
+
+/* Called inside an ebr section */
+void writeTable(FILE* fp) {
+
+    StockNode* node;
+    int amount, price;
+
+    for (node = __atomic_load_n(&head->next[0], __ATOMIC_ACQUIRE); node;
+         node = __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE)) {
+        if (__atomic_load_n(&node->removed, __ATOMIC_RELAXED))
+            continue;
+        stockRead(&node->stockItem, &amount, &price);
+        fprintf(fp, "%d %d %d\n", node->stockItem.id, amount, price);
+    }
+}
+
+/*
+ * Let the connections finish what they sent, closing those still open
+ * after restart_drain_ms, then send the successor the sockets and the table
+ * and exit. Keeps mutex to the end, so no disconnect saves stock.txt or the
+ * accounts after this server's last save. If the successor is gone by then,
+ * the table goes to stock.txt instead, so the drain's trades survive.
+ */
+void handOver(int listenfd, int unixfd) {
+
+    struct timespec tick = { 0, 1000000L };
+    restart_image_t img;
+    StockNode* node;
+    FILE* fp;
+    int fds[RESTART_MAX_FDS], nfds = 0, waited, amount, price;
+
+    LOG_TEXT(LOG_LVL_INFO, "handing over, draining %d connections",
+             __atomic_load_n(&connCount, __ATOMIC_RELAXED));
+    drainConnections(SHUT_RD);
+    for (waited = 0; __atomic_load_n(&connCount, __ATOMIC_ACQUIRE) > 0; waited++) {
+        if (waited == restart_drain_ms)
+            drainConnections(SHUT_RDWR);
+        nanosleep(&tick, NULL);
+    }
+
+    LP_P(&mutex, LK_GLOBAL, -1);
+    if (acct_save(ACCT_FILE) < 0)
+        fprintf(stderr, "The file (%s) could not be written. \n", ACCT_FILE);
+    restart_image_open(&img);
+    ebr_enter();
+    for (node = __atomic_load_n(&head->next[0], __ATOMIC_ACQUIRE); node;
+         node = __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE)) {
+        if (__atomic_load_n(&node->removed, __ATOMIC_RELAXED))
+            continue;
+        stockRead(&node->stockItem, &amount, &price);
+        restart_image_add(&img, node->stockItem.id, amount, price);
+    }
+    ebr_exit();
+    fds[nfds++] = listenfd;
+    if (unixfd >= 0)
+        fds[nfds++] = unixfd;
+    if (restart_handover(__atomic_load_n(&successorFd, __ATOMIC_ACQUIRE), fds, nfds, &img) < 0) {
+        /* The drain skipped the disconnect saves; keep its trades for a cold start */
+        LOG_TEXT(LOG_LVL_ERROR, "successor gone, %ld stocks saved to stock.txt", img.rows);
+        if (!(fp = fopen("stock.txt", "w"))) {
+            fprintf(stderr, "The file (stock.txt) does not exist. \n");
+        }
+        else {
+            ebr_enter();
+            writeTable(fp);
+            ebr_exit();
+            fclose(fp);
+        }
+    }
+    else
+        LOG_TEXT(LOG_LVL_INFO, "handed over %ld stocks", img.rows);
+    exit(0);
+}
+
+/* Geometric level with p = 1/4 */
+static int randomLevel(void) {
+
+    static __thread unsigned long long rng = 0;
+    unsigned long long r;
+    int level = 1;
+
+    if (!rng)
+        rng = (unsigned long long)(uintptr_t)&rng * 0x9e3779b97f4a7c15ULL | 1;
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    for (r = rng; level < SKIP_MAX_LEVEL && (r & 3) == 0; r >>= 2)
+        level++;
+    return level;
+}
+
+/* id INT_MIN makes the head sentinel, which has every level */
+StockNode* createNode(int id, int amount, int price) {
+
+    int level = id == INT_MIN ? SKIP_MAX_LEVEL : randomLevel();
+    StockNode* node = hp_alloc(&nodeArena, sizeof(StockNode) + level * sizeof(StockNode*));
+
+    if (!node) return NULL;
     node->stockItem.id = id;
     node->stockItem.amount = amount;
     node->stockItem.price = price;
-    node->left = node->right = NULL;
-    
-    node->stockItem.readcnt = 0;
-    Sem_init(&node->stockItem.mutex, 0, 1);
-    Sem_init(&node->stockItem.w, 0, 1);
+    node->level = level;
+
+    node->stockItem.seq = 0;
+    node->ext = NULL;
+    node->removed = 0;
 
     return node;
 }
 
-void deleteTree(TreeNode* node) {
+void freeNode(void* vp) {
+
+    StockNode* node = vp;
+
+    if (node->ext) {
+        book_destroy(node->ext->book);
+        free(node->ext->fc);
+        Free(node->ext);
+    }
+    hp_free(&nodeArena, node, sizeof(StockNode) + node->level * sizeof(StockNode*));
+}
+
+/* First stock with an id >= targetId; lock-free, inside an ebr section */
+static StockNode* findFrom(int targetId) {
+
+    StockNode *node = head, *next;
+    int i;
+
+    for (i = __atomic_load_n(&indexLevel, __ATOMIC_ACQUIRE) - 1; i >= 0; i--)
+        while ((next = __atomic_load_n(&node->next[i], __ATOMIC_ACQUIRE))
+               && next->stockItem.id < targetId)
+            node = next;
+    return __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE);
+}
+
+/* Lock-free; the caller must be inside an ebr section */
+StockNode* findNode(int targetId) {
+
+    StockNode* node = findFrom(targetId);
+
+    return node && node->stockItem.id == targetId ? node : NULL;
+}
+
+/*
+ * findNode for n ids at once, inside one ebr section. One walk has to wait
+ * for each node before it knows the next, so the walks are interleaved
+ * instead: every round takes each unfinished walk one step, right or down,
+ * and prefetches the node it will compare next, which then arrives while
+ * the other walks take their step. nodes[k] is NULL for an id not listed.
+ */
+void findNodes(const int* ids, int n, StockNode** nodes) {
 
-    if (!node) return;
+    StockNode *cur[LOOKUP_BATCH], *next[LOOKUP_BATCH];
+    int level[LOOKUP_BATCH];
+    int k, base, m, active, top = __atomic_load_n(&indexLevel, __ATOMIC_ACQUIRE) - 1;
 
-    deleteTree(node->left);
-    deleteTree(node->right);
-    //printf("Delete node %d \n", node->stockItem.id);
-    free(node);
+    for (base = 0; base < n; base += LOOKUP_BATCH) {
+        m = n - base < LOOKUP_BATCH ? n - base : LOOKUP_BATCH;
+        for (k = 0; k < m; k++) {
+            cur[k] = head;
+            level[k] = top;
+            next[k] = __atomic_load_n(&head->next[top], __ATOMIC_ACQUIRE);
+            __builtin_prefetch(next[k]);
+        }
+        for (active = m; active; ) {
+            for (k = 0; k < m; k++) {
+                if (level[k] < 0) continue;
+                if (next[k] && next[k]->stockItem.id < ids[base + k]) {
+                    cur[k] = next[k];
+                }
+                else if (--level[k] < 0) {
+                    nodes[base + k] = next[k] && next[k]->stockItem.id == ids[base + k] ? next[k] : NULL;
+                    active--;
+                    continue;
+                }
+                next[k] = __atomic_load_n(&cur[k]->next[level[k]], __ATOMIC_ACQUIRE);
+                __builtin_prefetch(next[k]);
+            }
+        }
+    }
 }
 
-void addNodeToTree(TreeNode* node) {
+/* Last node before targetId on every level; called with indexLock held */
+static StockNode* findPreds(int targetId, StockNode** preds) {
+
+    StockNode *node = head, *next;
+    int i;
 
-    if (root == NULL) {
-        root = node;
-        return;
+    for (i = SKIP_MAX_LEVEL - 1; i >= 0; i--) {
+        while ((next = node->next[i]) && next->stockItem.id < targetId)
+            node = next;
+        preds[i] = node;
     }
+    return node->next[0];
+}
 
-    TreeNode* temp = root;
-    int newId = node->stockItem.id;
+/* Returns false if the id is already listed */
+bool insertNode(StockNode* node) {
 
-    while (true) {
-        
-        if (newId == temp->stockItem.id) {
-            printf("stock id: %d - already exists. \n", newId);
-            return;
+    StockNode* preds[SKIP_MAX_LEVEL];
+    StockNode* next;
+    int i;
+
+    pthread_mutex_lock(&indexLock);
+    next = findPreds(node->stockItem.id, preds);
+    if (next && next->stockItem.id == node->stockItem.id) {
+        pthread_mutex_unlock(&indexLock);
+        return false;
+    }
+
+    for (i = 0; i < node->level; i++)
+        node->next[i] = preds[i]->next[i];
+    __atomic_fetch_add(&tableEpoch.started, 1, __ATOMIC_ACQ_REL);
+    for (i = 0; i < node->level; i++)
+        __atomic_store_n(&preds[i]->next[i], node, __ATOMIC_RELEASE);
+    if (node->level > indexLevel)
+        __atomic_store_n(&indexLevel, node->level, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&indexShape, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&tableEpoch.finished, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&indexLock);
+
+    return true;
+}
+
+/*
+ * Unlink the stock and retire it. It is marked removed under its w first,
+ * so a trade that found it just before the unlink fails instead of
+ * updating a stock that is gone.
+ */
+bool removeNode(int targetId) {
+
+    StockNode* preds[SKIP_MAX_LEVEL];
+    StockNode* node;
+    int i;
+
+    pthread_mutex_lock(&indexLock);
+    node = findPreds(targetId, preds);
+    if (!node || node->stockItem.id != targetId) {
+        pthread_mutex_unlock(&indexLock);
+        return false;
+    }
+
+    LP_P(&stockLockOf(targetId)->w, LK_STOCK_W, targetId);
+    __atomic_store_n(&node->removed, 1, __ATOMIC_RELAXED);
+    LP_V(&stockLockOf(targetId)->w, LK_STOCK_W, targetId);
+
+    __atomic_fetch_add(&tableEpoch.started, 1, __ATOMIC_ACQ_REL);
+    for (i = node->level - 1; i >= 0; i--)
+        __atomic_store_n(&preds[i]->next[i], node->next[i], __ATOMIC_RELEASE);
+    __atomic_fetch_add(&indexShape, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&tableEpoch.finished, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&indexLock);
+
+    rankForget(node);
+    ebr_retire(node, freeNode);
+    return true;
+}
+
+void deleteIndex(void) {
+
+    StockNode *node, *next;
+
+    for (node = head; node; node = next) {
+        next = node->next[0];
+        freeNode(node);
+    }
+    head = NULL;
+}
+
+/*
+ * show <lo> <hi> into newBuf (MAXLINE bytes): the index is walked from the
+ * first id >= lo. Like a show refresh it is retried while writes overlap
+ * it and then settles for per-row consistency. Called inside an ebr section.
+ */
+bool showRange(int lo, int hi, char* newBuf) {
+
+    unsigned long started, finished;
+    StockNode* node;
+    int attempt, len = 0, amount, price;
+    bool consistent = false;
+
+    for (attempt = 0; attempt < SNAPSHOT_RETRIES && !consistent; attempt++) {
+        finished = __atomic_load_n(&tableEpoch.finished, __ATOMIC_ACQUIRE);
+        started = __atomic_load_n(&tableEpoch.started, __ATOMIC_ACQUIRE);
+
+        len = 0;
+        for (node = findFrom(lo); node && node->stockItem.id <= hi && len < MAXLINE - SHOW_ROW_MAX;
+             node = __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE)) {
+            if (__atomic_load_n(&node->removed, __ATOMIC_RELAXED))
+                continue;
+            stockRead(&node->stockItem, &amount, &price);
+            len += sprintf(newBuf + len, "%d %d %d\n", node->stockItem.id, amount, price);
         }
 
-        if (newId < temp->stockItem.id) {
-            if (temp->left == NULL) {
-                temp->left = node;
-                break;
-            }
-            else {
-                temp = temp->left;
-            }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        consistent = started == finished
+                     && __atomic_load_n(&tableEpoch.started, __ATOMIC_RELAXED) == started;
+    }
+    memset(newBuf + len, '\0', MAXLINE - len);
+    return consistent;
+}
+
+/*
+ * top is served from one rank index per value, under rankLock. The indexes
+ * are built by the first top and kept up to date from then on, so until
+ * someone asks, trades pay one load for them. A writer touches the stock
+ * after releasing its w and moves the entries to the values it reads then,
+ * so they may briefly lag a trade but never settle behind the last one.
+ * The build holds indexLock and takes each stock's w while adding it: a
+ * stock listed or traded meanwhile is either seen by the build or its
+ * writer sees rankOn and touches it afterwards.
+ */
+static rank_t ranks[RANK_NKEYS];
+static int rankOn = 0;
+
+/* Bring the stock's entries up to its amount and price; no w may be held */
+void rankTouch(StockNode* node) {
+
+    stock* item = &node->stockItem;
+    stockExt* ext;
+    int value[RANK_NKEYS];
+    int k;
+
+    if (!__atomic_load_n(&rankOn, __ATOMIC_ACQUIRE)) return;
+    LP_P(&rankLock, LK_RANK, -1);
+    /* Delisting marks the node before it drops the entries, under this lock */
+    if (!__atomic_load_n(&node->removed, __ATOMIC_RELAXED)) {
+        stockRead(item, &value[RANK_AMOUNT], &value[RANK_PRICE]);
+        ext = stockExtOf(node);
+        for (k = 0; k < RANK_NKEYS; k++) {
+            if (ext->rank[k])
+                rank_move(&ranks[k], ext->rank[k], value[k]);
+            else
+                ext->rank[k] = rank_insert(&ranks[k], item->id, value[k], node);
         }
-        else {
-            if (temp->right == NULL) {
-                temp->right = node;
-                break;
-            }
-            else {
-                temp = temp->right;
-            }
+    }
+    LP_V(&rankLock, LK_RANK, -1);
+}
+
+/* Drop a delisted stock's entries before it is retired */
+void rankForget(StockNode* node) {
+
+    stockExt* ext;
+    int k;
+
+    if (!__atomic_load_n(&rankOn, __ATOMIC_ACQUIRE)) return;
+    LP_P(&rankLock, LK_RANK, -1);
+    /* Under the lock, so a rankTouch past its removed check has finished */
+    ext = __atomic_load_n(&node->ext, __ATOMIC_ACQUIRE);
+    for (k = 0; ext && k < RANK_NKEYS; k++) {
+        if (ext->rank[k]) {
+            rank_remove(&ranks[k], ext->rank[k]);
+            ext->rank[k] = NULL;
         }
     }
+    LP_V(&rankLock, LK_RANK, -1);
+}
+
+/* Called with rankLock held */
+static void rankBuild(void) {
 
-    return;
+    StockNode* node;
+    stockLock* lk;
+    stockExt* ext;
+    stock* item;
+    int k;
+
+    for (k = 0; k < RANK_NKEYS; k++)
+        rank_init(&ranks[k]);
+    pthread_mutex_lock(&indexLock);
+    __atomic_store_n(&rankOn, 1, __ATOMIC_RELEASE);
+    for (node = head->next[0]; node; node = node->next[0]) {
+        item = &node->stockItem;
+        lk = stockLockOf(item->id);
+        LP_P(&lk->w, LK_STOCK_W, item->id);
+        if (!node->removed) {
+            ext = stockExtOf(node);
+            ext->rank[RANK_AMOUNT] = rank_insert(&ranks[RANK_AMOUNT], item->id, item->amount, node);
+            ext->rank[RANK_PRICE] = rank_insert(&ranks[RANK_PRICE], item->id, item->price, node);
+        }
+        LP_V(&lk->w, LK_STOCK_W, item->id);
+    }
+    pthread_mutex_unlock(&indexLock);
+}
+
+/*
+ * top <n> amount|price: the n stocks with the most, ties by id, cut like
+ * show. The order is the index's; each row is read like a show row.
+ */
+bool showTop(int n, int key, const int connfd) {
+
+    char buf[MAXLINE];
+    rank_node_t* e;
+    StockNode* node;
+    int len = 0, amount, price;
+
+    memset(buf, '\0', sizeof(buf));
+    LP_P(&rankLock, LK_RANK, -1);
+    if (!rankOn)
+        rankBuild();
+    for (e = rank_first(&ranks[key]); e && n-- > 0 && len < MAXLINE - SHOW_ROW_MAX; e = rank_next(e)) {
+        node = e->item;
+        stockRead(&node->stockItem, &amount, &price);
+        len += sprintf(buf + len, "%d %d %d\n", node->stockItem.id, amount, price);
+    }
+    LP_V(&rankLock, LK_RANK, -1);
+    stats_lap(PH_LOOKUP);
+    shm_reply(connfd, buf);
+    stats_lap(PH_WRITE);
+
+    return true;
+}
+
+bool listStock(int targetId, int amount, int price, const int connfd) {
+
+    char buf[MAXLINE];
+    StockNode* node = NULL;
+    bool listed = false;
+
+    if (targetId != INT_MIN && amount >= 0 && price >= 0
+        && (node = createNode(targetId, amount, price)) != NULL)
+        listed = insertNode(node);
+    if (listed)
+        rankTouch(node);
+    else if (node)
+        freeNode(node);
+
+    sprintf(buf, listed ? "[list] success\n" : "Not listed\n");
+    shm_reply(connfd, buf);
+    return listed;
+}
+
+bool delistStock(int targetId, const int connfd) {
+
+    char buf[MAXLINE];
+    bool removed = removeNode(targetId);
+
+    sprintf(buf, removed ? "[delist] success\n" : "No such stock\n");
+    shm_reply(connfd, buf);
+    return removed;
 }
 
 /* Create an empty, bounded, shared FIFO buffer with n slots */
@@ -243,28 +1368,31 @@ void sbuf_deinit(sbuf_t *sp) {
 /* Insert item onto the rear of shared buffer sp */
 void sbuf_insert(sbuf_t *sp, int item) {
 
-    P(&sp->slots);                          /* Wait for available slot */
-    P(&sp->mutex);                          /* Lock the buffer */
-    sp->buf[(++sp->rear) % (sp->n)] = item; /* Insert the item */
-    V(&sp->mutex);                          /* Unlock the buffer */
-    V(&sp->items);                          /* Announce available item */
+    LP_P(&sp->slots, LK_SBUF_SLOTS, -1);        /* Wait for available slot */
+    LP_P(&sp->mutex, LK_SBUF_MUTEX, -1);        /* Lock the buffer */
+    sp->buf[(++sp->rear) % (sp->n)] = item;     /* Insert the item */
+    LP_V(&sp->mutex, LK_SBUF_MUTEX, -1);        /* Unlock the buffer */
+    LP_V(&sp->items, LK_SBUF_ITEMS, -1);        /* Announce available item */
 }
 
 /* Remove and return the first item from buffer sp */
 int sbuf_remove(sbuf_t *sp) {
 
     int item;                               
-    P(&sp->items);                              /* Wait for available item */
-    P(&sp->mutex);                              /* Lock the buffer */
+    LP_P(&sp->items, LK_SBUF_ITEMS, -1);        /* Wait for available item */
+    LP_P(&sp->mutex, LK_SBUF_MUTEX, -1);        /* Lock the buffer */
     item = sp->buf[(++sp->front) % (sp->n)];    /* Remove the item */    
-    V(&sp->mutex);                              /* Unlock the buffer */
-    V(&sp->slots);                              /* Announce available slot */
+    LP_V(&sp->mutex, LK_SBUF_MUTEX, -1);        /* Unlock the buffer */
+    LP_V(&sp->slots, LK_SBUF_SLOTS, -1);        /* Announce available slot */
 
     return item;
 }
 
 void *thread(void *vargp) {
 
+    /* Carved here so the buffer lands on this worker's node */
+    rio_t* rp = hp_carve(&connArena[hp_node()], sizeof(rio_t));
+
     Pthread_detach(pthread_self());
 
     while (1) {
@@ -275,13 +1403,20 @@ void *thread(void *vargp) {
         //P(&mutex);
         //sem_getvalue(&mutex, &val);
         //printf("\nAction mutex val: %d \n", val);
-        echo(connfd);                       /* Service client */
+        echo(connfd, rp);                   /* Service client */
         //V(&mutex);
 
         Close(connfd);
+        __atomic_fetch_sub(&connCount, 1, __ATOMIC_RELEASE);
+
+        /* A server handing over saves once its connections are gone, see handOver */
+        if (__atomic_load_n(&successorFd, __ATOMIC_ACQUIRE) >= 0) {
+            ebr_reclaim();
+            continue;
+        }
         
         /* File (stock.txt) write start */
-        P(&mutex);
+        LP_P(&mutex, LK_GLOBAL, -1);
         writeCnt++;
         
         FILE* fp = fopen("stock.txt", "w");
@@ -289,13 +1424,15 @@ void *thread(void *vargp) {
             fprintf(stderr, "The file (stock.txt) does not exist. \n");
         }
         else {
-            char res[MAXLINE] = {0};
-            createResultString(root, res);
-            fprintf(fp, "%s", res);
-            
+            ebr_enter();
+            writeTable(fp);
+            ebr_exit();
             fclose(fp);
         }
-        V(&mutex);
+        if (acct_save(ACCT_FILE) < 0)
+            fprintf(stderr, "The file (%s) could not be written. \n", ACCT_FILE);
+        LP_V(&mutex, LK_GLOBAL, -1);
         /* File write end */
+        ebr_reclaim();
     }
 }
@@ -0,0 +1,268 @@
+/*
+ * tlbbench.c - stock table placement microbenchmark
+ *
+ * Builds a table of stock nodes shaped like task1's binary search tree,
+ * inserted in random id order, once per allocation mode of hp.c, and times
+ * random buy/sell style lookups and show style in-order scans over it. In
+ * a running server the nodes are allocated among order books, buffers and
+ * strings, so between nodes the benchmark also allocates filler blocks of
+ * random size that stay live; malloc scatters the nodes between them while
+ * the arenas keep the nodes together.
+ *
+ * dTLB load misses are counted with perf_event_open where the kernel
+ * allows it, and the huge pages the process actually got are read back
+ * from /proc/self/smaps_rollup, so a fallback from MAP_HUGETLB to THP (or
+ * to no huge pages at all) shows up in the output.
+ */
+#include "csapp.h"
+#include "hp.h"
+#include "hist.h"
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define SAMPLE_MASK 15		/* Time one lookup in 16 */
+#define SCANS 5
+
+typedef struct _node_ {
+	int id;
+	int price;
+	int amount;
+	void *book;
+	struct _node_ *left;
+	struct _node_ *right;
+	int dirty;
+} node_t;			/* Same layout as task1's TreeNode */
+
+typedef struct {
+	long stocks;
+	long lookups;
+	int filler;		/* Largest filler block between nodes, 0 for none */
+	uint64_t seed;
+	int modes;		/* Bit per HP_* mode to run */
+	int csv;
+} config_t;
+
+static config_t cfg = { 1000000, 5000000, 256, 1, 7, 0 };
+static volatile long sink;	/* Keeps the scans from being optimized out */
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t next_rand(uint64_t *s)
+{
+	uint64_t z = (*s += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-n stocks] [-l lookups] [-f max_filler] [-m malloc,thp,hugetlb]\n"
+		"       [-s seed] [-c]\n", prog);
+	exit(1);
+}
+
+/* dTLB read misses of this thread in user space, -1 if not allowed */
+static int tlb_open(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+		      | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long tlb_read(int fd)
+{
+	long long v;
+
+	if (fd < 0 || read(fd, &v, sizeof(v)) != sizeof(v))
+		return -1;
+	return v;
+}
+
+/* Huge page kB of the process: transparent plus hugetlb */
+static long huge_kb(void)
+{
+	char line[256];
+	long kb, total = 0;
+	FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+
+	if (!fp)
+		return -1;
+	while (fgets(line, sizeof(line), fp))
+		if ((sscanf(line, "AnonHugePages: %ld", &kb) == 1)
+		    || (sscanf(line, "Private_Hugetlb: %ld", &kb) == 1))
+			total += kb;
+	fclose(fp);
+	return total;
+}
+
+static node_t *insert(node_t *root, node_t *node)
+{
+	node_t **link = &root;
+
+	while (*link)
+		link = node->id < (*link)->id ? &(*link)->left : &(*link)->right;
+	*link = node;
+	return root;
+}
+
+static long scan(node_t *node)
+{
+	long sum = 0;
+
+	while (node) {		/* Recurse left, loop right */
+		sum += scan(node->left) + node->amount;
+		node = node->right;
+	}
+	return sum;
+}
+
+static void run(int mode, const int *order, const int *keys)
+{
+	static const char *name[] = { "malloc", "thp", "hugetlb" };
+	hp_arena_t arena;
+	hist_t *lat = Calloc(1, sizeof(hist_t));
+	void **filler = Calloc(cfg.stocks, sizeof(void *));
+	node_t *root = NULL, *node;
+	uint64_t rng = cfg.seed, t0, t1, s;
+	long i, sum = 0, tlb0, tlb1, tlb2, huge = huge_kb();
+	double lookup_ns, scan_ms;
+	int fd;
+
+	hp_mode = mode;
+	hp_arena_init(&arena, HP_LOCAL);
+	for (i = 0; i < cfg.stocks; i++) {
+		node = hp_alloc(&arena, sizeof(node_t));
+		node->id = order[i];
+		node->amount = 100;
+		root = insert(root, node);
+		if (cfg.filler)
+			filler[i] = Malloc(1 + next_rand(&rng) % cfg.filler);
+	}
+	huge = huge_kb() - huge;
+
+	fd = tlb_open();
+	if (fd >= 0)
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	tlb0 = tlb_read(fd);
+	t0 = now_ns();
+	for (i = 0; i < cfg.lookups; i++) {
+		s = (i & SAMPLE_MASK) ? 0 : now_ns();
+		node = root;
+		while (node && node->id != keys[i])
+			node = keys[i] < node->id ? node->left : node->right;
+		if (node)
+			node->amount += (i & 1) ? 1 : -1;
+		if (s)
+			hist_record(lat, now_ns() - s);
+	}
+	t1 = now_ns();
+	tlb1 = tlb_read(fd);
+	lookup_ns = (double)(t1 - t0) / cfg.lookups;
+
+	t0 = now_ns();
+	for (i = 0; i < SCANS; i++)
+		sum += scan(root);
+	t1 = now_ns();
+	tlb2 = tlb_read(fd);
+	scan_ms = (t1 - t0) / 1e6 / SCANS;
+	sink = sum;
+	if (fd >= 0)
+		close(fd);
+
+	if (cfg.csv) {
+		printf("%s,%ld,%.1f,%lu,%lu,%.2f,%.3f,%.3f,%ld\n", name[mode], cfg.stocks, lookup_ns,
+		       (unsigned long)hist_percentile(lat, 0.50),
+		       (unsigned long)hist_percentile(lat, 0.99),
+		       fd < 0 ? -1.0 : (double)(tlb1 - tlb0) / cfg.lookups, scan_ms,
+		       fd < 0 ? -1.0 : (double)(tlb2 - tlb1) / SCANS / cfg.stocks, huge);
+	} else {
+		printf("%-8s lookup %6.1f ns (p50 %lu p99 %lu)", name[mode], lookup_ns,
+		       (unsigned long)hist_percentile(lat, 0.50),
+		       (unsigned long)hist_percentile(lat, 0.99));
+		if (fd >= 0)
+			printf("  %.2f dTLB misses", (double)(tlb1 - tlb0) / cfg.lookups);
+		printf("\n         scan %8.2f ms", scan_ms);
+		if (fd >= 0)
+			printf("  %.3f dTLB misses/node", (double)(tlb2 - tlb1) / SCANS / cfg.stocks);
+		printf("  huge pages %ld kB\n", huge);
+	}
+
+	for (i = 0; i < cfg.stocks; i++)
+		free(filler[i]);
+	Free(filler);
+	Free(lat);
+}
+
+int main(int argc, char **argv)
+{
+	int *order, *keys;
+	uint64_t rng;
+	long i, j;
+	int c, t;
+	char *tok;
+
+	while ((c = getopt(argc, argv, "n:l:f:m:s:c")) != -1) {
+		switch (c) {
+		case 'n': cfg.stocks = atol(optarg); break;
+		case 'l': cfg.lookups = atol(optarg); break;
+		case 'f': cfg.filler = atoi(optarg); break;
+		case 'm':
+			cfg.modes = 0;
+			for (tok = strtok(optarg, ","); tok; tok = strtok(NULL, ","))
+				cfg.modes |= !strcmp(tok, "malloc") ? 1 << HP_OFF
+					   : !strcmp(tok, "thp") ? 1 << HP_THP
+					   : !strcmp(tok, "hugetlb") ? 1 << HP_HUGETLB : 0;
+			break;
+		case 's': cfg.seed = strtoull(optarg, NULL, 10); break;
+		case 'c': cfg.csv = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (cfg.stocks <= 0 || cfg.lookups <= 0 || cfg.filler < 0 || !cfg.modes)
+		usage(argv[0]);
+	hp_config();
+
+	/* Ids 1..stocks in random insertion order, and the ids to look up */
+	order = Malloc(cfg.stocks * sizeof(int));
+	keys = Malloc(cfg.lookups * sizeof(int));
+	rng = cfg.seed;
+	for (i = 0; i < cfg.stocks; i++)
+		order[i] = i + 1;
+	for (i = cfg.stocks - 1; i > 0; i--) {
+		j = next_rand(&rng) % (i + 1);
+		t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+	for (i = 0; i < cfg.lookups; i++)
+		keys[i] = next_rand(&rng) % cfg.stocks + 1;
+
+	if (!cfg.csv)
+		printf("%ld stocks, %ld lookups, filler up to %d bytes between nodes\n",
+		       cfg.stocks, cfg.lookups, cfg.filler);
+	/* mode,stocks,lookup_ns,p50_ns,p99_ns,dtlb_per_lookup,scan_ms,dtlb_per_node,huge_kb */
+	for (t = HP_OFF; t <= HP_HUGETLB; t++)
+		if (cfg.modes & (1 << t))
+			run(t, order, keys);
+	Free(order);
+	Free(keys);
+	return 0;
+}
@@ -0,0 +1,166 @@
+/*
+ * tw.c - hierarchical timer wheel
+ */
+/* $begin tw.c */
+#include "csapp.h"
+#include "tw.h"
+#include <time.h>
+
+#define TW_MASK (TW_SLOTS - 1)
+
+int tw_idle_ms = TW_IDLE_MS;
+int tw_header_ms = TW_HEADER_MS;
+int tw_write_ms = TW_WRITE_MS;
+const char *tw_kind_name[] = { "idle", "header", "write" };
+
+static void config_one(const char *name, int *ms) {
+
+    char *v = getenv(name);
+
+    if (v && *v)
+        *ms = atoi(v) * 1000;
+}
+
+/* Read the timeout overrides from the environment */
+void tw_config(void) {
+
+    config_one("STOCK_IDLE_TIMEOUT", &tw_idle_ms);
+    config_one("STOCK_HEADER_TIMEOUT", &tw_header_ms);
+    config_one("STOCK_WRITE_TIMEOUT", &tw_write_ms);
+}
+
+/* Configured timeout for a TMO_* kind, 0 if disabled */
+int tw_timeout_ms(int kind) {
+
+    int ms = kind == TMO_IDLE ? tw_idle_ms : kind == TMO_HEADER ? tw_header_ms : tw_write_ms;
+
+    return ms > 0 ? ms : 0;
+}
+
+uint64_t tw_now_ms(void) {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void tw_init(tw_t *w, uint64_t now_ms) {
+
+    memset(w, 0, sizeof(*w));
+    w->tick = now_ms / TW_TICK_MS;
+}
+
+/* Link t into the slot its expiry falls in, relative to the current tick */
+static void place(tw_t *w, tw_timer_t *t) {
+
+    uint64_t delta;
+    tw_timer_t **head;
+    int level;
+
+    if (t->expires < w->tick)
+        t->expires = w->tick;
+    delta = t->expires - w->tick;
+    for (level = 0; level < TW_LEVELS - 1; level++)
+        if (delta < (1ULL << (TW_BITS * (level + 1))))
+            break;
+    if (delta >= (1ULL << (TW_BITS * TW_LEVELS)))
+        t->expires = w->tick + (1ULL << (TW_BITS * TW_LEVELS)) - 1;
+
+    head = &w->slot[level][(t->expires >> (TW_BITS * level)) & TW_MASK];
+    t->next = *head;
+    if (t->next)
+        t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+}
+
+static void unlink_timer(tw_timer_t *t) {
+
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->pprev = NULL;
+}
+
+/* (Re)arm t to fire once the clock reaches when_ms */
+void tw_add(tw_t *w, tw_timer_t *t, uint64_t when_ms) {
+
+    if (tw_pending(t))
+        unlink_timer(t);
+    else
+        w->count++;
+    t->expires = (when_ms + TW_TICK_MS - 1) / TW_TICK_MS;
+    place(w, t);
+}
+
+void tw_del(tw_t *w, tw_timer_t *t) {
+
+    if (!tw_pending(t))
+        return;
+    unlink_timer(t);
+    w->count--;
+}
+
+/* Move the timers of a higher-level slot down to where they now belong */
+static void cascade(tw_t *w, int level, int idx) {
+
+    tw_timer_t *t = w->slot[level][idx], *next;
+
+    w->slot[level][idx] = NULL;
+    for (; t; t = next) {
+        next = t->next;
+        place(w, t);
+    }
+}
+
+/*
+ * Run every tick up to now_ms and call fire for each timer that expires.
+ * fire may add or delete any timer, including the one it was called for.
+ */
+void tw_advance(tw_t *w, uint64_t now_ms, void (*fire)(tw_timer_t *t)) {
+
+    uint64_t target = now_ms / TW_TICK_MS;
+    tw_timer_t *list, *t;
+    int idx, level;
+
+    while (w->tick <= target) {
+        idx = w->tick & TW_MASK;
+        if (!idx) {
+            for (level = 1; level < TW_LEVELS; level++) {
+                int i = (w->tick >> (TW_BITS * level)) & TW_MASK;
+                cascade(w, level, i);
+                if (i) break;
+            }
+        }
+        w->tick++;
+
+        /* Detach the slot so timers re-armed by fire land in a later one */
+        list = w->slot[0][idx];
+        w->slot[0][idx] = NULL;
+        if (list)
+            list->pprev = &list;
+        while ((t = list) != NULL) {
+            unlink_timer(t);
+            w->count--;
+            fire(t);
+        }
+    }
+}
+
+/* Milliseconds until tw_advance next has work to do, -1 if nothing is pending */
+long tw_next_ms(tw_t *w, uint64_t now_ms) {
+
+    uint64_t at, wrap;
+
+    if (!w->count)
+        return -1;
+    /* A cascade can bring down timers due before anything now on level 0 */
+    wrap = (w->tick + TW_MASK) & ~(uint64_t)TW_MASK;
+    for (at = w->tick; at < wrap; at++)
+        if (w->slot[0][at & TW_MASK])
+            break;
+    at *= TW_TICK_MS;
+    return at > now_ms ? (long)(at - now_ms) : 0;
+}
+/* $end tw.c */